@@ -1,9 +1,19 @@
 #include <algorithm>
 #include <cassert>
+#include <cctype>
 #include <csignal>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
 #include <iostream>
 #include <map>
+#include <set>
+#include <sstream>
 #include <string>
+#include <vector>
+
+#include <time.h>
+#include <zstd.h>
 
 typedef void (*sighandler_t)(int sig);
 
@@ -11,16 +21,87 @@ typedef void (*sighandler_t)(int sig);
 #include "impl_zmq.h"
 #include "services.h"
 
+// usage: bridge [--batch] [--zstd] [--flush-ms N]   forward msgq to zmq
+//        bridge [--batch] ip whitelist             republish zmq as msgq, whitelist is comma separated
+//
+// With --batch all messages of a service that arrive within flush-ms are sent as one
+// framed batch, --zstd additionally compresses it. Batches go out on the service's port
+// + BATCH_PORT_OFFSET, so plain zmq subscribers on the regular ports never see them. The
+// republishing side needs --batch to subscribe to the batch ports.
+
+#define BATCH_MAGIC 0x48435442 // "BTCH"
+#define BATCH_ZSTD 1
+#define BATCH_MAX_MSGS 1024
+#define BATCH_MAX_BYTES (512 * 1024)
+// A batch holds up to BATCH_MAX_BYTES, or one message larger than that. msgq fits at
+// least three messages in a ring, so this is above any single message.
+#define BATCH_MAX_RAW_SIZE (64 * 1024 * 1024)
+#define BATCH_PORT_OFFSET 10000
+#define STATS_INTERVAL_NS (5 * 1000000000ULL)
+
+struct BatchHeader {
+  uint32_t magic;
+  uint32_t flags;
+  uint32_t num_msgs;
+  uint32_t raw_size; // size of the uncompressed payload
+};
+// payload: num_msgs times [uint32_t size][data]
+
+struct Batch {
+  PubSocket *pub_sock;
+  MessageArena arena;
+  size_t bytes = 0;
+  uint64_t first_ns = 0; // arrival of the oldest message in the batch
+};
+
+struct BridgeStats {
+  uint64_t start_ns = 0;
+  uint64_t msgs = 0, frames = 0;
+  uint64_t raw_bytes = 0, wire_bytes = 0;
+  uint64_t delay_sum_ns = 0, delay_max_ns = 0;
+
+  void report(uint64_t now) {
+    double dt = (now - start_ns) * 1e-9;
+    if (dt < STATS_INTERVAL_NS * 1e-9) return;
+
+    printf("bridge: %.1f msg/s, %.1f frames/s, %.1f KB/s raw, %.1f KB/s wire", msgs / dt, frames / dt, raw_bytes * 1e-3 / dt, wire_bytes * 1e-3 / dt);
+    if (frames > 0 && delay_max_ns > 0) {
+      printf(", batch delay avg %.2f ms max %.2f ms", delay_sum_ns * 1e-6 / frames, delay_max_ns * 1e-6);
+    }
+    printf("\n");
+    fflush(stdout);
+    *this = BridgeStats{.start_ns = now};
+  }
+};
+
+static inline uint64_t nanos_since_boot() {
+  struct timespec t;
+  clock_gettime(CLOCK_MONOTONIC, &t);
+  return t.tv_sec * 1000000000ULL + t.tv_nsec;
+}
+
 void sigpipe_handler(int sig) {
   assert(sig == SIGPIPE);
   std::cout << "SIGPIPE received" << std::endl;
 }
 
-static std::vector<std::string> get_services(std::string whitelist_str, bool zmq_to_msgq) {
+static std::set<std::string> parse_whitelist(const std::string &whitelist_str) {
+  std::set<std::string> whitelist;
+  std::string name;
+  std::stringstream ss(whitelist_str);
+  while (std::getline(ss, name, ',')) {
+    name.erase(std::remove_if(name.begin(), name.end(), ::isspace), name.end());
+    if (!name.empty()) whitelist.insert(name);
+  }
+  return whitelist;
+}
+
+static std::vector<std::string> get_services(const std::string &whitelist_str, bool zmq_to_msgq) {
+  std::set<std::string> whitelist = parse_whitelist(whitelist_str);
   std::vector<std::string> service_list;
   for (const auto& it : services) {
     std::string name = it.name;
-    bool in_whitelist = whitelist_str.find(name) != std::string::npos;
+    bool in_whitelist = whitelist.count(name) > 0;
     if (name == "plusFrame" || name == "uiLayoutState" || (zmq_to_msgq && !in_whitelist)) {
       continue;
     }
@@ -29,12 +110,211 @@ static std::vector<std::string> get_services(std::string whitelist_str, bool zmq
   return service_list;
 }
 
+static int batch_port(const std::string &endpoint) {
+  for (const auto& it : services) {
+    if (endpoint == it.name) return it.port + BATCH_PORT_OFFSET;
+  }
+  assert(false);
+  return -1;
+}
+
+static void flush_batch(Batch &b, std::vector<char> &raw, std::vector<char> &frame, ZSTD_CCtx *cctx, BridgeStats &stats, uint64_t now) {
+  if (b.arena.size() == 0) return;
+
+  raw.clear();
+  for (size_t i = 0; i < b.arena.size(); i++) {
+    uint32_t size = b.arena.getSize(i);
+    raw.insert(raw.end(), (const char *)&size, (const char *)&size + sizeof(size));
+    raw.insert(raw.end(), b.arena.getData(i), b.arena.getData(i) + size);
+  }
+
+  if (raw.size() > BATCH_MAX_RAW_SIZE) {
+    std::cout << "bridge: dropping batch of " << raw.size() << " bytes, the receiver would reject it" << std::endl;
+    b.arena.clear();
+    b.bytes = 0;
+    return;
+  }
+
+  BatchHeader header = {.magic = BATCH_MAGIC, .flags = 0, .num_msgs = (uint32_t)b.arena.size(), .raw_size = (uint32_t)raw.size()};
+  size_t payload_size = raw.size();
+  if (cctx != NULL) {
+    frame.resize(sizeof(header) + ZSTD_compressBound(raw.size()));
+    size_t rc = ZSTD_compressCCtx(cctx, frame.data() + sizeof(header), frame.size() - sizeof(header), raw.data(), raw.size(), 1);
+    if (!ZSTD_isError(rc) && rc < raw.size()) {
+      header.flags |= BATCH_ZSTD;
+      payload_size = rc;
+    }
+  }
+  if (!(header.flags & BATCH_ZSTD)) {
+    frame.resize(sizeof(header) + raw.size());
+    memcpy(frame.data() + sizeof(header), raw.data(), raw.size());
+  }
+  memcpy(frame.data(), &header, sizeof(header));
+  b.pub_sock->send(frame.data(), sizeof(header) + payload_size);
+
+  uint64_t delay = now - b.first_ns;
+  stats.msgs += b.arena.size();
+  stats.frames++;
+  stats.raw_bytes += b.bytes;
+  stats.wire_bytes += sizeof(header) + payload_size;
+  stats.delay_sum_ns += delay;
+  stats.delay_max_ns = std::max(stats.delay_max_ns, delay);
+
+  b.arena.clear();
+  b.bytes = 0;
+}
+
+static void forward_batched(Poller *poller, std::map<SubSocket*, PubSocket*> &sub2pub, bool compress, int flush_ms) {
+  std::map<SubSocket*, Batch> batches;
+  for (auto &it : sub2pub) {
+    batches[it.first].pub_sock = it.second;
+  }
+
+  ZSTD_CCtx *cctx = compress ? ZSTD_createCCtx() : NULL;
+  std::vector<char> raw, frame;
+  BridgeStats stats = {.start_ns = nanos_since_boot()};
+  const uint64_t flush_ns = flush_ms * 1000000ULL;
+
+  while (true) {
+    // wake up in time to flush the oldest pending batch
+    uint64_t now = nanos_since_boot();
+    int timeout = 100;
+    for (auto &it : batches) {
+      if (it.second.arena.size() > 0) {
+        uint64_t deadline = it.second.first_ns + flush_ns;
+        timeout = std::min(timeout, deadline > now ? (int)((deadline - now + 999999) / 1000000) : 0);
+      }
+    }
+
+    for (auto sub_sock : poller->poll(timeout)) {
+      Batch &b = batches[sub_sock];
+      size_t prev = b.arena.size();
+      while (b.arena.size() < BATCH_MAX_MSGS && b.bytes < BATCH_MAX_BYTES &&
+             sub_sock->receive_batch(&b.arena, BATCH_MAX_MSGS - b.arena.size(), BATCH_MAX_BYTES - b.bytes) > 0) {
+        for (size_t i = prev; i < b.arena.size(); i++) {
+          b.bytes += b.arena.getSize(i);
+        }
+        prev = b.arena.size();
+      }
+      if (b.arena.size() > 0 && b.first_ns == 0) {
+        b.first_ns = nanos_since_boot();
+      }
+    }
+
+    now = nanos_since_boot();
+    for (auto &it : batches) {
+      Batch &b = it.second;
+      if (b.arena.size() > 0 && (now - b.first_ns >= flush_ns || b.arena.size() >= BATCH_MAX_MSGS || b.bytes >= BATCH_MAX_BYTES)) {
+        flush_batch(b, raw, frame, cctx, stats, now);
+        b.first_ns = 0;
+      }
+    }
+    stats.report(now);
+  }
+}
+
+// forwards every message as is, in either direction
+static void forward(Poller *poller, std::map<SubSocket*, PubSocket*> &sub2pub) {
+  BridgeStats stats = {.start_ns = nanos_since_boot()};
+
+  while (true) {
+    for (auto sub_sock : poller->poll(100)) {
+      Message *msg = sub_sock->receive(true);
+      if (msg == NULL) continue;
+      sub2pub[sub_sock]->sendMessage(msg);
+      stats.msgs++;
+      stats.frames++;
+      stats.raw_bytes += msg->getSize();
+      stats.wire_bytes += msg->getSize();
+      delete msg;
+    }
+    stats.report(nanos_since_boot());
+  }
+}
+
+static void republish_batches(Poller *poller, std::map<SubSocket*, PubSocket*> &sub2pub) {
+  ZSTD_DCtx *dctx = ZSTD_createDCtx();
+  std::vector<char> raw;
+  BridgeStats stats = {.start_ns = nanos_since_boot()};
+
+  while (true) {
+    for (auto sub_sock : poller->poll(100)) {
+      Message *msg = sub_sock->receive(true);
+      if (msg == NULL) continue;
+
+      PubSocket *pub_sock = sub2pub[sub_sock];
+      BatchHeader header = {};
+      if (msg->getSize() >= sizeof(header)) {
+        memcpy(&header, msg->getData(), sizeof(header));
+      }
+      if (header.magic != BATCH_MAGIC) {
+        std::cout << "bridge: dropping frame without batch header" << std::endl;
+        delete msg;
+        continue;
+      }
+
+      char *payload = msg->getData() + sizeof(header);
+      size_t payload_size = msg->getSize() - sizeof(header);
+      if (header.flags & BATCH_ZSTD) {
+        // raw_size comes from the network, don't let it pick the allocation
+        if (header.raw_size > BATCH_MAX_RAW_SIZE) {
+          std::cout << "bridge: dropping batch claiming " << header.raw_size << " bytes" << std::endl;
+          delete msg;
+          continue;
+        }
+        raw.resize(header.raw_size);
+        size_t rc = ZSTD_decompressDCtx(dctx, raw.data(), raw.size(), payload, payload_size);
+        if (ZSTD_isError(rc) || rc != header.raw_size) {
+          std::cout << "bridge: dropping corrupt batch: " << (ZSTD_isError(rc) ? ZSTD_getErrorName(rc) : "size mismatch") << std::endl;
+          delete msg;
+          continue;
+        }
+        payload = raw.data();
+        payload_size = rc;
+      }
+
+      size_t offset = 0;
+      for (uint32_t i = 0; i < header.num_msgs && offset + sizeof(uint32_t) <= payload_size; i++) {
+        uint32_t size;
+        memcpy(&size, payload + offset, sizeof(size));
+        offset += sizeof(size);
+        if (offset + size > payload_size) break;
+
+        pub_sock->send(payload + offset, size);
+        offset += size;
+        stats.msgs++;
+        stats.raw_bytes += size;
+      }
+      stats.frames++;
+      stats.wire_bytes += msg->getSize();
+      delete msg;
+    }
+    stats.report(nanos_since_boot());
+  }
+}
+
 int main(int argc, char** argv) {
   signal(SIGPIPE, (sighandler_t)sigpipe_handler);
 
-  bool zmq_to_msgq = argc > 2;
-  std::string ip = zmq_to_msgq ? argv[1] : "127.0.0.1";
-  std::string whitelist_str = zmq_to_msgq ? std::string(argv[2]) : "";
+  bool batch = false, compress = false;
+  int flush_ms = 10;
+  std::vector<std::string> args;
+  for (int i = 1; i < argc; i++) {
+    std::string arg = argv[i];
+    if (arg == "--batch") {
+      batch = true;
+    } else if (arg == "--zstd") {
+      batch = compress = true;
+    } else if (arg == "--flush-ms" && i + 1 < argc) {
+      flush_ms = atoi(argv[++i]);
+    } else {
+      args.push_back(arg);
+    }
+  }
+
+  bool zmq_to_msgq = args.size() > 1;
+  std::string ip = zmq_to_msgq ? args[0] : "127.0.0.1";
+  std::string whitelist_str = zmq_to_msgq ? args[1] : "";
 
   Poller *poller;
   Context *pub_context;
@@ -60,20 +340,31 @@ int main(int argc, char** argv) {
       pub_sock = new ZMQPubSocket();
       sub_sock = new MSGQSubSocket();
     }
-    pub_sock->connect(pub_context, endpoint);
-    sub_sock->connect(sub_context, endpoint, ip, false);
+    if (batch) {
+      // batches are on their own zmq ports
+      std::string port = std::to_string(batch_port(endpoint));
+      if (zmq_to_msgq) {
+        pub_sock->connect(pub_context, endpoint);
+        sub_sock->connect(sub_context, port, ip, false, false);
+      } else {
+        pub_sock->connect(pub_context, port, false);
+        sub_sock->connect(sub_context, endpoint, ip, false);
+      }
+    } else {
+      pub_sock->connect(pub_context, endpoint);
+      sub_sock->connect(sub_context, endpoint, ip, false);
+    }
 
     poller->registerSocket(sub_sock);
     sub2pub[sub_sock] = pub_sock;
   }
 
-  while (true) {
-    for (auto sub_sock : poller->poll(100)) {
-      Message * msg = sub_sock->receive();
-      if (msg == NULL) continue;
-      sub2pub[sub_sock]->sendMessage(msg);
-      delete msg;
-    }
+  if (!batch) {
+    forward(poller, sub2pub);
+  } else if (zmq_to_msgq) {
+    republish_batches(poller, sub2pub);
+  } else {
+    forward_batched(poller, sub2pub, compress, flush_ms);
   }
   return 0;
 }
@@ -26,17 +26,35 @@ static bool service_exists(std::string path){
 }
 
 static size_t get_size(std::string endpoint){
-  size_t sz = DEFAULT_SEGMENT_SIZE;
-
-  if (endpoint == "roadCameraState" || endpoint == "driverCameraState" || endpoint == "wideRoadCameraState"){
-    sz *= 10;
+  // Services are sized in services.py, other endpoints (e.g. visionipc) get the default
+  for (const auto& it : services) {
+    if (it.name == endpoint) {
+      return it.segment_size;
+    }
   }
+  return DEFAULT_SEGMENT_SIZE;
+}
 
-  return sz;
+static size_t get_max_readers(std::string endpoint){
+  for (const auto& it : services) {
+    if (it.name == endpoint) {
+      return it.max_readers;
+    }
+  }
+  return DEFAULT_NUM_READERS;
 }
 
 
 MSGQContext::MSGQContext() {
+  // Reported once per boot, by the first process using msgq
+  if (msgq_init_shm()){
+    size_t budget = 0;
+    for (const auto& it : services) {
+      budget += msgq_mmap_size(it.segment_size, it.max_readers);
+    }
+    std::cout << "msgq: shared memory budget " << budget / (1024 * 1024) << " MiB for "
+              << sizeof(services) / sizeof(services[0]) << " services" << std::endl;
+  }
 }
 
 MSGQContext::~MSGQContext() {
@@ -78,12 +96,15 @@ int MSGQSubSocket::connect(Context *context, std::string endpoint, std::string a
   }
 
   q = new msgq_queue_t;
-  int r = msgq_new_queue(q, endpoint.c_str(), get_size(endpoint));
+  int r = msgq_new_queue(q, endpoint.c_str(), get_size(endpoint), get_max_readers(endpoint));
   if (r != 0){
     return r;
   }
 
-  msgq_init_subscriber(q);
+  r = msgq_init_subscriber(q);
+  if (r != 0){
+    return r;
+  }
 
   if (conflate){
     q->read_conflate = true;
@@ -151,6 +172,52 @@ Message * MSGQSubSocket::receive(bool non_blocking){
   return (Message*)r;
 }
 
+bool MSGQSubSocket::borrow(const char **data, size_t *size){
+  msgq_msg_t msg;
+  if (msgq_msg_borrow(&msg, q) <= 0){
+    return false;
+  }
+
+  *data = msg.data;
+  *size = msg.size;
+  return true;
+}
+
+bool MSGQSubSocket::release(){
+  return msgq_msg_release(q);
+}
+
+int MSGQSubSocket::receive_batch(MessageArena *arena, size_t max_msgs, size_t max_bytes){
+  size_t used = 0;
+  char *buf = arena->reserve(max_bytes);
+  int rc = msgq_msg_recv_batch(q, buf, max_bytes, max_msgs, &used);
+  if (rc == 0 && used > 0){
+    // The next message alone is larger than max_bytes
+    buf = arena->reserve(used);
+    rc = msgq_msg_recv_batch(q, buf, used, 1, &used);
+  }
+
+  // Messages are copied in ring format, a size followed by the aligned data
+  for (int i = 0; i < rc; i++){
+    int64_t size = *(int64_t*)buf;
+    arena->push(buf + sizeof(int64_t), size);
+    buf += ALIGN(size + sizeof(int64_t));
+  }
+  return rc;
+}
+
+bool MSGQSubSocket::getStats(SubSocketStats *stats){
+  if (q->reader_id < 0){
+    return false;
+  }
+  msgq_reader_t &r = q->readers[q->reader_id];
+  stats->received = r.num_read;
+  stats->skipped = r.num_skipped;
+  stats->resets = r.num_resets;
+  stats->max_lag = r.max_lag;
+  return true;
+}
+
 void MSGQSubSocket::setTimeout(int t){
   timeout = t;
 }
@@ -170,7 +237,7 @@ int MSGQPubSocket::connect(Context *context, std::string endpoint, bool check_en
   }
 
   q = new msgq_queue_t;
-  int r = msgq_new_queue(q, endpoint.c_str(), get_size(endpoint));
+  int r = msgq_new_queue(q, endpoint.c_str(), get_size(endpoint), get_max_readers(endpoint));
   if (r != 0){
     return r;
   }
@@ -196,6 +263,24 @@ int MSGQPubSocket::send(char *data, size_t size){
   return msgq_msg_send(&msg, q);
 }
 
+char * MSGQPubSocket::reserve(size_t size){
+  msgq_msg_t msg;
+  msg.size = size;
+
+  if (msgq_msg_reserve(&msg, q) < 0){
+    return NULL;
+  }
+  return msg.data;
+}
+
+int MSGQPubSocket::commit(size_t size){
+  msgq_msg_t msg;
+  msg.data = NULL;
+  msg.size = size;
+
+  return msgq_msg_commit(&msg, q);
+}
+
 bool MSGQPubSocket::all_readers_updated() {
   return msgq_all_readers_updated(q);
 }
@@ -218,13 +303,17 @@ void MSGQPoller::registerSocket(SubSocket * socket){
 
 std::vector<SubSocket*> MSGQPoller::poll(int timeout){
   std::vector<SubSocket*> r;
+  poll(timeout, r);
+  return r;
+}
+
+void MSGQPoller::poll(int timeout, std::vector<SubSocket*> &ready){
+  ready.clear();
 
   msgq_poll(polls, num_polls, timeout);
   for (size_t i = 0; i < num_polls; i++){
     if (polls[i].revents){
-      r.push_back(sockets[i]);
+      ready.push_back(sockets[i]);
     }
   }
-
-  return r;
 }
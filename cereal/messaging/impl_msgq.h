@@ -38,6 +38,10 @@ public:
   void setTimeout(int timeout);
   void * getRawSocket() {return (void*)q;}
   Message *receive(bool non_blocking=false);
+  bool borrow(const char **data, size_t *size);
+  bool release();
+  int receive_batch(MessageArena *arena, size_t max_msgs, size_t max_bytes);
+  bool getStats(SubSocketStats *stats);
   ~MSGQSubSocket();
 };
 
@@ -48,6 +52,8 @@ public:
   int connect(Context *context, std::string endpoint, bool check_endpoint=true);
   int sendMessage(Message *message);
   int send(char *data, size_t size);
+  char *reserve(size_t size);
+  int commit(size_t size);
   bool all_readers_updated();
   ~MSGQPubSocket();
 };
@@ -61,5 +67,6 @@ private:
 public:
   void registerSocket(SubSocket *socket);
   std::vector<SubSocket*> poll(int timeout);
+  void poll(int timeout, std::vector<SubSocket*> &ready);
   ~MSGQPoller(){};
 };
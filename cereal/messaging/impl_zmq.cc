@@ -99,11 +99,52 @@ Message * ZMQSubSocket::receive(bool non_blocking){
   return r;
 }
 
+bool ZMQSubSocket::borrow(const char **data, size_t *size){
+  // ZMQ has no shared ring, keep the received copy alive until the next borrow
+  Message *msg = receive(true);
+  if (msg == NULL){
+    return false;
+  }
+
+  delete borrowed;
+  borrowed = msg;
+  *data = borrowed->getData();
+  *size = borrowed->getSize();
+  return true;
+}
+
+bool ZMQSubSocket::release(){
+  return true;
+}
+
+int ZMQSubSocket::receive_batch(MessageArena *arena, size_t max_msgs, size_t max_bytes){
+  size_t num = 0, bytes = 0;
+  while (num < max_msgs && bytes < max_bytes){
+    Message *msg = receive(true);
+    if (msg == NULL){
+      break;
+    }
+
+    char *data = arena->reserve(msg->getSize());
+    memcpy(data, msg->getData(), msg->getSize());
+    arena->push(data, msg->getSize());
+    bytes += msg->getSize();
+    num++;
+    delete msg;
+  }
+  return num;
+}
+
+bool ZMQSubSocket::getStats(SubSocketStats *stats){
+  return false;
+}
+
 void ZMQSubSocket::setTimeout(int timeout){
   zmq_setsockopt(sock, ZMQ_RCVTIMEO, &timeout, sizeof(int));
 }
 
 ZMQSubSocket::~ZMQSubSocket(){
+  delete borrowed;
   zmq_close(sock);
 }
 
@@ -131,6 +172,19 @@ int ZMQPubSocket::send(char *data, size_t size){
   return zmq_send(sock, data, size, ZMQ_DONTWAIT);
 }
 
+char * ZMQPubSocket::reserve(size_t size){
+  // No shared ring to build into, zmq copies the reserved buffer on commit
+  if (reserved.size() < size){
+    reserved.resize(size);
+  }
+  return reserved.data();
+}
+
+int ZMQPubSocket::commit(size_t size){
+  assert(size <= reserved.size());
+  return send(reserved.data(), size);
+}
+
 bool ZMQPubSocket::all_readers_updated() {
   assert(false); // TODO not implemented
   return false;
@@ -152,17 +206,21 @@ void ZMQPoller::registerSocket(SubSocket * socket){
 
 std::vector<SubSocket*> ZMQPoller::poll(int timeout){
   std::vector<SubSocket*> r;
+  poll(timeout, r);
+  return r;
+}
+
+void ZMQPoller::poll(int timeout, std::vector<SubSocket*> &ready){
+  ready.clear();
 
   int rc = zmq_poll(polls, num_polls, timeout);
   if (rc < 0){
-    return r;
+    return;
   }
 
   for (size_t i = 0; i < num_polls; i++){
     if (polls[i].revents){
-      r.push_back(sockets[i]);
+      ready.push_back(sockets[i]);
     }
   }
-
-  return r;
 }
@@ -31,11 +31,16 @@ class ZMQSubSocket : public SubSocket {
 private:
   void * sock;
   std::string full_endpoint;
+  Message * borrowed = NULL;
 public:
   int connect(Context *context, std::string endpoint, std::string address, bool conflate=false, bool check_endpoint=true);
   void setTimeout(int timeout);
   void * getRawSocket() {return sock;}
   Message *receive(bool non_blocking=false);
+  bool borrow(const char **data, size_t *size);
+  bool release();
+  int receive_batch(MessageArena *arena, size_t max_msgs, size_t max_bytes);
+  bool getStats(SubSocketStats *stats);
   ~ZMQSubSocket();
 };
 
@@ -43,10 +48,13 @@ class ZMQPubSocket : public PubSocket {
 private:
   void * sock;
   std::string full_endpoint;
+  std::vector<char> reserved;
 public:
   int connect(Context *context, std::string endpoint, bool check_endpoint=true);
   int sendMessage(Message *message);
   int send(char *data, size_t size);
+  char *reserve(size_t size);
+  int commit(size_t size);
   bool all_readers_updated();
   ~ZMQPubSocket();
 };
@@ -60,5 +68,6 @@ private:
 public:
   void registerSocket(SubSocket *socket);
   std::vector<SubSocket*> poll(int timeout);
+  void poll(int timeout, std::vector<SubSocket*> &ready);
   ~ZMQPoller(){};
 };
@@ -1,4 +1,6 @@
 #pragma once
+#include <algorithm>
+#include <cassert>
 #include <cstddef>
 #include <map>
 #include <string>
@@ -32,11 +34,59 @@ public:
 };
 
 
+// Word aligned buffer that holds a batch of received messages, reused between
+// receive_batch() calls to avoid an allocation per message.
+class MessageArena {
+public:
+  size_t size() const { return msgs.size(); }
+  const char *getData(size_t i) const { return (const char *)buf.data() + msgs[i].first; }
+  size_t getSize(size_t i) const { return msgs[i].second; }
+  kj::ArrayPtr<const capnp::word> getWords(size_t i) const {
+    return kj::arrayPtr(buf.data() + msgs[i].first / sizeof(capnp::word), msgs[i].second / sizeof(capnp::word));
+  }
+  void clear() { used = 0; msgs.clear(); }
+
+  // Returns space for at least size bytes after the last message
+  char *reserve(size_t size) {
+    size_t words = (used + size + sizeof(capnp::word) - 1) / sizeof(capnp::word);
+    if (words > buf.size()) buf.resize(std::max(words, buf.size() * 2));
+    return (char *)buf.data() + used;
+  }
+  // Adds a message that was written into the reserved space
+  void push(const char *data, size_t size) {
+    size_t offset = data - (const char *)buf.data();
+    assert(offset % sizeof(capnp::word) == 0 && offset >= used && offset + size <= buf.size() * sizeof(capnp::word));
+    msgs.push_back({offset, size});
+    used = (offset + size + sizeof(capnp::word) - 1) & ~(sizeof(capnp::word) - 1);
+  }
+
+private:
+  std::vector<capnp::word> buf;
+  size_t used = 0;
+  std::vector<std::pair<size_t, size_t>> msgs;
+};
+
+struct SubSocketStats {
+  uint64_t received = 0;
+  uint64_t skipped = 0; // messages lost because the reader was overrun
+  uint64_t resets = 0;
+  uint64_t max_lag = 0; // bytes
+};
+
 class SubSocket {
 public:
   virtual int connect(Context *context, std::string endpoint, std::string address, bool conflate=false, bool check_endpoint=true) = 0;
   virtual void setTimeout(int timeout) = 0;
   virtual Message *receive(bool non_blocking=false) = 0;
+  // Non-blocking zero-copy receive. The data stays readable until the next successful borrow,
+  // release() returns false if it was overwritten by the publisher in the meantime.
+  virtual bool borrow(const char **data, size_t *size) = 0;
+  virtual bool release() = 0;
+  // Non-blocking receive of everything that is queued, up to max_msgs messages and about
+  // max_bytes of data, appended to arena. Returns the number of messages received.
+  virtual int receive_batch(MessageArena *arena, size_t max_msgs, size_t max_bytes) = 0;
+  // Reader statistics, returns false if not supported by the backend
+  virtual bool getStats(SubSocketStats *stats) = 0;
   virtual void * getRawSocket() = 0;
   static SubSocket * create();
   static SubSocket * create(Context * context, std::string endpoint, std::string address="127.0.0.1", bool conflate=false, bool check_endpoint=true);
@@ -48,6 +98,10 @@ public:
   virtual int connect(Context *context, std::string endpoint, bool check_endpoint=true) = 0;
   virtual int sendMessage(Message *message) = 0;
   virtual int send(char *data, size_t size) = 0;
+  // Zero-copy send. reserve() returns word aligned space for up to size bytes in the
+  // socket's send buffer, commit() publishes the first size bytes of it.
+  virtual char *reserve(size_t size) = 0;
+  virtual int commit(size_t size) = 0;
   virtual bool all_readers_updated() = 0;
   static PubSocket * create();
   static PubSocket * create(Context * context, std::string endpoint, bool check_endpoint=true);
@@ -59,6 +113,8 @@ class Poller {
 public:
   virtual void registerSocket(SubSocket *socket) = 0;
   virtual std::vector<SubSocket*> poll(int timeout) = 0;
+  // Same as poll(), the ready sockets are written to ready, which keeps its capacity between calls
+  virtual void poll(int timeout, std::vector<SubSocket*> &ready) = 0;
   static Poller * create();
   static Poller * create(std::vector<SubSocket*> sockets);
   virtual ~Poller(){};
@@ -82,6 +138,7 @@ public:
   bool valid(const char *name) const;
   uint64_t rcv_frame(const char *name) const;
   uint64_t rcv_time(const char *name) const;
+  SubSocketStats stats(const char *name) const;
   cereal::Event::Reader &operator[](const char *name) const;
 
 private:
@@ -95,6 +152,8 @@ private:
 class MessageBuilder : public capnp::MallocMessageBuilder {
 public:
   MessageBuilder() = default;
+  // firstSegment must be zeroed, additional segments are allocated on the heap
+  MessageBuilder(kj::ArrayPtr<capnp::word> firstSegment) : capnp::MallocMessageBuilder(firstSegment) {}
 
   cereal::Event::Builder initEvent(bool valid = true) {
     cereal::Event::Builder event = initRoot<cereal::Event>();
@@ -120,10 +179,17 @@ public:
   PubMaster(const std::vector<const char *> &service_list);
   inline int send(const char *name, capnp::byte *data, size_t size) { return sockets_.at(name)->send((char *)data, size); }
   int send(const char *name, MessageBuilder &msg);
+  // Zero-copy send. The returned builder writes directly into the socket's send buffer,
+  // max_size bytes are reserved and anything beyond that is copied on commit.
+  // The builder is valid until commit(), nothing else may be sent on this service in between.
+  MessageBuilder &reserve(const char *name, size_t max_size);
+  int commit(const char *name);
   ~PubMaster();
 
 private:
   std::map<std::string, PubSocket *> sockets_;
+  struct Reservation;
+  std::map<std::string, Reservation *> reservations_;
 };
 
 class AlignedBuffer {
@@ -9,6 +9,8 @@
 #include <cstdlib>
 #include <csignal>
 #include <random>
+#include <mutex>
+#include <climits>
 
 #include <poll.h>
 #include <sys/ioctl.h>
@@ -19,6 +21,10 @@
 #include <fcntl.h>
 #include <unistd.h>
 
+#ifdef __linux__
+#include <linux/futex.h>
+#endif
+
 #include <stdio.h>
 
 #include "msgq.h"
@@ -69,8 +75,35 @@ int msgq_msg_close(msgq_msg_t * msg){
 
 void msgq_reset_reader(msgq_queue_t * q){
   int id = q->reader_id;
-  q->read_valids[id]->store(true);
-  q->read_pointers[id]->store(*q->write_pointer);
+  q->readers[id].read_seq.store(*q->write_count);
+  q->readers[id].read_valid.store(true);
+  q->readers[id].read_pointer.store(*q->write_pointer);
+}
+
+static inline void stat_add(std::atomic<uint64_t> &stat, uint64_t n){
+  stat.store(stat.load(std::memory_order_relaxed) + n, std::memory_order_relaxed);
+}
+
+// The reader was overrun by the publisher, count what was lost and skip to the write pointer
+static void msgq_reader_overrun(msgq_queue_t * q){
+  msgq_reader_t &r = q->readers[q->reader_id];
+  uint64_t write_count = *q->write_count;
+  uint64_t read_seq = r.read_seq;
+
+  stat_add(r.num_resets, 1);
+  stat_add(r.num_skipped, write_count > read_seq ? write_count - read_seq : 0);
+  msgq_reset_reader(q);
+}
+
+static void msgq_reader_consumed(msgq_queue_t * q, uint32_t read_cycles, uint32_t read_pointer, uint32_t write_cycles, uint32_t write_pointer){
+  msgq_reader_t &r = q->readers[q->reader_id];
+  uint64_t lag = (uint64_t)(write_cycles - read_cycles) * q->size + write_pointer - read_pointer;
+
+  stat_add(r.read_seq, 1);
+  stat_add(r.num_read, 1);
+  if (lag > r.max_lag.load(std::memory_order_relaxed)){
+    r.max_lag.store(lag, std::memory_order_relaxed);
+  }
 }
 
 void msgq_wait_for_subscriber(msgq_queue_t *q){
@@ -82,9 +115,15 @@ void msgq_wait_for_subscriber(msgq_queue_t *q){
 }
 
 
-int msgq_new_queue(msgq_queue_t * q, const char * path, size_t size){
+size_t msgq_mmap_size(size_t size, size_t max_readers){
+  return sizeof(msgq_header_t) + max_readers * sizeof(msgq_reader_t) + size;
+}
+
+int msgq_new_queue(msgq_queue_t * q, const char * path, size_t size, size_t max_readers){
   assert(size < 0xFFFFFFFF); // Buffer must be smaller than 2^32 bytes
+  assert(max_readers > 0);
   std::signal(SIGUSR2, sigusr2_handler);
+  q->mmap_p = NULL;
 
   const char * prefix = "/dev/shm/";
   char * full_path = new char[strlen(path) + strlen(prefix) + 1];
@@ -99,45 +138,72 @@ int msgq_new_queue(msgq_queue_t * q, const char * path, size_t size){
   }
   delete[] full_path;
 
-  int rc = ftruncate(fd, size + sizeof(msgq_header_t));
-  if (rc < 0){
+  // The layout depends on size and max_readers, an existing queue has to match them.
+  // Resizing it would move the data under the other users of the queue.
+  size_t mmap_size = msgq_mmap_size(size, max_readers);
+  struct stat st;
+  if (fstat(fd, &st) < 0){
+    close(fd);
+    return -1;
+  }
+  if (st.st_size != 0 && (size_t)st.st_size != mmap_size){
+    std::cout << "Warning, " << path << " exists with a different size or reader count, remove it if it is stale" << std::endl;
+    close(fd);
+    errno = EINVAL;
+    return -1;
+  }
+  if (st.st_size == 0 && ftruncate(fd, mmap_size) < 0){
     close(fd);
     return -1;
   }
-  char * mem = (char*)mmap(NULL, size + sizeof(msgq_header_t), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  char * mem = (char*)mmap(NULL, mmap_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
   close(fd);
 
   if (mem == NULL){
     return -1;
   }
-  q->mmap_p = mem;
-
   msgq_header_t *header = (msgq_header_t *)mem;
 
+  // Set by whoever maps the new queue first, two openers can create the file at the same time
+  uint64_t header_max_readers = 0;
+  if (!reinterpret_cast<std::atomic<uint64_t>*>(&header->max_readers)->compare_exchange_strong(header_max_readers, max_readers) &&
+      header_max_readers != max_readers){
+    std::cout << "Warning, " << path << " has " << header_max_readers << " reader slots, expected " << max_readers << std::endl;
+    munmap(mem, mmap_size);
+    errno = EINVAL;
+    return -1;
+  }
+  q->mmap_p = mem;
+
   // Setup pointers to header segment
   q->num_readers = reinterpret_cast<std::atomic<uint64_t>*>(&header->num_readers);
   q->write_pointer = reinterpret_cast<std::atomic<uint64_t>*>(&header->write_pointer);
   q->write_uid = reinterpret_cast<std::atomic<uint64_t>*>(&header->write_uid);
+  q->write_count = reinterpret_cast<std::atomic<uint64_t>*>(&header->write_count);
 
-  for (size_t i = 0; i < NUM_READERS; i++){
-    q->read_pointers[i] = reinterpret_cast<std::atomic<uint64_t>*>(&header->read_pointers[i]);
-    q->read_valids[i] = reinterpret_cast<std::atomic<uint64_t>*>(&header->read_valids[i]);
-    q->read_uids[i] = reinterpret_cast<std::atomic<uint64_t>*>(&header->read_uids[i]);
-  }
+  q->readers = reinterpret_cast<msgq_reader_t*>(mem + sizeof(msgq_header_t));
+  q->max_readers = max_readers;
 
-  q->data = mem + sizeof(msgq_header_t);
+  q->data = mem + sizeof(msgq_header_t) + max_readers * sizeof(msgq_reader_t);
   q->size = size;
   q->reader_id = -1;
+  q->reader_lost = false;
 
   q->endpoint = path;
   q->read_conflate = false;
+  q->write_reserved = 0;
 
   return 0;
 }
 
 void msgq_close_queue(msgq_queue_t *q){
   if (q->mmap_p != NULL){
-    munmap(q->mmap_p, q->size + sizeof(msgq_header_t));
+    // Free our reader slot, unless we were evicted and it belongs to someone else
+    if (q->reader_id >= 0){
+      uint64_t uid = q->read_uid_local;
+      q->readers[q->reader_id].read_uid.compare_exchange_strong(uid, 0);
+    }
+    munmap(q->mmap_p, msgq_mmap_size(q->size, q->max_readers));
   }
 }
 
@@ -149,9 +215,12 @@ void msgq_init_publisher(msgq_queue_t * q) {
   *q->write_uid = uid;
   *q->num_readers = 0;
 
-  for (size_t i = 0; i < NUM_READERS; i++){
-    *q->read_valids[i] = false;
-    *q->read_uids[i] = 0;
+  for (size_t i = 0; i < q->max_readers; i++){
+    q->readers[i].read_valid = false;
+    q->readers[i].read_uid = 0;
+    q->readers[i].read_pid = 0;
+    q->readers[i].wake_slot = 0;
+    q->readers[i].lease_valid = false;
   }
 
   q->write_uid_local = uid;
@@ -166,57 +235,260 @@ static void thread_signal(uint32_t tid) {
   #endif
 }
 
-void msgq_init_subscriber(msgq_queue_t * q) {
+static msgq_wake_table_t *wake_table = NULL;
+static bool wake_table_created = false;
+static std::once_flag wake_table_once;
+
+static msgq_wake_table_t *msgq_get_wake_table(){
+  std::call_once(wake_table_once, [](){
+    auto fd = open("/dev/shm/msgq_wake", O_RDWR | O_CREAT, 0777);
+    if (fd < 0) {
+      std::cout << "Warning, could not open: /dev/shm/msgq_wake" << std::endl;
+      return;
+    }
+
+    struct stat st;
+    if (fstat(fd, &st) == 0 && (size_t)st.st_size < sizeof(msgq_wake_table_t)){
+      if (ftruncate(fd, sizeof(msgq_wake_table_t)) < 0){
+        close(fd);
+        return;
+      }
+      wake_table_created = true;
+    }
+
+    void * mem = mmap(NULL, sizeof(msgq_wake_table_t), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (mem != MAP_FAILED){
+      wake_table = (msgq_wake_table_t *)mem;
+    }
+  });
+  return wake_table;
+}
+
+// Sets up the state shared by all msgq users. Returns true in the process that created
+// it, which is the first one to use msgq since boot.
+bool msgq_init_shm(){
+  msgq_get_wake_table();
+  return wake_table_created;
+}
+
+static inline std::atomic<uint32_t> *wake_futex(msgq_wake_table_t *table, uint64_t slot){
+  return reinterpret_cast<std::atomic<uint32_t>*>(&table->slots[slot].futex);
+}
+
+static bool thread_alive(uint64_t tid){
+  #ifdef SYS_tkill
+    return syscall(SYS_tkill, tid, 0) == 0 || errno != ESRCH;
+  #else
+    return kill(tid, 0) == 0 || errno != ESRCH;
+  #endif
+}
+
+static bool process_alive(uint64_t pid){
+  // A pid of 0 means the slot was just claimed and the owner is still filling it in
+  return pid == 0 || kill(pid, 0) == 0 || errno != ESRCH;
+}
+
+// Wake slot owned by the calling thread, released again when the thread exits
+struct msgq_wake_slot_owner_t {
+  int slot = -1;
+  uint64_t tid = 0;
+
+  ~msgq_wake_slot_owner_t(){
+    if (slot >= 0 && wake_table != NULL){
+      auto owner = reinterpret_cast<std::atomic<uint64_t>*>(&wake_table->slots[slot].owner_tid);
+      owner->compare_exchange_strong(tid, 0);
+    }
+  }
+};
+
+static int msgq_get_wake_slot(){
+  static thread_local msgq_wake_slot_owner_t owner;
+  if (owner.slot >= 0) return owner.slot;
+
+  msgq_wake_table_t *table = msgq_get_wake_table();
+  if (table == NULL) return -1;
+
+  uint64_t tid = syscall(SYS_gettid);
+  uint64_t start = tid % NUM_WAKE_SLOTS;
+
+  // Claim a free slot, or one whose owner thread no longer exists
+  for (size_t i = 0; i < NUM_WAKE_SLOTS; i++){
+    uint64_t slot = (start + i) % NUM_WAKE_SLOTS;
+    auto owner_tid = reinterpret_cast<std::atomic<uint64_t>*>(&table->slots[slot].owner_tid);
+
+    uint64_t cur = *owner_tid;
+    if ((cur == 0 || !thread_alive(cur)) && owner_tid->compare_exchange_strong(cur, tid)){
+      owner.slot = slot;
+      owner.tid = tid;
+      return owner.slot;
+    }
+  }
+
+  std::cout << "Warning, no msgq wake slots available" << std::endl;
+  return -1;
+}
+
+static void msgq_wake(uint64_t slot){
+  msgq_wake_table_t *table = msgq_get_wake_table();
+  if (table == NULL || slot >= NUM_WAKE_SLOTS) return;
+
+  std::atomic<uint32_t> *futex = wake_futex(table, slot);
+  futex->fetch_add(1);
+
+  #ifdef __linux__
+    syscall(SYS_futex, futex, FUTEX_WAKE, INT_MAX, NULL, NULL, 0);
+  #endif
+}
+
+// Block until the futex no longer holds the expected value, a signal arrives or the timeout expires
+static void msgq_wait(std::atomic<uint32_t> *futex, uint32_t expected, int timeout_ms){
+  struct timespec ts;
+  ts.tv_sec = timeout_ms / 1000;
+  ts.tv_nsec = (timeout_ms % 1000) * 1000 * 1000;
+
+  #ifdef __linux__
+    syscall(SYS_futex, futex, FUTEX_WAIT, expected, timeout_ms < 0 ? NULL : &ts, NULL, 0);
+  #else
+    // No futex available, fall back to sleeping in short intervals
+    if (timeout_ms < 0 || timeout_ms > 10){
+      ts.tv_sec = 0;
+      ts.tv_nsec = 10 * 1000 * 1000;
+    }
+    if (*futex == expected){
+      nanosleep(&ts, NULL);
+    }
+  #endif
+}
+
+// Claims a reader slot. Returns -1 with errno EBUSY if every slot stayed taken by
+// a live reader that keeps up for timeout_ms.
+int msgq_init_subscriber(msgq_queue_t * q, int timeout_ms) {
   assert(q != NULL);
   assert(q->num_readers != NULL);
 
   uint64_t uid = msgq_get_uid();
+  auto deadline = std::chrono::steady_clock::now() + std::chrono::milliseconds(timeout_ms);
 
   // Get reader id
-  while (true){
+  int id = -1;
+  bool warned = false;
+  while (id < 0){
     uint64_t cur_num_readers = *q->num_readers;
-    uint64_t new_num_readers = cur_num_readers + 1;
 
-    // No more slots available. Reset all subscribers to kick out inactive ones
-    if (new_num_readers > NUM_READERS){
-      std::cout << "Warning, evicting all subscribers!" << std::endl;
-      *q->num_readers = 0;
-
-      for (size_t i = 0; i < NUM_READERS; i++){
-        *q->read_valids[i] = false;
-
-        uint64_t old_uid = *q->read_uids[i];
-        *q->read_uids[i] = 0;
+    // Reuse a slot that was freed, or whose reader process no longer exists
+    for (uint64_t i = 0; i < cur_num_readers && id < 0; i++){
+      uint64_t old_uid = q->readers[i].read_uid;
+      if ((old_uid == 0 || !process_alive(q->readers[i].read_pid)) &&
+          q->readers[i].read_uid.compare_exchange_strong(old_uid, uid)){
+        id = i;
+      }
+    }
+    if (id >= 0) break;
+
+    if (cur_num_readers < q->max_readers){
+      // Use atomic compare and swap to handle race condition
+      // where two subscribers start at the same time
+      if (std::atomic_compare_exchange_strong(q->num_readers, &cur_num_readers, cur_num_readers + 1)){
+        // The new slot is visible to others now, it is ours if nobody claimed it in the meantime
+        uint64_t old_uid = 0;
+        if (q->readers[cur_num_readers].read_uid.compare_exchange_strong(old_uid, uid)){
+          id = cur_num_readers;
+        }
+      }
+      continue;
+    }
 
-        // Wake up reader in case they are in a poll
-        thread_signal(old_uid & 0xFFFFFFFF);
+    // All slots are taken by live readers. Only evict a reader that stopped keeping up,
+    // i.e. it was already overrun or is more than half the buffer behind
+    uint32_t write_cycles, write_pointer;
+    UNPACK64(write_cycles, write_pointer, *q->write_pointer);
+    uint64_t write_pos = (uint64_t)write_cycles * q->size + write_pointer;
+
+    int victim = -1;
+    uint64_t max_lag = q->size / 2;
+    for (uint64_t i = 0; i < cur_num_readers; i++){
+      uint32_t read_cycles, read_pointer;
+      UNPACK64(read_cycles, read_pointer, q->readers[i].read_pointer);
+      uint64_t lag = q->readers[i].read_valid ? write_pos - ((uint64_t)read_cycles * q->size + read_pointer) : UINT64_MAX;
+      if (lag > max_lag){
+        max_lag = lag;
+        victim = i;
       }
+    }
 
+    if (victim < 0){
+      // Wait for a reader to go away instead of kicking out one that is keeping up
+      if (std::chrono::steady_clock::now() >= deadline){
+        if (timeout_ms > 0){
+          std::cout << "Error, " << q->endpoint << ": all " << q->max_readers << " reader slots in use" << std::endl;
+        }
+        q->reader_id = -1;
+        errno = EBUSY;
+        return -1;
+      }
+      if (!warned){
+        std::cout << "Warning, " << q->endpoint << ": all " << q->max_readers << " reader slots in use, waiting for a free slot" << std::endl;
+        warned = true;
+      }
+      usleep(10 * 1000);
       continue;
     }
 
-    // Use atomic compare and swap to handle race condition
-    // where two subscribers start at the same time
-    if (std::atomic_compare_exchange_strong(q->num_readers,
-                                            &cur_num_readers,
-                                            new_num_readers)){
-      q->reader_id = cur_num_readers;
-      q->read_uid_local = uid;
+    uint64_t old_uid = q->readers[victim].read_uid;
+    if (q->readers[victim].read_uid.compare_exchange_strong(old_uid, uid)){
+      std::cout << "Warning, " << q->endpoint << ": all " << q->max_readers << " reader slots in use, evicting stalled reader " << victim << std::endl;
 
-      // We start with read_valid = false,
-      // on the first read the read pointer will be synchronized with the write pointer
-      *q->read_valids[cur_num_readers] = false;
-      *q->read_pointers[cur_num_readers] = 0;
-      *q->read_uids[cur_num_readers] = uid;
-      break;
+      // Wake up reader in case they are in a poll
+      thread_signal(old_uid & 0xFFFFFFFF);
+      id = victim;
     }
   }
 
+  q->reader_id = id;
+  q->read_uid_local = uid;
+  q->readers[id].read_pid = getpid();
+
+  // We start with read_valid = false,
+  // on the first read the read pointer will be synchronized with the write pointer
+  q->readers[id].read_valid = false;
+  q->readers[id].read_pointer = 0;
+  q->readers[id].wake_slot = 0;
+  q->readers[id].lease_valid = false;
+  q->readers[id].num_read = 0;
+  q->readers[id].num_skipped = 0;
+  q->readers[id].num_resets = 0;
+  q->readers[id].max_lag = 0;
+
   //std::cout << "New subscriber id: " << q->reader_id << " uid: " << q->read_uid_local << " " << q->endpoint << std::endl;
   msgq_reset_reader(q);
+  return 0;
 }
 
-int msgq_msg_send(msgq_msg_t * msg, msgq_queue_t *q){
+// Makes sure the reader still owns its slot and takes a new one if it was evicted.
+// Returns false if no slot is free right now, the next call tries again.
+static bool msgq_reader_attached(msgq_queue_t * q){
+  assert(q->reader_id >= 0 || q->reader_lost); // Make sure subscriber is initialized
+
+  if (q->reader_id >= 0 && q->read_uid_local == q->readers[q->reader_id].read_uid){
+    return true;
+  }
+
+  if (!q->reader_lost){
+    std::cout << q->endpoint << ": Reader was evicted, reconnecting" << std::endl;
+  }
+  bool lost = msgq_init_subscriber(q, 0) != 0;
+  if (lost && !q->reader_lost){
+    std::cout << q->endpoint << ": no free reader slot, retrying on the next read" << std::endl;
+  }
+  q->reader_lost = lost;
+  return !lost;
+}
+
+// Reserve space for a message of msg->size bytes directly in the ring. msg->data is
+// set to the reserved space, which can be filled in place and published with msgq_msg_commit.
+// Readers never see the reserved space before the commit.
+int msgq_msg_reserve(msgq_msg_t * msg, msgq_queue_t *q){
   // Die if we are no longer the active publisher
   if (q->write_uid_local != *q->write_uid){
     std::cout << "Killing old publisher: " << q->endpoint << std::endl;
@@ -247,12 +519,19 @@ int msgq_msg_send(msgq_msg_t * msg, msgq_queue_t *q){
     // Invalidate all readers that are beyond the write pointer
     // TODO: should we handle the case where a new reader shows up while this is running?
     for (uint64_t i = 0; i < num_readers; i++){
-      uint64_t read_pointer = *q->read_pointers[i];
+      uint64_t read_pointer = q->readers[i].read_pointer;
       uint64_t read_cycles = read_pointer >> 32;
       read_pointer &= 0xFFFFFFFF;
 
       if ((read_pointer > write_pointer) && (read_cycles != write_cycles)) {
-        *q->read_valids[i] = false;
+        q->readers[i].read_valid = false;
+      }
+
+      // The wraparound tag overwrites the size of a borrowed message at the write pointer
+      uint32_t lease_cycles, lease_pointer;
+      UNPACK64(lease_cycles, lease_pointer, q->readers[i].lease_pointer);
+      if ((lease_pointer == write_pointer) && (lease_cycles != write_cycles)) {
+        q->readers[i].lease_valid = false;
       }
     }
 
@@ -271,82 +550,106 @@ int msgq_msg_send(msgq_msg_t * msg, msgq_queue_t *q){
 
   for (uint64_t i = 0; i < num_readers; i++){
     uint32_t read_cycles, read_pointer;
-    UNPACK64(read_cycles, read_pointer, *q->read_pointers[i]);
+    UNPACK64(read_cycles, read_pointer, q->readers[i].read_pointer);
 
     if ((read_pointer >= start) && (read_pointer < end) && (read_cycles != write_cycles)) {
-      *q->read_valids[i] = false;
+      q->readers[i].read_valid = false;
+    }
+
+    uint32_t lease_cycles, lease_pointer;
+    UNPACK64(lease_cycles, lease_pointer, q->readers[i].lease_pointer);
+    if ((lease_pointer >= start) && (lease_pointer < end) && (lease_cycles != write_cycles)) {
+      q->readers[i].lease_valid = false;
     }
   }
 
 
+  q->write_reserved = msg->size;
+  msg->data = p + sizeof(int64_t);
+
+  return 0;
+}
+
+// Publish the first msg->size bytes of the space returned by msgq_msg_reserve
+int msgq_msg_commit(msgq_msg_t * msg, msgq_queue_t *q){
+  assert(msg->size <= q->write_reserved);
+  q->write_reserved = 0;
+
+  uint64_t num_readers = *q->num_readers;
+
+  uint32_t write_cycles, write_pointer;
+  UNPACK64(write_cycles, write_pointer, *q->write_pointer);
+
+  char *p = q->data + write_pointer;
+
   // Write size tag
   std::atomic<int64_t> *size_p = reinterpret_cast<std::atomic<int64_t>*>(p);
   *size_p = msg->size;
-
-  // Copy data
-  memcpy(p + sizeof(int64_t), msg->data, msg->size);
   __sync_synchronize();
 
   // Update write pointer
   uint32_t new_ptr = ALIGN(write_pointer + msg->size + sizeof(int64_t));
   PACK64(*q->write_pointer, write_cycles, new_ptr);
+  stat_add(*q->write_count, 1);
 
-  // Notify readers
+  // Wake readers that are blocked in msgq_poll
   for (uint64_t i = 0; i < num_readers; i++){
-    uint64_t reader_uid = *q->read_uids[i];
-    thread_signal(reader_uid & 0xFFFFFFFF);
+    uint64_t wake_slot = q->readers[i].wake_slot;
+    if (wake_slot != 0){
+      msgq_wake(wake_slot - 1);
+    }
   }
 
   return msg->size;
 }
 
+int msgq_msg_send(msgq_msg_t * msg, msgq_queue_t *q){
+  msgq_msg_t slot;
+  slot.size = msg->size;
+  if (msgq_msg_reserve(&slot, q) < 0){
+    return -1;
+  }
+
+  memcpy(slot.data, msg->data, msg->size);
+  return msgq_msg_commit(&slot, q);
+}
+
 
 int msgq_msg_ready(msgq_queue_t * q){
  start:
-  int id = q->reader_id;
-  assert(id >= 0); // Make sure subscriber is initialized
-
-  if (q->read_uid_local != *q->read_uids[id]){
-    std::cout << q->endpoint << ": Reader was evicted, reconnecting" << std::endl;
-    msgq_init_subscriber(q);
-    goto start;
+  if (!msgq_reader_attached(q)){
+    return 0;
   }
+  int id = q->reader_id;
 
   // Check valid
-  if (!*q->read_valids[id]){
-    msgq_reset_reader(q);
+  if (!q->readers[id].read_valid){
+    msgq_reader_overrun(q);
     goto start;
   }
 
-  uint32_t read_cycles, read_pointer;
-  UNPACK64(read_cycles, read_pointer, *q->read_pointers[id]);
-
-  uint32_t write_cycles, write_pointer;
-  UNPACK64(write_cycles, write_pointer, *q->write_pointer);
-
-  // Check if new message is available
+  // Check if new message is available, only the pointers matter and not the cycles
+  uint32_t read_pointer = q->readers[id].read_pointer & 0xFFFFFFFF;
+  uint32_t write_pointer = *q->write_pointer & 0xFFFFFFFF;
   return (read_pointer != write_pointer);
 }
 
 int msgq_msg_recv(msgq_msg_t * msg, msgq_queue_t * q){
  start:
-  int id = q->reader_id;
-  assert(id >= 0); // Make sure subscriber is initialized
-
-  if (q->read_uid_local != *q->read_uids[id]){
-    std::cout << q->endpoint << ": Reader was evicted, reconnecting" << std::endl;
-    msgq_init_subscriber(q);
-    goto start;
+  if (!msgq_reader_attached(q)){
+    msg->size = 0;
+    return 0;
   }
+  int id = q->reader_id;
 
   // Check valid
-  if (!*q->read_valids[id]){
-    msgq_reset_reader(q);
+  if (!q->readers[id].read_valid){
+    msgq_reader_overrun(q);
     goto start;
   }
 
   uint32_t read_cycles, read_pointer;
-  UNPACK64(read_cycles, read_pointer, *q->read_pointers[id]);
+  UNPACK64(read_cycles, read_pointer, q->readers[id].read_pointer);
 
   uint32_t write_cycles, write_pointer;
   UNPACK64(write_cycles, write_pointer, *q->write_pointer);
@@ -364,15 +667,15 @@ int msgq_msg_recv(msgq_msg_t * msg, msgq_queue_t * q){
   std::int64_t size = *size_p;
 
   // Check if the size that was read is valid
-  if (!*q->read_valids[id]){
-    msgq_reset_reader(q);
+  if (!q->readers[id].read_valid){
+    msgq_reader_overrun(q);
     goto start;
   }
 
   // If size is -1 the buffer was full, and we need to wrap around
   if (size == -1){
     read_cycles++;
-    PACK64(*q->read_pointers[id], read_cycles, 0);
+    PACK64(q->readers[id].read_pointer, read_cycles, 0);
     goto start;
   }
 
@@ -387,7 +690,8 @@ int msgq_msg_recv(msgq_msg_t * msg, msgq_queue_t * q){
   if (q->read_conflate){
     if (new_read_pointer != write_pointer){
       // Update read pointer
-      PACK64(*q->read_pointers[id], read_cycles, new_read_pointer);
+      PACK64(q->readers[id].read_pointer, read_cycles, new_read_pointer);
+      stat_add(q->readers[id].read_seq, 1);
       goto start;
     }
   }
@@ -401,20 +705,236 @@ int msgq_msg_recv(msgq_msg_t * msg, msgq_queue_t * q){
   __sync_synchronize();
 
   // Update read pointer
-  PACK64(*q->read_pointers[id], read_cycles, new_read_pointer);
+  PACK64(q->readers[id].read_pointer, read_cycles, new_read_pointer);
 
   // Check if the actual data that was copied is valid
-  if (!*q->read_valids[id]){
+  if (!q->readers[id].read_valid){
     msgq_msg_close(msg);
-    msgq_reset_reader(q);
+    msgq_reader_overrun(q);
+    goto start;
+  }
+
+  msgq_reader_consumed(q, read_cycles, read_pointer, write_cycles, write_pointer);
+  return msg->size;
+}
+
+
+
+// Copy all available messages, up to max_msgs and buf_size bytes, into buf in one pass.
+// Messages are stored like in the ring: an int64_t size followed by the data, aligned to 8 bytes.
+// Returns the number of messages and sets *used to the number of bytes written. If the next message
+// doesn't fit into an empty buf, 0 is returned and *used is set to the space it needs.
+int msgq_msg_recv_batch(msgq_queue_t * q, char * buf, size_t buf_size, size_t max_msgs, size_t * used){
+  *used = 0;
+  if (max_msgs == 0){
+    return 0;
+  }
+
+  // Only the latest message is of interest
+  if (q->read_conflate){
+    msgq_msg_t msg;
+    int rc = msgq_msg_recv(&msg, q);
+    if (rc <= 0){
+      return rc;
+    }
+
+    size_t needed = ALIGN(msg.size + sizeof(int64_t));
+    if (needed > buf_size){
+      // The message is dropped, a conflating reader only cares about the next one anyway
+      msgq_msg_close(&msg);
+      *used = needed;
+      return 0;
+    }
+
+    *(int64_t*)buf = msg.size;
+    memcpy(buf + sizeof(int64_t), msg.data, msg.size);
+    msgq_msg_close(&msg);
+    *used = needed;
+    return 1;
+  }
+
+ start:
+  if (!msgq_reader_attached(q)){
+    return 0;
+  }
+  int id = q->reader_id;
+
+  // Check valid
+  if (!q->readers[id].read_valid){
+    msgq_reader_overrun(q);
+    goto start;
+  }
+
+  uint32_t read_cycles, read_pointer;
+  UNPACK64(read_cycles, read_pointer, q->readers[id].read_pointer);
+
+  uint32_t write_cycles, write_pointer;
+  UNPACK64(write_cycles, write_pointer, *q->write_pointer);
+
+  uint32_t cycles = read_cycles, pointer = read_pointer;
+  size_t num = 0, out = 0;
+
+  while (pointer != write_pointer && num < max_msgs){
+    char * p = q->data + pointer;
+    std::int64_t size = *reinterpret_cast<std::atomic<int64_t>*>(p);
+
+    // Check if the size that was read is valid
+    if (!q->readers[id].read_valid){
+      msgq_reader_overrun(q);
+      goto start;
+    }
+
+    // If size is -1 the buffer was full, and we need to wrap around
+    if (size == -1){
+      cycles++;
+      pointer = 0;
+      continue;
+    }
+
+    assert((uint64_t)size < q->size);
+    assert(size > 0);
+
+    size_t total_msg_size = ALIGN(size + sizeof(int64_t));
+    if (out + total_msg_size > buf_size){
+      if (num == 0){
+        *used = total_msg_size;
+        return 0;
+      }
+      break;
+    }
+
+    memcpy(buf + out, p, sizeof(int64_t) + size);
+    out += total_msg_size;
+    pointer += total_msg_size;
+    num++;
+  }
+  __sync_synchronize();
+
+  // Check if the data that was copied is valid, the publisher has to pass the
+  // read pointer before it can overwrite any of the messages after it
+  if (!q->readers[id].read_valid){
+    msgq_reader_overrun(q);
+    goto start;
+  }
+
+  // Update read pointer once for the whole batch
+  PACK64(q->readers[id].read_pointer, cycles, pointer);
+
+  if (num > 0){
+    msgq_reader_t &r = q->readers[id];
+    uint64_t lag = (uint64_t)(write_cycles - read_cycles) * q->size + write_pointer - read_pointer;
+    stat_add(r.read_seq, num);
+    stat_add(r.num_read, num);
+    if (lag > r.max_lag.load(std::memory_order_relaxed)){
+      r.max_lag.store(lag, std::memory_order_relaxed);
+    }
+  }
+
+  *used = out;
+  return num;
+}
+
+// Like msgq_msg_recv, but msg->data points directly into the shared memory segment.
+// The data stays valid until it is overwritten by the publisher, which is tracked per reader.
+// msg must not be closed, call msgq_msg_release to check if it was valid during use.
+// A successful borrow replaces any previous lease of this reader.
+int msgq_msg_borrow(msgq_msg_t * msg, msgq_queue_t * q){
+ start:
+  if (!msgq_reader_attached(q)){
+    msg->size = 0;
+    return 0;
+  }
+  int id = q->reader_id;
+
+  // Check valid
+  if (!q->readers[id].read_valid){
+    msgq_reader_overrun(q);
     goto start;
   }
 
+  uint32_t read_cycles, read_pointer;
+  UNPACK64(read_cycles, read_pointer, q->readers[id].read_pointer);
 
+  uint32_t write_cycles, write_pointer;
+  UNPACK64(write_cycles, write_pointer, *q->write_pointer);
+
+  char * p = q->data + read_pointer;
+
+  // Check if new message is available
+  if (read_pointer == write_pointer) {
+    msg->size = 0;
+    return 0;
+  }
+
+  // Read potential message size
+  std::atomic<int64_t> *size_p = reinterpret_cast<std::atomic<int64_t>*>(p);
+  std::int64_t size = *size_p;
+
+  // Check if the size that was read is valid
+  if (!q->readers[id].read_valid){
+    msgq_reader_overrun(q);
+    goto start;
+  }
+
+  // If size is -1 the buffer was full, and we need to wrap around
+  if (size == -1){
+    read_cycles++;
+    PACK64(q->readers[id].read_pointer, read_cycles, 0);
+    goto start;
+  }
+
+  assert((uint64_t)size < q->size);
+  assert(size > 0);
+
+  uint32_t new_read_pointer = ALIGN(read_pointer + sizeof(std::int64_t) + size);
+
+  // If conflate is true, check if this is the latest message, else start over
+  if (q->read_conflate){
+    if (new_read_pointer != write_pointer){
+      // Update read pointer
+      PACK64(q->readers[id].read_pointer, read_cycles, new_read_pointer);
+      stat_add(q->readers[id].read_seq, 1);
+      goto start;
+    }
+  }
+
+  // Take the lease before moving the read pointer, from here on the
+  // publisher invalidates the lease instead of the reader
+  q->readers[id].lease_valid = false;
+  PACK64(q->readers[id].lease_pointer, read_cycles, read_pointer);
+  q->readers[id].lease_valid = true;
+  __sync_synchronize();
+
+  // Check if the message was overwritten before the lease was taken
+  if (!q->readers[id].read_valid){
+    q->readers[id].lease_valid = false;
+    msgq_reader_overrun(q);
+    goto start;
+  }
+
+  // Update read pointer
+  PACK64(q->readers[id].read_pointer, read_cycles, new_read_pointer);
+  msgq_reader_consumed(q, read_cycles, read_pointer, write_cycles, write_pointer);
+
+  msg->data = p + sizeof(int64_t);
+  msg->size = size;
   return msg->size;
 }
 
+// Returns true if the data of the last borrowed message was not overwritten
+bool msgq_msg_release(msgq_queue_t * q){
+  int id = q->reader_id;
+  if (id < 0){
+    return false; // evicted since the borrow
+  }
 
+  __sync_synchronize();
+  bool valid = (q->read_uid_local == q->readers[id].read_uid) && q->readers[id].lease_valid;
+  if (valid){
+    q->readers[id].lease_valid = false;
+  }
+  return valid;
+}
 
 int msgq_poll(msgq_pollitem_t * items, size_t nitems, int timeout){
   int num = 0;
@@ -425,18 +945,32 @@ int msgq_poll(msgq_pollitem_t * items, size_t nitems, int timeout){
     if (items[i].revents) num++;
   }
 
-  int ms = (timeout == -1) ? 100 : timeout;
-  struct timespec ts;
-  ts.tv_sec = ms / 1000;
-  ts.tv_nsec = (ms % 1000) * 1000 * 1000;
+  if (num > 0 || timeout == 0){
+    return num;
+  }
 
+  int slot = msgq_get_wake_slot();
+  std::atomic<uint32_t> *futex = (slot >= 0) ? wake_futex(wake_table, slot) : NULL;
+  std::atomic<uint32_t> dummy_futex(0);
 
-  while (num == 0) {
-    int ret;
+  auto deadline = std::chrono::steady_clock::now() + std::chrono::milliseconds(timeout);
 
-    ret = nanosleep(&ts, &ts);
+  while (num == 0) {
+    // Register before checking the queues, so a publisher either sees
+    // the registration or we see its updated write pointer
+    uint32_t seq = 0;
+    bool lost = false;
+    if (futex != NULL){
+      seq = *futex;
+      for (size_t i = 0; i < nitems; i++) {
+        if (items[i].q->reader_id >= 0){
+          items[i].q->readers[items[i].q->reader_id].wake_slot = slot + 1;
+        } else {
+          lost = true;
+        }
+      }
+    }
 
-    // Check if messages ready
     for (size_t i = 0; i < nitems; i++) {
       if (items[i].revents == 0 && msgq_msg_ready(items[i].q)){
         num += 1;
@@ -444,10 +978,39 @@ int msgq_poll(msgq_pollitem_t * items, size_t nitems, int timeout){
       }
     }
 
-    // exit if we had a timeout and the sleep finished
-    if (timeout != -1 && ret == 0){
+    if (num > 0){
       break;
     }
+
+    int ms = -1;
+    if (timeout != -1){
+      auto remaining = std::chrono::duration_cast<std::chrono::milliseconds>(deadline - std::chrono::steady_clock::now()).count();
+      if (remaining <= 0){
+        break;
+      }
+      ms = remaining;
+    }
+    if (lost && (ms == -1 || ms > 100)){
+      // Nobody wakes a reader without a slot, keep retrying to reconnect
+      ms = 100;
+    }
+
+    if (futex != NULL){
+      msgq_wait(futex, seq, ms);
+    } else {
+      // No wake slot available, degrade to sleeping for the full timeout
+      msgq_wait(&dummy_futex, 0, (ms == -1) ? 100 : ms);
+    }
+  }
+
+  // Unregister, unless the reader slot was taken over by someone else in the meantime
+  if (futex != NULL){
+    for (size_t i = 0; i < nitems; i++) {
+      uint64_t expected = slot + 1;
+      if (items[i].q->reader_id >= 0){
+        items[i].q->readers[items[i].q->reader_id].wake_slot.compare_exchange_strong(expected, 0);
+      }
+    }
   }
 
   return num;
@@ -456,7 +1019,7 @@ int msgq_poll(msgq_pollitem_t * items, size_t nitems, int timeout){
 bool msgq_all_readers_updated(msgq_queue_t *q) {
   uint64_t num_readers = *q->num_readers;
   for (uint64_t i = 0; i < num_readers; i++) {
-    if (*q->read_valids[i] && *q->write_pointer != *q->read_pointers[i]) {
+    if (q->readers[i].read_valid && *q->write_pointer != q->readers[i].read_pointer) {
       return false;
     }
   }
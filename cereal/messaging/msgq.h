@@ -5,34 +5,67 @@
 #include <atomic>
 
 #define DEFAULT_SEGMENT_SIZE (10 * 1024 * 1024)
-#define NUM_READERS 10
+#define DEFAULT_NUM_READERS 32
+#define SUBSCRIBER_TIMEOUT_MS 1000 // how long a new subscriber waits for a reader slot
+#define NUM_WAKE_SLOTS 1024
 #define ALIGN(n) ((n + (8 - 1)) & -8)
 
 #define UNPACK64(higher, lower, input) do {uint64_t tmp = input; higher = tmp >> 32; lower = tmp & 0xFFFFFFFF;} while (0)
 #define PACK64(output, higher, lower) output = ((uint64_t)higher << 32 ) | ((uint64_t)lower & 0xFFFFFFFF)
 
 struct  msgq_header_t {
-  uint64_t num_readers;
+  uint64_t num_readers; // high-water mark of used reader slots
+  uint64_t max_readers; // size of the reader table, fixed at creation
   uint64_t write_pointer;
   uint64_t write_uid;
-  uint64_t read_pointers[NUM_READERS];
-  uint64_t read_valids[NUM_READERS];
-  uint64_t read_uids[NUM_READERS];
+  uint64_t write_count; // number of messages published
+};
+
+// Reader table, located between the header and the data
+struct msgq_reader_t {
+  std::atomic<uint64_t> read_pointer;
+  std::atomic<uint64_t> read_valid;
+  std::atomic<uint64_t> read_uid; // 0 if the slot is free
+  std::atomic<uint64_t> read_pid; // process owning the slot, used to reclaim slots of dead readers
+  std::atomic<uint64_t> wake_slot; // wake slot + 1 of a reader blocked in msgq_poll, 0 if not waiting
+  std::atomic<uint64_t> lease_pointer; // start of the message borrowed by msgq_msg_borrow
+  std::atomic<uint64_t> lease_valid;
+
+  // Statistics, only written by the reader that owns the slot
+  std::atomic<uint64_t> read_seq; // write_count of the next message to read
+  std::atomic<uint64_t> num_read;
+  std::atomic<uint64_t> num_skipped; // messages lost because the reader was overrun
+  std::atomic<uint64_t> num_resets;
+  std::atomic<uint64_t> max_lag; // bytes between read and write pointer
+};
+
+// Futex words shared by all processes in /dev/shm/msgq_wake. Every polling thread
+// owns one slot, publishers bump and wake the slots registered by their readers.
+struct alignas(64) msgq_wake_slot_t {
+  uint32_t futex;
+  uint32_t pad;
+  uint64_t owner_tid;
+};
+
+struct msgq_wake_table_t {
+  msgq_wake_slot_t slots[NUM_WAKE_SLOTS];
 };
 
 struct msgq_queue_t {
   std::atomic<uint64_t> *num_readers;
   std::atomic<uint64_t> *write_pointer;
   std::atomic<uint64_t> *write_uid;
-  std::atomic<uint64_t> *read_pointers[NUM_READERS];
-  std::atomic<uint64_t> *read_valids[NUM_READERS];
-  std::atomic<uint64_t> *read_uids[NUM_READERS];
+  std::atomic<uint64_t> *write_count;
+  msgq_reader_t *readers;
+  size_t max_readers;
   char * mmap_p;
   char * data;
   size_t size;
   int reader_id;
+  bool reader_lost; // evicted and no slot to reconnect to yet
   uint64_t read_uid_local;
   uint64_t write_uid_local;
+  size_t write_reserved;
 
   bool read_conflate;
   std::string endpoint;
@@ -55,13 +88,21 @@ int msgq_msg_init_size(msgq_msg_t *msg, size_t size);
 int msgq_msg_init_data(msgq_msg_t *msg, char * data, size_t size);
 int msgq_msg_close(msgq_msg_t *msg);
 
-int msgq_new_queue(msgq_queue_t * q, const char * path, size_t size);
+size_t msgq_mmap_size(size_t size, size_t max_readers);
+bool msgq_init_shm();
+
+int msgq_new_queue(msgq_queue_t * q, const char * path, size_t size, size_t max_readers = DEFAULT_NUM_READERS);
 void msgq_close_queue(msgq_queue_t *q);
 void msgq_init_publisher(msgq_queue_t * q);
-void msgq_init_subscriber(msgq_queue_t * q);
+int msgq_init_subscriber(msgq_queue_t * q, int timeout_ms = SUBSCRIBER_TIMEOUT_MS);
 
 int msgq_msg_send(msgq_msg_t *msg, msgq_queue_t *q);
+int msgq_msg_reserve(msgq_msg_t *msg, msgq_queue_t *q);
+int msgq_msg_commit(msgq_msg_t *msg, msgq_queue_t *q);
 int msgq_msg_recv(msgq_msg_t *msg, msgq_queue_t *q);
+int msgq_msg_recv_batch(msgq_queue_t *q, char *buf, size_t buf_size, size_t max_msgs, size_t *used);
+int msgq_msg_borrow(msgq_msg_t *msg, msgq_queue_t *q);
+bool msgq_msg_release(msgq_queue_t *q);
 int msgq_msg_ready(msgq_queue_t * q);
 int msgq_poll(msgq_pollitem_t * items, size_t nitems, int timeout);
 
@@ -0,0 +1,132 @@
+// Compares publish-to-receive latency and subscriber CPU usage of the
+// futex based msgq_poll against a plain sleep-and-rescan polling loop.
+//
+// usage: msgq_bench [num_msgs] [rate_hz] [sleep_poll_ms]
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <thread>
+#include <vector>
+
+#include <sys/resource.h>
+#include <time.h>
+
+#include "msgq.h"
+
+static inline uint64_t nanos_since_boot() {
+  struct timespec t;
+  clock_gettime(CLOCK_MONOTONIC, &t);
+  return t.tv_sec * 1000000000ULL + t.tv_nsec;
+}
+
+static double thread_cpu_ms() {
+  struct rusage usage;
+  getrusage(RUSAGE_THREAD, &usage);
+  return (usage.ru_utime.tv_sec + usage.ru_stime.tv_sec) * 1e3 + (usage.ru_utime.tv_usec + usage.ru_stime.tv_usec) * 1e-3;
+}
+
+struct BenchResult {
+  std::vector<uint64_t> latencies;
+  double busy_cpu_ms = 0;
+  double idle_cpu_ms = 0;
+};
+
+// Block until a message is ready, either through msgq_poll or by sleeping and rescanning
+static bool wait_ready(msgq_queue_t *q, bool use_poll, int sleep_ms, int timeout_ms) {
+  if (use_poll) {
+    msgq_pollitem_t item = {.q = q};
+    return msgq_poll(&item, 1, timeout_ms) > 0;
+  }
+
+  auto deadline = std::chrono::steady_clock::now() + std::chrono::milliseconds(timeout_ms);
+  while (!msgq_msg_ready(q)) {
+    if (std::chrono::steady_clock::now() > deadline) return false;
+    struct timespec ts = {.tv_sec = sleep_ms / 1000, .tv_nsec = (sleep_ms % 1000) * 1000 * 1000};
+    nanosleep(&ts, NULL);
+  }
+  return true;
+}
+
+static BenchResult run(bool use_poll, int num_msgs, int rate_hz, int sleep_ms) {
+  const char *endpoint = "msgq_bench";
+  BenchResult result;
+
+  msgq_queue_t pub_q, sub_q;
+  msgq_new_queue(&pub_q, endpoint, DEFAULT_SEGMENT_SIZE);
+  msgq_init_publisher(&pub_q);
+  msgq_new_queue(&sub_q, endpoint, DEFAULT_SEGMENT_SIZE);
+  msgq_init_subscriber(&sub_q);
+
+  std::atomic<bool> idle_done(false);
+  const int idle_ms = 1000;
+
+  std::thread subscriber([&]() {
+    // Idle phase, nothing is published
+    double cpu_start = thread_cpu_ms();
+    while (!idle_done) {
+      wait_ready(&sub_q, use_poll, sleep_ms, 100);
+    }
+    result.idle_cpu_ms = thread_cpu_ms() - cpu_start;
+
+    cpu_start = thread_cpu_ms();
+    while ((int)result.latencies.size() < num_msgs) {
+      if (!wait_ready(&sub_q, use_poll, sleep_ms, 1000)) break;
+
+      msgq_msg_t msg;
+      while (msgq_msg_recv(&msg, &sub_q) > 0) {
+        uint64_t sent = *(uint64_t *)msg.data;
+        result.latencies.push_back(nanos_since_boot() - sent);
+        msgq_msg_close(&msg);
+      }
+    }
+    result.busy_cpu_ms = thread_cpu_ms() - cpu_start;
+  });
+
+  std::this_thread::sleep_for(std::chrono::milliseconds(idle_ms));
+  idle_done = true;
+
+  // Make sure the subscriber left the idle phase before publishing
+  std::this_thread::sleep_for(std::chrono::milliseconds(200));
+
+  char buf[256] = {};
+  for (int i = 0; i < num_msgs; i++) {
+    *(uint64_t *)buf = nanos_since_boot();
+    msgq_msg_t msg = {.size = sizeof(buf), .data = buf};
+    msgq_msg_send(&msg, &pub_q);
+    std::this_thread::sleep_for(std::chrono::microseconds(1000000 / rate_hz));
+  }
+
+  subscriber.join();
+  msgq_close_queue(&sub_q);
+  msgq_close_queue(&pub_q);
+  return result;
+}
+
+static void report(const char *name, BenchResult &r, int num_msgs) {
+  auto &l = r.latencies;
+  std::sort(l.begin(), l.end());
+  if (l.empty()) {
+    printf("%-12s no messages received\n", name);
+    return;
+  }
+
+  auto pct = [&](double p) { return l[std::min(l.size() - 1, (size_t)(p * l.size()))] / 1e3; };
+  printf("%-12s recv %5zu/%d  latency us: p50 %8.1f  p99 %8.1f  max %8.1f  cpu ms: idle %6.2f  busy %6.2f\n",
+         name, l.size(), num_msgs, pct(0.5), pct(0.99), l.back() / 1e3, r.idle_cpu_ms, r.busy_cpu_ms);
+}
+
+int main(int argc, char **argv) {
+  int num_msgs = argc > 1 ? atoi(argv[1]) : 1000;
+  int rate_hz = argc > 2 ? atoi(argv[2]) : 100;
+  int sleep_ms = argc > 3 ? atoi(argv[3]) : 1;
+
+  BenchResult poll = run(true, num_msgs, rate_hz, sleep_ms);
+  report("msgq_poll", poll, num_msgs);
+
+  BenchResult sleep = run(false, num_msgs, rate_hz, sleep_ms);
+  report("sleep poll", sleep, num_msgs);
+  return 0;
+}
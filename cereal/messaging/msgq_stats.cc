@@ -0,0 +1,75 @@
+// Dumps the per reader statistics of msgq queues, to find out which
+// process is falling behind without attaching a debugger.
+//
+// usage: msgq_stats [endpoint ...]   (defaults to all services)
+
+#include <cstdio>
+#include <string>
+#include <vector>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "msgq.h"
+#include "services.h"
+
+static void print_stats(const std::string &endpoint) {
+  std::string path = "/dev/shm/" + endpoint;
+  int fd = open(path.c_str(), O_RDONLY);
+  if (fd < 0) return;
+
+  // Only map the header and reader table, the data is not needed
+  struct stat st;
+  msgq_header_t header;
+  if (fstat(fd, &st) != 0 || (size_t)st.st_size < sizeof(header) || pread(fd, &header, sizeof(header), 0) != sizeof(header)) {
+    close(fd);
+    return;
+  }
+
+  size_t map_size = sizeof(msgq_header_t) + header.max_readers * sizeof(msgq_reader_t);
+  if ((size_t)st.st_size < map_size) {
+    close(fd);
+    return;
+  }
+
+  char *mem = (char *)mmap(NULL, map_size, PROT_READ, MAP_SHARED, fd, 0);
+  close(fd);
+  if (mem == MAP_FAILED) return;
+
+  const msgq_header_t *h = (const msgq_header_t *)mem;
+  const msgq_reader_t *readers = (const msgq_reader_t *)(mem + sizeof(msgq_header_t));
+
+  printf("%s: %llu messages, %llu/%llu reader slots\n", endpoint.c_str(),
+         (unsigned long long)h->write_count, (unsigned long long)h->num_readers, (unsigned long long)h->max_readers);
+
+  for (uint64_t i = 0; i < h->num_readers && i < h->max_readers; i++) {
+    const msgq_reader_t &r = readers[i];
+    uint64_t uid = r.read_uid;
+    if (uid == 0) continue;
+
+    uint64_t read_seq = r.read_seq;
+    uint64_t lag = h->write_count > read_seq ? h->write_count - read_seq : 0;
+    printf("  [%2llu] pid %6llu tid %6llu  read %10llu  skipped %8llu  resets %6llu  max lag %10llu B  behind %llu msgs\n",
+           (unsigned long long)i, (unsigned long long)r.read_pid.load(), (unsigned long long)(uid & 0xFFFFFFFF),
+           (unsigned long long)r.num_read.load(), (unsigned long long)r.num_skipped.load(),
+           (unsigned long long)r.num_resets.load(), (unsigned long long)r.max_lag.load(), (unsigned long long)lag);
+  }
+
+  munmap(mem, map_size);
+}
+
+int main(int argc, char **argv) {
+  std::vector<std::string> endpoints(argv + 1, argv + argc);
+  if (endpoints.empty()) {
+    for (const auto &it : services) {
+      endpoints.push_back(it.name);
+    }
+  }
+
+  for (auto &endpoint : endpoints) {
+    print_stats(endpoint);
+  }
+  return 0;
+}
@@ -0,0 +1,164 @@
+// Stress test for the msgq reader table. Dozens of readers subscribe to one
+// queue while short lived readers keep attaching and detaching, every reader
+// counts the messages it missed based on a sequence number in the payload.
+// Without arguments it also runs with more readers than slots, where the extra
+// readers have to give up instead of waiting forever.
+//
+// usage: msgq_stress [num_readers] [num_churn_readers] [num_msgs] [rate_hz] [max_readers]
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <unistd.h>
+
+#include "msgq.h"
+
+const size_t queue_size = 1024 * 1024;
+
+struct StressConfig {
+  const char *endpoint;
+  int num_readers, num_churn, num_msgs, rate_hz;
+  size_t max_readers;
+};
+
+struct ReaderStats {
+  uint64_t received = 0;
+  uint64_t dropped = 0;
+  bool rejected = false;
+};
+
+static void reader_thread(const StressConfig *config, ReaderStats *stats, std::atomic<bool> *started, std::atomic<bool> *done) {
+  msgq_queue_t q;
+  msgq_new_queue(&q, config->endpoint, queue_size, config->max_readers);
+  if (msgq_init_subscriber(&q) != 0) {
+    stats->rejected = true;
+    *started = true;
+    msgq_close_queue(&q);
+    return;
+  }
+  *started = true;
+
+  int64_t last_seq = -1;
+  while (!*done) {
+    msgq_pollitem_t item = {.q = &q};
+    if (msgq_poll(&item, 1, 100) == 0) continue;
+
+    msgq_msg_t msg;
+    while (msgq_msg_recv(&msg, &q) > 0) {
+      int64_t seq = *(int64_t *)msg.data;
+      if (last_seq >= 0 && seq > last_seq + 1) {
+        stats->dropped += seq - last_seq - 1;
+      }
+      last_seq = seq;
+      stats->received++;
+      msgq_msg_close(&msg);
+    }
+  }
+  msgq_close_queue(&q);
+}
+
+// Attaches, reads for a bit and detaches again, like a debugging tool would
+static void churn_thread(const StressConfig *config, std::atomic<bool> *done, std::atomic<uint64_t> *attaches,
+                         std::atomic<uint64_t> *rejects) {
+  while (!*done) {
+    msgq_queue_t q;
+    msgq_new_queue(&q, config->endpoint, queue_size, config->max_readers);
+    if (msgq_init_subscriber(&q) != 0) {
+      (*rejects)++;
+      msgq_close_queue(&q);
+      continue;
+    }
+    (*attaches)++;
+
+    for (int i = 0; i < 10 && !*done; i++) {
+      msgq_pollitem_t item = {.q = &q};
+      msgq_poll(&item, 1, 10);
+      msgq_msg_t msg;
+      while (msgq_msg_recv(&msg, &q) > 0) msgq_msg_close(&msg);
+    }
+    msgq_close_queue(&q);
+  }
+}
+
+static bool run(const StressConfig &config) {
+  // a leftover queue from a run with another table size can't be opened
+  unlink((std::string("/dev/shm/") + config.endpoint).c_str());
+
+  msgq_queue_t pub_q;
+  msgq_new_queue(&pub_q, config.endpoint, queue_size, config.max_readers);
+  msgq_init_publisher(&pub_q);
+
+  std::atomic<bool> done(false);
+  std::vector<ReaderStats> stats(config.num_readers);
+  std::vector<std::atomic<bool>> started(config.num_readers);
+  std::vector<std::thread> threads;
+  for (int i = 0; i < config.num_readers; i++) {
+    threads.emplace_back(reader_thread, &config, &stats[i], &started[i], &done);
+  }
+  for (auto &s : started) {
+    while (!s) std::this_thread::sleep_for(std::chrono::milliseconds(1));
+  }
+
+  std::atomic<bool> churn_done(false);
+  std::atomic<uint64_t> attaches(0), rejects(0);
+  std::vector<std::thread> churn_threads;
+  for (int i = 0; i < config.num_churn; i++) {
+    churn_threads.emplace_back(churn_thread, &config, &churn_done, &attaches, &rejects);
+  }
+
+  char buf[128] = {};
+  for (int64_t seq = 0; seq < config.num_msgs; seq++) {
+    *(int64_t *)buf = seq;
+    msgq_msg_t msg = {.size = sizeof(buf), .data = buf};
+    msgq_msg_send(&msg, &pub_q);
+    std::this_thread::sleep_for(std::chrono::microseconds(1000000 / config.rate_hz));
+  }
+
+  churn_done = true;
+  for (auto &t : churn_threads) t.join();
+
+  // Give the readers time to drain the queue
+  std::this_thread::sleep_for(std::chrono::milliseconds(200));
+  done = true;
+  for (auto &t : threads) t.join();
+
+  int subscribed = 0;
+  uint64_t total_received = 0, total_dropped = 0;
+  for (auto &s : stats) {
+    subscribed += !s.rejected;
+    total_received += s.received;
+    total_dropped += s.dropped;
+  }
+
+  printf("%s: readers: %d (%d rejected, +%d churning, %llu attaches, %llu rejected), table size: %zu\n", config.endpoint,
+         config.num_readers, config.num_readers - subscribed, config.num_churn, (unsigned long long)attaches.load(),
+         (unsigned long long)rejects.load(), config.max_readers);
+  printf("sent: %d  received: %llu/%llu  dropped: %llu\n", config.num_msgs,
+         (unsigned long long)total_received, (unsigned long long)config.num_msgs * subscribed,
+         (unsigned long long)total_dropped);
+
+  msgq_close_queue(&pub_q);
+
+  // Readers that keep up are never evicted, so exactly the ones that didn't fit are turned away
+  int expected_rejected = std::max(0, config.num_readers - (int)config.max_readers);
+  return total_dropped == 0 && config.num_readers - subscribed == expected_rejected;
+}
+
+int main(int argc, char **argv) {
+  if (argc > 1) {
+    StressConfig config = {"msgq_stress", atoi(argv[1]), argc > 2 ? atoi(argv[2]) : 8, argc > 3 ? atoi(argv[3]) : 5000,
+                           argc > 4 ? atoi(argv[4]) : 1000, argc > 5 ? (size_t)atoi(argv[5]) : DEFAULT_NUM_READERS};
+    return run(config) ? 0 : 1;
+  }
+
+  // Fills the table, then overfills it
+  bool ok = run({"msgq_stress", 24, 8, 5000, 1000, DEFAULT_NUM_READERS});
+  ok = run({"msgq_stress_overflow", 12, 4, 2000, 1000, 8}) && ok;
+  return ok ? 0 : 1;
+}
@@ -3,6 +3,7 @@
 #include <stdlib.h>
 #include <string>
 #include <mutex>
+#include <optional>
 
 #include "services.h"
 #include "messaging.h"
@@ -52,7 +53,8 @@ struct SubMaster::SubMessage {
   uint64_t rcv_time = 0, rcv_frame = 0;
   void *allocated_msg_reader = nullptr;
   capnp::FlatArrayMessageReader *msg_reader = nullptr;
-  AlignedBuffer aligned_buf;
+  AlignedBuffer aligned_buf[2];  // the current event and the copy of the next one
+  int aligned_idx = 0;
   cereal::Event::Reader event;
 };
 
@@ -86,14 +88,20 @@ void SubMaster::update(int timeout) {
   std::vector<std::pair<std::string, cereal::Event::Reader>> messages;
 
   for (auto s : sockets) {
-    Message *msg = s->receive(true);
-    if (msg == nullptr) continue;
+    // The event is read long after update returns, so it's copied out of the socket's
+    // buffer right away. A copy the publisher overwrote while it was being made is
+    // dropped and the previous event of this service stays in place.
+    const char *data;
+    size_t size;
+    if (!s->borrow(&data, &size)) continue;
 
     SubMessage *m = messages_.at(s);
+    kj::ArrayPtr<const capnp::word> words = m->aligned_buf[m->aligned_idx ^ 1].align(data, size);
+    if (!s->release()) continue;
+    m->aligned_idx ^= 1;
 
     m->msg_reader->~FlatArrayMessageReader();
-    m->msg_reader = new (m->allocated_msg_reader) capnp::FlatArrayMessageReader(m->aligned_buf.align(msg));
-    delete msg;
+    m->msg_reader = new (m->allocated_msg_reader) capnp::FlatArrayMessageReader(words);
     messages.push_back({m->name, m->msg_reader->getRoot<cereal::Event>()});
   }
 
@@ -137,14 +145,16 @@ bool SubMaster::all_(const std::vector<const char *> &service_list, bool valid,
 }
 
 void SubMaster::drain() {
+  MessageArena arena;
   while (true) {
     auto polls = poller_->poll(0);
     if (polls.size() == 0)
       break;
 
     for (auto sock : polls) {
-      Message *msg = sock->receive(true);
-      delete msg;
+      while (sock->receive_batch(&arena, 64, 64 * 1024) > 0) {
+        arena.clear();
+      }
     }
   }
 }
@@ -169,6 +179,12 @@ uint64_t SubMaster::rcv_time(const char *name) const {
   return services_.at(name)->rcv_time;
 }
 
+SubSocketStats SubMaster::stats(const char *name) const {
+  SubSocketStats stats;
+  services_.at(name)->socket->getStats(&stats);
+  return stats;
+}
+
 cereal::Event::Reader &SubMaster::operator[](const char *name) const {
   return services_.at(name)->event;
 };
@@ -184,6 +200,12 @@ SubMaster::~SubMaster() {
   }
 }
 
+struct PubMaster::Reservation {
+  capnp::word *segment = nullptr;
+  // constructed in place for every reservation, so reserving doesn't allocate
+  std::optional<MessageBuilder> builder;
+};
+
 PubMaster::PubMaster(const std::vector<const char *> &service_list) {
   for (auto name : service_list) {
     assert(get_service(name) != nullptr);
@@ -198,6 +220,53 @@ int PubMaster::send(const char *name, MessageBuilder &msg) {
   return send(name, bytes.begin(), bytes.size());
 }
 
+MessageBuilder &PubMaster::reserve(const char *name, size_t max_size) {
+  PubSocket *socket = sockets_.at(name);
+
+  auto it = reservations_.find(name);
+  if (it == reservations_.end()) {
+    it = reservations_.insert({name, new Reservation}).first;
+  }
+  Reservation *r = it->second;
+
+  // One word in front of the segment is left for the segment table
+  size_t segment_words = max_size / sizeof(capnp::word) + 1;
+  char *buf = socket->reserve((segment_words + 1) * sizeof(capnp::word));
+  if (buf != nullptr) {
+    r->segment = (capnp::word *)buf + 1;
+    memset(r->segment, 0, segment_words * sizeof(capnp::word));
+    r->builder.emplace(kj::arrayPtr(r->segment, segment_words));
+  } else {
+    r->segment = nullptr;
+    r->builder.emplace();
+  }
+  return *r->builder;
+}
+
+int PubMaster::commit(const char *name) {
+  Reservation *r = reservations_.at(name);
+  assert(r->builder);
+
+  int ret;
+  auto segments = r->builder->getSegmentsForOutput();
+  if (segments.size() == 1 && segments[0].begin() == r->segment) {
+    // Built in place, only the segment table is left to fill in
+    uint32_t *table = (uint32_t *)(r->segment - 1);
+    table[0] = 0;
+    table[1] = segments[0].size();
+    ret = sockets_.at(name)->commit((segments[0].size() + 1) * sizeof(capnp::word));
+  } else {
+    // Message outgrew the reserved space, flatten and send it the regular way
+    auto bytes = capnp::messageToFlatArray(segments);
+    ret = send(name, bytes.asBytes().begin(), bytes.asBytes().size());
+  }
+
+  r->builder.reset();
+  return ret;
+}
+
 PubMaster::~PubMaster() {
+  // builders first, their segments may be in the sockets' rings
+  for (auto &kv : reservations_) delete kv.second;
   for (auto s : sockets_) delete s.second;
 }
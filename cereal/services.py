@@ -1,6 +1,6 @@
 #!/usr/bin/env python3
 import os
-from typing import Optional
+from typing import Optional, Tuple
 
 TICI = os.path.isfile('/TICI')
 RESERVED_PORT = 8022  # sshd
@@ -12,12 +12,73 @@ def new_port(port: int):
   return port + 1 if port >= RESERVED_PORT else port
 
 
+# msgq ring sizing: every segment holds HISTORY_SECONDS worth of typical messages, so slow
+# readers aren't lapped, and at least 4 of the largest messages, which msgq needs to publish them.
+# Services at HIGH_RATE_FREQ or more never get less than the fixed size every service had
+# before (LEGACY_SEGMENT_SIZE, 10x for camera states), only low rate services shrink.
+HISTORY_SECONDS = 5
+DEFAULT_MESSAGE_SIZE = (1024, 16 * 1024)
+MIN_SEGMENT_SIZE = 1024 * 1024
+SEGMENT_ALIGN = 256 * 1024
+HIGH_RATE_FREQ = 10.
+LEGACY_SEGMENT_SIZE = 10 * 1024 * 1024
+LEGACY_CAMERA_STATE_SIZE = 10 * LEGACY_SEGMENT_SIZE
+
+# (typical, largest) message size in bytes, for services above DEFAULT_MESSAGE_SIZE.
+# Update with selfdrive/debug/msg_sizes.py on an rlog of a drive.
+message_sizes = {
+  "sensorEvents": (2 * 1024, 8 * 1024),
+  "can": (4 * 1024, 16 * 1024),
+  "liveTracks": (2 * 1024, 16 * 1024),
+  "logMessage": (1024, 64 * 1024),
+  "androidLog": (1024, 64 * 1024),
+  "longitudinalPlan": (2 * 1024, 8 * 1024),
+  "procLog": (64 * 1024, 256 * 1024),
+  "ubloxGnss": (2 * 1024, 8 * 1024),
+  "ubloxRaw": (2 * 1024, 8 * 1024),
+  "liveLocationKalman": (3 * 1024, 8 * 1024),
+  "lateralPlan": (3 * 1024, 8 * 1024),
+  "thumbnail": (64 * 1024, 256 * 1024),
+  "carParams": (8 * 1024, 32 * 1024),
+  "modelV2": (32 * 1024, 256 * 1024),
+  # camera states can carry a full debug image
+  "roadCameraState": (1024, 8 * 1024 * 1024),
+  "driverCameraState": (1024, 8 * 1024 * 1024),
+  "wideRoadCameraState": (1024, 8 * 1024 * 1024),
+}
+
+
+# msgq reader slots: every subscribing process and tool takes one, a new subscriber waits
+# for a free slot when all are taken by readers that keep up
+DEFAULT_READERS = 16
+
+# services most processes subscribe to
+reader_counts = {
+  "can": 32,
+  "carState": 32,
+  "controlsState": 32,
+  "deviceState": 32,
+  "modelV2": 32,
+}
+
+
+def segment_size(name: str, frequency: float, message_size: Tuple[int, int]) -> int:
+  typical, largest = message_size
+  sz = max(MIN_SEGMENT_SIZE, int(frequency * typical * HISTORY_SECONDS), 4 * largest)
+  if frequency >= HIGH_RATE_FREQ:
+    sz = max(sz, LEGACY_CAMERA_STATE_SIZE if name.endswith("CameraState") else LEGACY_SEGMENT_SIZE)
+  return (sz + SEGMENT_ALIGN - 1) // SEGMENT_ALIGN * SEGMENT_ALIGN
+
+
 class Service:
-  def __init__(self, port: int, should_log: bool, frequency: float, decimation: Optional[int] = None):
+  def __init__(self, name: str, port: int, should_log: bool, frequency: float, decimation: Optional[int] = None,
+               message_size: Tuple[int, int] = DEFAULT_MESSAGE_SIZE, max_readers: int = DEFAULT_READERS):
     self.port = port
     self.should_log = should_log
     self.frequency = frequency
     self.decimation = decimation
+    self.segment_size = segment_size(name, frequency, message_size)
+    self.max_readers = max_readers
 
 DCAM_FREQ = 10. if not TICI else 20.
 
@@ -62,8 +123,9 @@ services = {
   "managerState": (True, 2., 1),
   "uploaderState": (True, 0., 1),
 }
-service_list = {name: Service(new_port(idx), *vals) for  # type: ignore
-                idx, (name, vals) in enumerate(services.items())}
+service_list = {name: Service(name, new_port(idx), *vals, message_size=message_sizes.get(name, DEFAULT_MESSAGE_SIZE),  # type: ignore
+                              max_readers=reader_counts.get(name, DEFAULT_READERS))
+                for idx, (name, vals) in enumerate(services.items())}
 
 
 def build_header():
@@ -71,13 +133,13 @@ def build_header():
   h += "/* THIS IS AN AUTOGENERATED FILE, PLEASE EDIT services.py */\n"
   h += "#ifndef __SERVICES_H\n"
   h += "#define __SERVICES_H\n"
-  h += "struct service { char name[0x100]; int port; bool should_log; int frequency; int decimation; };\n"
+  h += "struct service { char name[0x100]; int port; bool should_log; int frequency; int decimation; int segment_size; int max_readers; };\n"
   h += "static struct service services[] = {\n"
   for k, v in service_list.items():
     should_log = "true" if v.should_log else "false"
     decimation = -1 if v.decimation is None else v.decimation
-    h += '  { "%s", %d, %s, %d, %d },\n' % \
-         (k, v.port, should_log, v.frequency, decimation)
+    h += '  { "%s", %d, %s, %d, %d, %d, %d },\n' % \
+         (k, v.port, should_log, v.frequency, decimation, v.segment_size, v.max_readers)
   h += "};\n"
   h += "#endif\n"
   return h
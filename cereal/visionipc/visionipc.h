@@ -1,10 +1,14 @@
 #pragma once
 
+#include <atomic>
 #include <cstdint>
 #include <cstddef>
 
 constexpr int VISIONIPC_MAX_FDS = 128;
 
+// Sends after which a lease is assumed to be leaked by a client that died
+constexpr uint32_t VISIONIPC_LEASE_TIMEOUT = 200;
+
 struct VisionIpcBufExtra {
   uint32_t frame_id;
   uint64_t timestamp_sof;
@@ -14,5 +18,26 @@ struct VisionIpcBufExtra {
 struct VisionIpcPacket {
   uint64_t server_id;
   size_t idx;
+  uint32_t seq;
   struct VisionIpcBufExtra extra;
 };
+
+// Shared between the server and its clients, one per stream. Clients lease the
+// buffer they received until they receive the next one, and the server only reuses
+// leased buffers when there is no other choice. A lease is the sequence number of
+// the send that published the buffer in the upper 32 bits and the number of clients
+// reading it in the lower 32. The sequence number is 0 while the server writes it.
+struct VisionIpcStreamState {
+  std::atomic<uint64_t> num_sent;
+  std::atomic<uint64_t> num_skipped;      // leased buffers get_buffer passed over
+  std::atomic<uint64_t> num_overwritten;  // leased buffers reused anyway
+  std::atomic<uint64_t> leases[VISIONIPC_MAX_FDS];
+};
+static_assert(std::atomic<uint64_t>::is_always_lock_free, "leases are shared between processes");
+
+struct VisionIpcStats {
+  uint64_t sent, skipped, overwritten;
+};
+
+inline uint32_t visionipc_lease_seq(uint64_t lease) { return lease >> 32; }
+inline uint32_t visionipc_lease_readers(uint64_t lease) { return lease & 0xFFFFFFFF; }
@@ -1,8 +1,11 @@
+#include <algorithm>
 #include <chrono>
 #include <cassert>
 #include <iostream>
 #include <thread>
 
+#include <sys/mman.h>
+
 #include "ipc.h"
 #include "visionipc_client.h"
 #include "visionipc_server.h"
@@ -15,15 +18,25 @@ VisionIpcClient::VisionIpcClient(std::string name, VisionStreamType type, bool c
   poller->registerSocket(sock);
 }
 
-// Connect is not thread safe. Do not use the buffers while calling connect
-bool VisionIpcClient::connect(bool blocking){
-  connected = false;
+void VisionIpcClient::disconnect(){
+  release();
+  if (state != nullptr) {
+    munmap(state, sizeof(VisionIpcStreamState));
+    state = nullptr;
+  }
 
-  // Cleanup old buffers on reconnect
   for (size_t i = 0; i < num_buffers; i++){
     buffers[i].free();
   }
   num_buffers = 0;
+}
+
+// Connect is not thread safe. Do not use the buffers while calling connect
+bool VisionIpcClient::connect(bool blocking){
+  connected = false;
+
+  // Cleanup old buffers on reconnect
+  disconnect();
 
   // Connect to server socket and ask for all FDs of type
   std::string path = "/tmp/visionipc_" + name;
@@ -46,14 +59,22 @@ bool VisionIpcClient::connect(bool blocking){
   int r = ipc_sendrecv_with_fds(true, socket_fd, &type, sizeof(type), nullptr, 0, nullptr);
   assert(r == sizeof(type));
 
-  // Get FDs
+  // Get FDs, the buffers and their lease state
   int fds[VISIONIPC_MAX_FDS];
   VisionBuf bufs[VISIONIPC_MAX_FDS];
-  r = ipc_sendrecv_with_fds(false, socket_fd, &bufs, sizeof(bufs), fds, VISIONIPC_MAX_FDS, &num_buffers);
+  int num_fds = 0;
+  r = ipc_sendrecv_with_fds(false, socket_fd, &bufs, sizeof(bufs), fds, VISIONIPC_MAX_FDS, &num_fds);
+  close(socket_fd);
 
+  num_buffers = num_fds - 1;
   assert(num_buffers > 0);
   assert(r == sizeof(VisionBuf) * num_buffers);
 
+  void *addr = mmap(NULL, sizeof(VisionIpcStreamState), PROT_READ | PROT_WRITE, MAP_SHARED, fds[num_buffers], 0);
+  assert(addr != MAP_FAILED);
+  close(fds[num_buffers]);
+  state = (VisionIpcStreamState *)addr;
+
   // Import buffers
   for (size_t i = 0; i < num_buffers; i++){
     buffers[i] = bufs[i];
@@ -79,9 +100,16 @@ VisionBuf * VisionIpcClient::recv(VisionIpcBufExtra * extra, const int timeout_m
     return nullptr;
   }
 
+  VisionBuf * buf = nullptr;
+  receive(&buf, extra);
+  return buf;
+}
+
+// Returns false when nothing is queued. buf is left null when the frame can't be used
+bool VisionIpcClient::receive(VisionBuf ** buf_out, VisionIpcBufExtra * extra){
   Message * r = sock->receive(true);
   if (r == nullptr){
-    return nullptr;
+    return false;
   }
 
   // Get buffer
@@ -94,7 +122,14 @@ VisionBuf * VisionIpcClient::recv(VisionIpcBufExtra * extra, const int timeout_m
   if (buf->server_id != packet->server_id){
     connected = false;
     delete r;
-    return nullptr;
+    return true;
+  }
+
+  // keep the previous frame when this one can't be leased anymore
+  if (!acquire(packet->idx, packet->seq)) {
+    num_dropped++;
+    delete r;
+    return true;
   }
 
   if (extra) {
@@ -103,17 +138,152 @@ VisionBuf * VisionIpcClient::recv(VisionIpcBufExtra * extra, const int timeout_m
 
   buf->sync(VISIONBUF_SYNC_TO_DEVICE);
   delete r;
-  return buf;
+  *buf_out = buf;
+  return true;
+}
+
+
+
+bool VisionIpcClient::acquire(size_t idx, uint32_t seq){
+  uint64_t lease = state->leases[idx].load();
+  do {
+    // the server reused it since it was sent
+    if (visionipc_lease_seq(lease) != seq) return false;
+  } while (!state->leases[idx].compare_exchange_weak(lease, lease + 1));
+
+  release();
+  leased_idx = idx;
+  leased_seq = seq;
+  return true;
 }
 
+void VisionIpcClient::release(){
+  if (leased_idx < 0) return;
 
+  uint64_t lease = state->leases[leased_idx].load();
+  do {
+    // a lease that timed out, the buffer isn't ours anymore
+    if (visionipc_lease_seq(lease) != leased_seq || visionipc_lease_readers(lease) == 0) break;
+  } while (!state->leases[leased_idx].compare_exchange_weak(lease, lease - 1));
+  leased_idx = -1;
+}
+
+VisionIpcStats VisionIpcClient::get_stats(){
+  if (state == nullptr) return {};
+  return {state->num_sent.load(), state->num_skipped.load(), state->num_overwritten.load()};
+}
 
 VisionIpcClient::~VisionIpcClient(){
-  for (size_t i = 0; i < num_buffers; i++){
-    buffers[i].free();
-  }
+  disconnect();
 
   delete sock;
   delete poller;
   delete msg_ctx;
 }
+
+
+
+VisionIpcMultiClient::VisionIpcMultiClient(std::string name, std::vector<VisionStreamType> types, bool latest_only, uint64_t match_tolerance_ns, cl_device_id device_id, cl_context ctx)
+  : latest_only(latest_only), match_tolerance_ns(match_tolerance_ns) {
+  assert(types.size() > 0);
+  poller = Poller::create();
+  for (auto type : types) {
+    Stream s = {type, std::make_unique<VisionIpcClient>(name, type, latest_only, device_id, ctx)};
+    poller->registerSocket(s.client->sock);
+    streams.push_back(std::move(s));
+  }
+}
+
+bool VisionIpcMultiClient::connect(bool blocking){
+  connected = false;
+  for (auto &s : streams) {
+    s.frame = {};
+    if (!s.client->connected && !s.client->connect(blocking)) {
+      return false;
+    }
+  }
+  connected = true;
+  return true;
+}
+
+VisionIpcClient * VisionIpcMultiClient::client(VisionStreamType type){
+  for (auto &s : streams) {
+    if (s.type == type) return s.client.get();
+  }
+  return nullptr;
+}
+
+uint64_t VisionIpcMultiClient::frame_key(const VisionIpcFrame &f){
+  return match_tolerance_ns > 0 ? f.extra.timestamp_eof : f.extra.frame_id;
+}
+
+uint64_t VisionIpcMultiClient::target_key(){
+  uint64_t target = 0;
+  for (auto &s : streams) {
+    if (s.frame.buf) target = std::max(target, frame_key(s.frame));
+  }
+  return target;
+}
+
+// a stream is behind when its frame can't be in a set with the newest frame
+bool VisionIpcMultiClient::needs_frame(const Stream &s){
+  return s.frame.buf == nullptr || frame_key(s.frame) + match_tolerance_ns < target_key();
+}
+
+// Receives what is queued, until the stream caught up with the others unless only the latest frames matter
+void VisionIpcMultiClient::drain(Stream &s){
+  while (latest_only || needs_frame(s)) {
+    VisionIpcFrame f;
+    if (!s.client->receive(&f.buf, &f.extra)) break;
+
+    if (!s.client->connected) {
+      connected = false;
+      return;
+    }
+    if (f.buf) {
+      if (s.frame.buf) num_unmatched++;
+      s.frame = f;
+    }
+  }
+}
+
+bool VisionIpcMultiClient::recv(std::vector<VisionIpcFrame> &frames, const int timeout_ms){
+  const auto deadline = std::chrono::steady_clock::now() + std::chrono::milliseconds(timeout_ms);
+
+  while (true) {
+    for (auto &s : streams) {
+      drain(s);
+    }
+    if (!connected) return false;
+
+    const bool complete = std::none_of(streams.begin(), streams.end(), [&](auto &s) { return needs_frame(s); });
+    if (complete) {
+      frames.resize(streams.size());
+      for (size_t i = 0; i < streams.size(); i++) {
+        frames[i] = streams[i].frame;
+        streams[i].frame = {};
+      }
+      return true;
+    }
+
+    // Wait for any stream when none has a frame yet, else for one that is behind.
+    // Waiting on every socket would spin on the ones that are ahead
+    int remaining = std::chrono::duration_cast<std::chrono::milliseconds>(deadline - std::chrono::steady_clock::now()).count();
+    if (remaining <= 0) return false;
+
+    Poller * wait_on = poller;
+    if (std::any_of(streams.begin(), streams.end(), [](auto &s) { return s.frame.buf != nullptr; })) {
+      for (auto &s : streams) {
+        if (needs_frame(s)) {
+          wait_on = s.client->poller;
+          break;
+        }
+      }
+    }
+    if (wait_on->poll(remaining).empty()) return false;
+  }
+}
+
+VisionIpcMultiClient::~VisionIpcMultiClient(){
+  delete poller;
+}
@@ -1,4 +1,5 @@
 #pragma once
+#include <memory>
 #include <vector>
 #include <string>
 #include <unistd.h>
@@ -19,14 +20,68 @@ private:
   cl_device_id device_id = nullptr;
   cl_context ctx = nullptr;
 
+  // the buffer returned by the last recv, leased until the next one
+  VisionIpcStreamState *state = nullptr;
+  int leased_idx = -1;
+  uint32_t leased_seq = 0;
+
+  friend class VisionIpcMultiClient;
+
   void init_msgq(bool conflate);
+  bool receive(VisionBuf ** buf, VisionIpcBufExtra * extra);
+  bool acquire(size_t idx, uint32_t seq);
+  void release();
+  void disconnect();
 
 public:
   bool connected = false;
   int num_buffers = 0;
   VisionBuf buffers[VISIONIPC_MAX_FDS];
+  uint64_t num_dropped = 0;  // frames reused by the server before they were received
   VisionIpcClient(std::string name, VisionStreamType type, bool conflate, cl_device_id device_id=nullptr, cl_context ctx=nullptr);
   ~VisionIpcClient();
+  // The buffer stays valid until the next frame is received
   VisionBuf * recv(VisionIpcBufExtra * extra=nullptr, const int timeout_ms=100);
   bool connect(bool blocking=true);
+  VisionIpcStats get_stats();
+};
+
+struct VisionIpcFrame {
+  VisionBuf * buf = nullptr;
+  VisionIpcBufExtra extra = {};
+};
+
+// Receives several streams of one server on a single thread, as sets of frames with the
+// same frame_id, or with a match_tolerance_ns, with timestamp_eofs at most that far from
+// the newest frame of the set for streams whose frame ids don't line up. With latest_only
+// the sockets conflate and recv returns the newest complete set, otherwise every set is
+// returned in order. Frames that don't have a match on every stream are skipped either way.
+class VisionIpcMultiClient {
+private:
+  struct Stream {
+    VisionStreamType type;
+    std::unique_ptr<VisionIpcClient> client;
+    VisionIpcFrame frame;  // newest frame received, waiting for the others
+  };
+
+  std::vector<Stream> streams;
+  Poller * poller;  // every stream
+  bool latest_only;
+  uint64_t match_tolerance_ns;  // 0 matches frame ids
+
+  // frame_id, or timestamp_eof when matching timestamps
+  uint64_t frame_key(const VisionIpcFrame &f);
+  uint64_t target_key();
+  bool needs_frame(const Stream &s);
+  void drain(Stream &s);
+
+public:
+  bool connected = false;
+  uint64_t num_unmatched = 0;  // frames replaced by a newer one before their set was complete
+  VisionIpcMultiClient(std::string name, std::vector<VisionStreamType> types, bool latest_only, uint64_t match_tolerance_ns=0, cl_device_id device_id=nullptr, cl_context ctx=nullptr);
+  ~VisionIpcMultiClient();
+  bool connect(bool blocking=true);
+  // Fills frames in the order of the types. The buffers stay valid until the next recv
+  bool recv(std::vector<VisionIpcFrame> &frames, const int timeout_ms=100);
+  VisionIpcClient * client(VisionStreamType type);
 };
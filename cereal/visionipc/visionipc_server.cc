@@ -1,9 +1,12 @@
 #include <iostream>
 #include <chrono>
 #include <cassert>
+#include <new>
 #include <random>
 
+#include <fcntl.h>
 #include <poll.h>
+#include <sys/mman.h>
 #include <sys/socket.h>
 #include <unistd.h>
 
@@ -20,6 +23,26 @@ std::string get_endpoint_name(std::string name, VisionStreamType type){
   }
 }
 
+static VisionIpcStreamState *create_stream_state(int *fd) {
+  static std::atomic<int> counter = 0;
+  char path[0x100];
+#ifdef __APPLE__
+  snprintf(path, sizeof(path), "/tmp/visionipc_state_%d_%d", getpid(), counter++);
+#else
+  snprintf(path, sizeof(path), "/dev/shm/visionipc_state_%d_%d", getpid(), counter++);
+#endif
+
+  *fd = open(path, O_RDWR | O_CREAT | O_CLOEXEC, 0777);
+  assert(*fd >= 0);
+  unlink(path);
+
+  int err = ftruncate(*fd, sizeof(VisionIpcStreamState));
+  assert(err == 0);
+  void *addr = mmap(NULL, sizeof(VisionIpcStreamState), PROT_READ | PROT_WRITE, MAP_SHARED, *fd, 0);
+  assert(addr != MAP_FAILED);
+  return new (addr) VisionIpcStreamState();
+}
+
 VisionIpcServer::VisionIpcServer(std::string name, cl_device_id device_id, cl_context ctx) : name(name), device_id(device_id), ctx(ctx) {
   msg_ctx = Context::create();
 
@@ -60,6 +83,7 @@ void VisionIpcServer::create_buffers(VisionStreamType type, size_t num_buffers,
   }
 
   cur_idx[type] = 0;
+  states[type] = create_stream_state(&state_fds[type]);
 
   // Create msgq publisher for each of the `name` + type combos
   // TODO: compute port number directly if using zmq
@@ -111,10 +135,10 @@ void VisionIpcServer::listener(){
     }
 
     int fds[VISIONIPC_MAX_FDS];
-    int num_fds = buffers[type].size();
+    int num_bufs = buffers[type].size();
     VisionBuf bufs[VISIONIPC_MAX_FDS];
 
-    for (int i = 0; i < num_fds; i++){
+    for (int i = 0; i < num_bufs; i++){
       fds[i] = buffers[type][i]->fd;
       bufs[i] = *buffers[type][i];
 
@@ -127,7 +151,9 @@ void VisionIpcServer::listener(){
       bufs[i].server_id = server_id;
     }
 
-    r = ipc_sendrecv_with_fds(true, fd, &bufs, sizeof(VisionBuf) * num_fds, fds, num_fds, nullptr);
+    // the lease state goes last
+    fds[num_bufs] = state_fds[type];
+    r = ipc_sendrecv_with_fds(true, fd, &bufs, sizeof(VisionBuf) * num_bufs, fds, num_bufs + 1, nullptr);
 
     close(fd);
   }
@@ -138,11 +164,44 @@ void VisionIpcServer::listener(){
 
 
 
+// Takes a buffer for writing when no client is reading it, or anyway if force is set.
+// Leases older than VISIONIPC_LEASE_TIMEOUT sends are ignored.
+bool VisionIpcServer::claim(VisionIpcStreamState *state, size_t idx, bool force){
+  uint64_t lease = state->leases[idx].load();
+  while (true) {
+    uint32_t seq = visionipc_lease_seq(lease);
+    bool leased = visionipc_lease_readers(lease) > 0 && (uint32_t)state->num_sent.load() - seq < VISIONIPC_LEASE_TIMEOUT;
+    if (leased && !force) return false;
+    if (state->leases[idx].compare_exchange_weak(lease, 0)) {
+      if (visionipc_lease_readers(lease) > 0) state->num_overwritten++;
+      return true;
+    }
+  }
+}
+
 VisionBuf * VisionIpcServer::get_buffer(VisionStreamType type){
-  // Do we want to keep track if the buffer has been sent out yet and warn user?
   assert(buffers.count(type));
-  auto b = buffers[type];
-  return b[cur_idx[type]++ % b.size()];
+  auto &b = buffers[type];
+  VisionIpcStreamState *state = states[type];
+
+  for (size_t i = 0; i < b.size(); i++) {
+    size_t idx = cur_idx[type]++ % b.size();
+    if (claim(state, idx, false)) {
+      return b[idx];
+    }
+    state->num_skipped++;
+  }
+
+  // every buffer is being read, the oldest one gets torn
+  size_t idx = cur_idx[type]++ % b.size();
+  claim(state, idx, true);
+  return b[idx];
+}
+
+VisionIpcStats VisionIpcServer::get_stats(VisionStreamType type){
+  assert(states.count(type));
+  VisionIpcStreamState *state = states[type];
+  return {state->num_sent.load(), state->num_skipped.load(), state->num_overwritten.load()};
 }
 
 void VisionIpcServer::send(VisionBuf * buf, VisionIpcBufExtra * extra, bool sync){
@@ -151,9 +210,15 @@ void VisionIpcServer::send(VisionBuf * buf, VisionIpcBufExtra * extra, bool sync
   assert(buf->idx < buffers[buf->type].size());
 
   // Send over correct msgq socket
+  // publish it, clients can lease it from now on
+  VisionIpcStreamState *state = states[buf->type];
+  uint32_t seq = (uint32_t)(state->num_sent.fetch_add(1) % UINT32_MAX) + 1;
+  state->leases[buf->idx].store((uint64_t)seq << 32);
+
   VisionIpcPacket packet = {0};
   packet.server_id = server_id;
   packet.idx = buf->idx;
+  packet.seq = seq;
   packet.extra = *extra;
 
   sockets[buf->type]->send((char*)&packet, sizeof(packet));
@@ -171,6 +236,11 @@ VisionIpcServer::~VisionIpcServer(){
     }
   }
 
+  for (auto const& [type, state] : states) {
+    munmap(state, sizeof(VisionIpcStreamState));
+    close(state_fds[type]);
+  }
+
   // Messaging cleanup
   for( auto const& [type, sock] : sockets ) {
     delete sock;
@@ -81,21 +81,18 @@ TEST_CASE("Send single buffer"){
 
 TEST_CASE("Test no conflate"){
   VisionIpcServer server("camerad");
-  server.create_buffers(VISION_STREAM_YUV_BACK, 1, true, 100, 100);
+  server.create_buffers(VISION_STREAM_YUV_BACK, 2, true, 100, 100);
   server.start_listener();
 
   VisionIpcClient client = VisionIpcClient("camerad", VISION_STREAM_YUV_BACK, false);
   REQUIRE(client.connect());
   zmq_sleep();
 
-  VisionBuf * buf = server.get_buffer(VISION_STREAM_YUV_BACK);
-  REQUIRE(buf != nullptr);
-
   VisionIpcBufExtra extra = {0};
   extra.frame_id = 1;
-  server.send(buf, &extra);
+  server.send(server.get_buffer(VISION_STREAM_YUV_BACK), &extra);
   extra.frame_id = 2;
-  server.send(buf, &extra);
+  server.send(server.get_buffer(VISION_STREAM_YUV_BACK), &extra);
 
   VisionIpcBufExtra extra_recv = {0};
   VisionBuf * recv_buf = client.recv(&extra_recv);
@@ -133,3 +130,224 @@ TEST_CASE("Test conflate"){
   recv_buf = client.recv(&extra_recv);
   REQUIRE(recv_buf == nullptr);
 }
+
+static void send_frame(VisionIpcServer &server, uint32_t frame_id){
+  VisionBuf * buf = server.get_buffer(VISION_STREAM_YUV_BACK);
+  *((uint32_t*)buf->addr) = frame_id;
+  VisionIpcBufExtra extra = {0};
+  extra.frame_id = frame_id;
+  server.send(buf, &extra);
+}
+
+TEST_CASE("Leased buffers are skipped"){
+  VisionIpcServer server("camerad");
+  server.create_buffers(VISION_STREAM_YUV_BACK, 3, false, 100, 100);
+  server.start_listener();
+
+  VisionIpcClient client = VisionIpcClient("camerad", VISION_STREAM_YUV_BACK, false);
+  REQUIRE(client.connect());
+  zmq_sleep();
+
+  send_frame(server, 1);
+  VisionIpcBufExtra extra = {0};
+  VisionBuf * leased = client.recv(&extra);
+  REQUIRE(leased != nullptr);
+  REQUIRE(extra.frame_id == 1);
+
+  // more frames than buffers, the leased one is left alone
+  for (uint32_t i = 2; i < 10; i++) {
+    send_frame(server, i);
+  }
+  REQUIRE(*(uint32_t*)leased->addr == 1);
+
+  VisionIpcStats stats = server.get_stats(VISION_STREAM_YUV_BACK);
+  REQUIRE(stats.sent == 9);
+  REQUIRE(stats.skipped == 3);
+  REQUIRE(stats.overwritten == 0);
+
+  // the frames whose buffers were reused are dropped instead of torn
+  for (uint32_t i = 2; i < 10; i++) {
+    VisionBuf * buf = client.recv(&extra);
+    if (buf != nullptr) {
+      REQUIRE(*(uint32_t*)buf->addr == extra.frame_id);
+    }
+  }
+  REQUIRE(client.num_dropped == 6);
+  REQUIRE(client.recv(&extra, 10) == nullptr);
+}
+
+TEST_CASE("Overwrite when every buffer is leased"){
+  VisionIpcServer server("camerad");
+  server.create_buffers(VISION_STREAM_YUV_BACK, 1, false, 100, 100);
+  server.start_listener();
+
+  VisionIpcClient client = VisionIpcClient("camerad", VISION_STREAM_YUV_BACK, false);
+  REQUIRE(client.connect());
+  zmq_sleep();
+
+  send_frame(server, 1);
+  REQUIRE(client.recv() != nullptr);
+
+  send_frame(server, 2);
+  VisionIpcStats stats = client.get_stats();
+  REQUIRE(stats.sent == 2);
+  REQUIRE(stats.overwritten == 1);
+
+  VisionIpcBufExtra extra = {0};
+  VisionBuf * buf = client.recv(&extra);
+  REQUIRE(buf != nullptr);
+  REQUIRE(extra.frame_id == 2);
+  REQUIRE(*(uint32_t*)buf->addr == 2);
+}
+
+TEST_CASE("Stale leases time out"){
+  VisionIpcServer server("camerad");
+  server.create_buffers(VISION_STREAM_YUV_BACK, 2, false, 100, 100);
+  server.start_listener();
+
+  VisionIpcClient client = VisionIpcClient("camerad", VISION_STREAM_YUV_BACK, false);
+  REQUIRE(client.connect());
+  zmq_sleep();
+
+  // a client that stopped receiving holds on to its lease
+  send_frame(server, 0);
+  REQUIRE(client.recv() != nullptr);
+
+  for (uint32_t i = 1; i < VISIONIPC_LEASE_TIMEOUT; i++) {
+    send_frame(server, i);
+  }
+  REQUIRE(server.get_stats(VISION_STREAM_YUV_BACK).overwritten == 0);
+
+  send_frame(server, VISIONIPC_LEASE_TIMEOUT);
+  send_frame(server, VISIONIPC_LEASE_TIMEOUT + 1);
+  REQUIRE(server.get_stats(VISION_STREAM_YUV_BACK).overwritten == 1);
+}
+
+static void send_frame(VisionIpcServer &server, VisionStreamType type, uint32_t frame_id){
+  VisionBuf * buf = server.get_buffer(type);
+  *((uint32_t*)buf->addr) = frame_id;
+  VisionIpcBufExtra extra = {0};
+  extra.frame_id = frame_id;
+  server.send(buf, &extra);
+}
+
+static void require_set(const std::vector<VisionIpcFrame> &frames, uint32_t frame_id){
+  REQUIRE(frames.size() == 2);
+  for (auto &f : frames) {
+    REQUIRE(f.extra.frame_id == frame_id);
+    REQUIRE(*(uint32_t*)f.buf->addr == frame_id);
+  }
+}
+
+TEST_CASE("Multi client returns matching sets in order"){
+  VisionIpcServer server("camerad");
+  server.create_buffers(VISION_STREAM_YUV_BACK, 4, false, 100, 100);
+  server.create_buffers(VISION_STREAM_YUV_WIDE, 4, false, 100, 100);
+  server.start_listener();
+
+  VisionIpcMultiClient client("camerad", {VISION_STREAM_YUV_BACK, VISION_STREAM_YUV_WIDE}, false);
+  REQUIRE(client.connect());
+  REQUIRE(client.client(VISION_STREAM_YUV_WIDE)->num_buffers == 4);
+  zmq_sleep();
+
+  // the wide camera is a frame behind, and misses frame 2
+  send_frame(server, VISION_STREAM_YUV_BACK, 1);
+  send_frame(server, VISION_STREAM_YUV_BACK, 2);
+  send_frame(server, VISION_STREAM_YUV_WIDE, 1);
+  send_frame(server, VISION_STREAM_YUV_BACK, 3);
+  send_frame(server, VISION_STREAM_YUV_WIDE, 3);
+
+  std::vector<VisionIpcFrame> frames;
+  REQUIRE(client.recv(frames));
+  require_set(frames, 1);
+  REQUIRE(client.recv(frames));
+  require_set(frames, 3);
+  REQUIRE(client.num_unmatched == 1);
+
+  // only one stream
+  send_frame(server, VISION_STREAM_YUV_BACK, 4);
+  REQUIRE(!client.recv(frames, 10));
+  send_frame(server, VISION_STREAM_YUV_WIDE, 4);
+  REQUIRE(client.recv(frames));
+  require_set(frames, 4);
+}
+
+TEST_CASE("Multi client latest only"){
+  VisionIpcServer server("camerad");
+  server.create_buffers(VISION_STREAM_YUV_BACK, 4, false, 100, 100);
+  server.create_buffers(VISION_STREAM_YUV_WIDE, 4, false, 100, 100);
+  server.start_listener();
+
+  VisionIpcMultiClient client("camerad", {VISION_STREAM_YUV_BACK, VISION_STREAM_YUV_WIDE}, true);
+  REQUIRE(client.connect());
+  zmq_sleep();
+
+  for (uint32_t i = 1; i <= 5; i++) {
+    send_frame(server, VISION_STREAM_YUV_BACK, i);
+    send_frame(server, VISION_STREAM_YUV_WIDE, i);
+  }
+
+  std::vector<VisionIpcFrame> frames;
+  REQUIRE(client.recv(frames));
+  require_set(frames, 5);
+
+  // the road camera's frame waits for the wide camera's
+  send_frame(server, VISION_STREAM_YUV_BACK, 6);
+  REQUIRE(!client.recv(frames, 10));
+  send_frame(server, VISION_STREAM_YUV_WIDE, 6);
+  REQUIRE(client.recv(frames));
+  require_set(frames, 6);
+  REQUIRE(!client.recv(frames, 10));
+}
+
+TEST_CASE("Multi client matches timestamps when frame ids are offset"){
+  VisionIpcServer server("camerad");
+  server.create_buffers(VISION_STREAM_YUV_BACK, 4, false, 100, 100);
+  server.create_buffers(VISION_STREAM_YUV_WIDE, 4, false, 100, 100);
+  server.start_listener();
+
+  // 20 fps, the wide camera's frames end 2 ms after the road camera's
+  const uint64_t dt = 50000000ULL, skew = 2000000ULL, tolerance = 10000000ULL;
+  const uint32_t wide_offset = 1000;
+  auto send = [&](VisionStreamType type, uint32_t i) {
+    VisionBuf * buf = server.get_buffer(type);
+    VisionIpcBufExtra extra = {0};
+    extra.frame_id = type == VISION_STREAM_YUV_WIDE ? i + wide_offset : i;
+    extra.timestamp_eof = i * dt + (type == VISION_STREAM_YUV_WIDE ? skew : 0);
+    *((uint32_t*)buf->addr) = extra.frame_id;
+    server.send(buf, &extra);
+  };
+  auto require_pair = [&](const std::vector<VisionIpcFrame> &frames, uint32_t i) {
+    REQUIRE(frames.size() == 2);
+    REQUIRE(frames[0].extra.frame_id == i);
+    REQUIRE(frames[1].extra.frame_id == i + wide_offset);
+    REQUIRE(*(uint32_t*)frames[1].buf->addr == i + wide_offset);
+  };
+
+  VisionIpcMultiClient client("camerad", {VISION_STREAM_YUV_BACK, VISION_STREAM_YUV_WIDE}, false, tolerance);
+  REQUIRE(client.connect());
+  zmq_sleep();
+
+  // the wide camera is a frame behind, and misses frame 2
+  send(VISION_STREAM_YUV_BACK, 1);
+  send(VISION_STREAM_YUV_BACK, 2);
+  send(VISION_STREAM_YUV_WIDE, 1);
+  send(VISION_STREAM_YUV_BACK, 3);
+  send(VISION_STREAM_YUV_WIDE, 3);
+
+  std::vector<VisionIpcFrame> frames;
+  REQUIRE(client.recv(frames));
+  require_pair(frames, 1);
+  REQUIRE(client.recv(frames));
+  require_pair(frames, 3);
+  REQUIRE(client.num_unmatched == 1);
+
+  // a frame outside the tolerance waits for its match
+  send(VISION_STREAM_YUV_WIDE, 4);
+  send(VISION_STREAM_YUV_BACK, 5);
+  REQUIRE(!client.recv(frames, 10));
+  send(VISION_STREAM_YUV_WIDE, 5);
+  REQUIRE(client.recv(frames));
+  require_pair(frames, 5);
+  REQUIRE(client.num_unmatched == 2);
+}
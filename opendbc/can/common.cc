@@ -1,13 +1,21 @@
 #include "common.h"
 
+// Sum of the bytes of x, adds neighbouring bytes into 16 bit lanes and the lanes with a multiply
+static inline unsigned int byte_sum(uint64_t x) {
+  x = (x & 0x00FF00FF00FF00FFULL) + ((x >> 8) & 0x00FF00FF00FF00FFULL);
+  return (x * 0x0001000100010001ULL) >> 48;
+}
+
+static inline unsigned int nibble_sum(uint64_t x) {
+  return byte_sum(x & 0x0F0F0F0F0F0F0F0FULL) + byte_sum((x >> 4) & 0x0F0F0F0F0F0F0F0FULL);
+}
+
 unsigned int honda_checksum(unsigned int address, uint64_t d, int l) {
   d >>= ((8-l)*8); // remove padding
   d >>= 4; // remove checksum
 
-  int s = 0;
   bool extended = address > 0x7FF; // extended can
-  while (address) { s += (address & 0xF); address >>= 4; }
-  while (d) { s += (d & 0xF); d >>= 4; }
+  int s = nibble_sum(address) + nibble_sum(d);
   s = 8-s;
   if (extended) s += 3;
   s &= 0xF;
@@ -19,59 +27,38 @@ unsigned int toyota_checksum(unsigned int address, uint64_t d, int l) {
   d >>= ((8-l)*8); // remove padding
   d >>= 8; // remove checksum
 
-  unsigned int s = l;
-  while (address) { s += address & 0xFF; address >>= 8; }
-  while (d) { s += d & 0xFF; d >>= 8; }
-
+  unsigned int s = l + byte_sum(address) + byte_sum(d);
   return s & 0xFF;
 }
 
 unsigned int subaru_checksum(unsigned int address, uint64_t d, int l) {
   d >>= ((8-l)*8); // remove padding
+  d &= (1ULL << ((l - 1) * 8)) - 1; // checksum is first byte
 
-  unsigned int s = 0;
-  while (address) { s += address & 0xFF; address >>= 8; }
-  l -= 1; // checksum is first byte
-  while (l) { s += d & 0xFF; d >>= 8; l -= 1; }
-
+  unsigned int s = byte_sum(address) + byte_sum(d);
   return s & 0xFF;
 }
 
+// Static lookup table for CRC8 poly 0x1D, aka SAE J1850
+uint8_t crc8_lut_j1850[256];
+
 unsigned int chrysler_checksum(unsigned int address, uint64_t d, int l) {
   /* This function does not want the checksum byte in the input data.
-  jeep chrysler canbus checksum from http://illmatics.com/Remote%20Car%20Hacking.pdf */
-  uint8_t checksum = 0xFF;
+  jeep chrysler canbus checksum from http://illmatics.com/Remote%20Car%20Hacking.pdf
+  It is a CRC8 J1850 with init and final XOR 0xFF. */
+  uint8_t crc = 0xFF;
   for (int j = 0; j < (l - 1); j++) {
-    uint8_t shift = 0x80;
-    uint8_t curr = (d >> 8*j) & 0xFF;
-    for (int i=0; i<8; i++) {
-      uint8_t bit_sum = curr & shift;
-      uint8_t temp_chk = checksum & 0x80U;
-      if (bit_sum != 0U) {
-        bit_sum = 0x1C;
-        if (temp_chk != 0U) {
-          bit_sum = 1;
-        }
-        checksum = checksum << 1;
-        temp_chk = checksum | 1U;
-        bit_sum ^= temp_chk;
-      } else {
-        if (temp_chk != 0U) {
-          bit_sum = 0x1D;
-        }
-        checksum = checksum << 1;
-        bit_sum ^= checksum;
-      }
-      checksum = bit_sum;
-      shift = shift >> 1;
-    }
+    crc = crc8_lut_j1850[crc ^ ((d >> 8*j) & 0xFF)];
   }
-  return ~checksum & 0xFF;
+  return ~crc & 0xFF;
 }
 
 // Static lookup table for fast computation of CRC8 poly 0x2F, aka 8H2F/AUTOSAR
 uint8_t crc8_lut_8h2f[256];
 
+// Static lookup table for CRC8 poly 0xD5
+uint8_t crc8_lut_d5[256];
+
 void gen_crc_lookup_table(uint8_t poly, uint8_t crc_lut[]) {
   uint8_t crc;
   int i, j;
@@ -92,6 +79,8 @@ void init_crc_lookup_tables() {
   // At init time, set up static lookup tables for fast CRC computation.
 
   gen_crc_lookup_table(0x2F, crc8_lut_8h2f);    // CRC-8 8H2F/AUTOSAR for Volkswagen
+  gen_crc_lookup_table(0x1D, crc8_lut_j1850);   // CRC-8 SAE J1850 for Chrysler
+  gen_crc_lookup_table(0xD5, crc8_lut_d5);      // CRC-8 for the comma pedal
 }
 
 unsigned int volkswagen_crc(unsigned int address, uint64_t d, int l) {
@@ -175,45 +164,12 @@ unsigned int volkswagen_crc(unsigned int address, uint64_t d, int l) {
 
 unsigned int pedal_checksum(uint64_t d, int l) {
   uint8_t crc = 0xFF;
-  uint8_t poly = 0xD5; // standard crc8
 
   d >>= ((8-l)*8); // remove padding
   d >>= 8; // remove checksum
 
-  int i, j;
-  for (i = 0; i < l - 1; i++) {
-    crc ^= (d >> (i*8)) & 0xFF;
-    for (j = 0; j < 8; j++) {
-      if ((crc & 0x80) != 0) {
-        crc = (uint8_t)((crc << 1) ^ poly);
-      }
-      else {
-        crc <<= 1;
-      }
-    }
+  for (int i = 0; i < l - 1; i++) {
+    crc = crc8_lut_d5[crc ^ ((d >> (i*8)) & 0xFF)];
   }
   return crc;
 }
-
-
-uint64_t read_u64_be(const uint8_t* v) {
-  return (((uint64_t)v[0] << 56)
-          | ((uint64_t)v[1] << 48)
-          | ((uint64_t)v[2] << 40)
-          | ((uint64_t)v[3] << 32)
-          | ((uint64_t)v[4] << 24)
-          | ((uint64_t)v[5] << 16)
-          | ((uint64_t)v[6] << 8)
-          | (uint64_t)v[7]);
-}
-
-uint64_t read_u64_le(const uint8_t* v) {
-  return ((uint64_t)v[0]
-          | ((uint64_t)v[1] << 8)
-          | ((uint64_t)v[2] << 16)
-          | ((uint64_t)v[3] << 24)
-          | ((uint64_t)v[4] << 32)
-          | ((uint64_t)v[5] << 40)
-          | ((uint64_t)v[6] << 48)
-          | ((uint64_t)v[7] << 56));
-}
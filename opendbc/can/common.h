@@ -2,7 +2,6 @@
 
 #include <vector>
 #include <map>
-#include <unordered_map>
 
 #include "common_dbc.h"
 #include <capnp/dynamic.h>
@@ -14,16 +13,33 @@
 
 #define MAX_BAD_COUNTER 5
 
-// Helper functions
-unsigned int honda_checksum(unsigned int address, uint64_t d, int l);
-unsigned int toyota_checksum(unsigned int address, uint64_t d, int l);
-unsigned int subaru_checksum(unsigned int address, uint64_t d, int l);
-unsigned int chrysler_checksum(unsigned int address, uint64_t d, int l);
-void init_crc_lookup_tables();
-unsigned int volkswagen_crc(unsigned int address, uint64_t d, int l);
-unsigned int pedal_checksum(uint64_t d, int l);
-uint64_t read_u64_be(const uint8_t* v);
-uint64_t read_u64_le(const uint8_t* v);
+// CAN frame in the format the panda sends over USB
+struct PandaCanFrame {
+  uint32_t f1; // address << 21, or address << 3 | 4 for extended addresses
+  uint32_t f2; // length in bits 0-3, bus in bits 4-11, bus time in bits 16-31
+  uint8_t dat[8];
+};
+static_assert(sizeof(PandaCanFrame) == 0x10, "panda CAN frames are 16 bytes");
+
+#ifndef DYNAMIC_CAPNP
+// The CAN events of a log in the panda USB format, to replay them through
+// CANParser::UpdateCans without capnp
+struct CanFrameEvent {
+  uint64_t sec;
+  std::vector<PandaCanFrame> frames;
+};
+
+// converts the CAN (or sendcan) events of a whole decompressed rlog
+std::vector<CanFrameEvent> can_frames_from_log(const std::string &log_data, bool sendcan = false);
+#endif
+
+// Every decoded value of a message, see CANParser::set_record_columns
+struct MessageColumns {
+  uint32_t address;
+  std::vector<uint64_t> sec;
+  std::vector<const char*> names;
+  std::vector<std::vector<double>> values; // values[signal][frame]
+};
 
 class MessageState {
 public:
@@ -33,6 +49,18 @@ public:
   std::vector<Signal> parse_sigs;
   std::vector<double> vals;
 
+  // generated decoder for the whole message, parse_sigs[i] is msg_vals[sig_index[i]]
+  MsgDecoder decode = NULL;
+  bool generic_decode = false;
+  std::vector<double> msg_vals;
+  std::vector<int> sig_index;
+  int counter_size = 0;
+
+  // columns of all decoded values, if recording
+  bool record_columns = false;
+  std::vector<uint64_t> col_sec;
+  std::vector<std::vector<double>> col_vals;
+
   uint16_t ts;
   uint64_t seen;
   uint64_t check_threshold;
@@ -43,7 +71,10 @@ public:
   bool ignore_checksum = false;
   bool ignore_counter = false;
 
-  bool parse(uint64_t sec, uint16_t ts_, uint8_t * dat);
+  void init_decoder(const Msg *msg);
+  bool parse(uint64_t sec, uint16_t ts_, const uint8_t * dat);
+  bool parse_generated(uint64_t sec, uint16_t ts_, const uint8_t * dat);
+  bool parse_generic(uint64_t sec, uint16_t ts_, const uint8_t * dat);
   bool update_counter_generic(int64_t v, int cnt_size);
 };
 
@@ -53,7 +84,15 @@ private:
   kj::Array<capnp::word> aligned_buf;
 
   const DBC *dbc = NULL;
-  std::unordered_map<uint32_t, MessageState> message_states;
+
+  // states are sorted by address and looked up directly by index for standard
+  // addresses, extended addresses use a binary search on addresses
+  std::vector<MessageState> message_states;
+  std::vector<uint32_t> addresses;
+  std::vector<uint16_t> std_index; // standard address -> index + 1, 0 if not parsed
+  std::vector<size_t> checked_states; // states that time out
+  void init_lookup(std::map<uint32_t, MessageState> &states);
+  MessageState *find_state(uint32_t address);
 
 public:
   bool can_valid = false;
@@ -65,11 +104,31 @@ public:
   CANParser(int abus, const std::string& dbc_name, bool ignore_checksum, bool ignore_counter);
   #ifndef DYNAMIC_CAPNP
   void update_string(const std::string &data, bool sendcan);
+  // decodes every CAN (or sendcan) event of a whole decompressed rlog, with
+  // set_record_columns this turns a segment into columns for offline analysis
+  void update_log(const std::string &log_data, bool sendcan);
   void UpdateCans(uint64_t sec, const capnp::List<cereal::CanData>::Reader& cans);
   #endif
   void UpdateCans(uint64_t sec, const capnp::DynamicStruct::Reader& cans);
+  // decode frames straight from a panda USB receive buffer
+  void UpdateCans(uint64_t sec, const PandaCanFrame *frames, size_t num_frames);
   void UpdateValid(uint64_t sec);
   std::vector<SignalValue> query_latest();
+  // decode with the generic per signal loop instead of the generated decoders, for benchmarking
+  void set_generic_decode(bool generic);
+  // keep every decoded value instead of only the latest, for offline analysis of whole segments
+  void set_record_columns(bool record);
+  std::vector<MessageColumns> take_columns();
+};
+
+// Message and signals resolved once by CANPacker::plan, to pack the same message
+// repeatedly without looking up signal names. Only valid as long as the CANPacker.
+struct PackPlan {
+  uint32_t address;
+  unsigned int size;
+  std::vector<const Signal*> sigs; // NULL for undefined signals
+  const Signal *counter_sig = NULL;
+  const Signal *checksum_sig = NULL;
 };
 
 class CANPacker {
@@ -78,8 +137,14 @@ private:
   std::map<std::pair<uint32_t, std::string>, Signal> signal_lookup;
   std::map<uint32_t, Msg> message_lookup;
 
+  uint64_t set_counter_checksum(uint32_t address, unsigned int size, const Signal *counter_sig,
+                                const Signal *checksum_sig, uint64_t ret, int counter);
+
 public:
   CANPacker(const std::string& dbc_name);
+  PackPlan plan(uint32_t address, const std::vector<std::string> &signal_names);
+  // values are in the order of the signal names the plan was made with
+  uint64_t pack(const PackPlan &plan, const double *values, int counter);
   uint64_t pack(uint32_t address, const std::vector<SignalPackValue> &values, int counter);
   Msg* lookup_message(uint32_t address);
 };
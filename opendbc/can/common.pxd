@@ -73,12 +73,27 @@ cdef extern from "common_dbc.h":
 cdef extern from "common.h":
   cdef const DBC* dbc_lookup(const string);
 
+  cdef struct MessageColumns:
+    uint32_t address
+    vector[uint64_t] sec
+    vector[const char*] names
+    vector[vector[double]] values
+
   cdef cppclass CANParser:
     bool can_valid
     CANParser(int, string, vector[MessageParseOptions], vector[SignalParseOptions])
     void update_string(string, bool)
+    void update_log(string, bool)
     vector[SignalValue] query_latest()
+    void set_record_columns(bool)
+    vector[MessageColumns] take_columns()
+
+  cdef cppclass PackPlan:
+    uint32_t address
+    unsigned int size
 
   cdef cppclass CANPacker:
    CANPacker(string)
+   PackPlan plan(uint32_t, vector[string])
+   uint64_t pack(PackPlan&, const double*, int counter)
    uint64_t pack(uint32_t, vector[SignalPackValue], int counter)
@@ -1,5 +1,19 @@
 #include "common_dbc.h"
 
+{% macro sig_type(address, sig) -%}
+{% if checksum_type == "honda" and sig.name == "CHECKSUM" %}HONDA_CHECKSUM
+{%- elif checksum_type == "honda" and sig.name == "COUNTER" %}HONDA_COUNTER
+{%- elif checksum_type == "toyota" and sig.name == "CHECKSUM" %}TOYOTA_CHECKSUM
+{%- elif checksum_type == "volkswagen" and sig.name == "CHECKSUM" %}VOLKSWAGEN_CHECKSUM
+{%- elif checksum_type == "volkswagen" and sig.name == "COUNTER" %}VOLKSWAGEN_COUNTER
+{%- elif checksum_type == "subaru" and sig.name == "CHECKSUM" %}SUBARU_CHECKSUM
+{%- elif checksum_type == "chrysler" and sig.name == "CHECKSUM" %}CHRYSLER_CHECKSUM
+{%- elif address in [512, 513] and sig.name == "CHECKSUM_PEDAL" %}PEDAL_CHECKSUM
+{%- elif address in [512, 513] and sig.name == "COUNTER_PEDAL" %}PEDAL_COUNTER
+{%- else %}DEFAULT
+{%- endif %}
+{%- endmacro %}
+
 namespace {
 
 {% for address, msg_name, msg_size, sigs in msgs %}
@@ -19,32 +33,51 @@ const Signal sigs_{{address}}[] = {
       .factor = {{sig.factor}},
       .offset = {{sig.offset}},
       .is_little_endian = {{"true" if sig.is_little_endian else "false"}},
-      {% if checksum_type == "honda" and sig.name == "CHECKSUM" %}
-      .type = SignalType::HONDA_CHECKSUM,
-      {% elif checksum_type == "honda" and sig.name == "COUNTER" %}
-      .type = SignalType::HONDA_COUNTER,
-      {% elif checksum_type == "toyota" and sig.name == "CHECKSUM" %}
-      .type = SignalType::TOYOTA_CHECKSUM,
-      {% elif checksum_type == "volkswagen" and sig.name == "CHECKSUM" %}
-      .type = SignalType::VOLKSWAGEN_CHECKSUM,
-      {% elif checksum_type == "volkswagen" and sig.name == "COUNTER" %}
-      .type = SignalType::VOLKSWAGEN_COUNTER,
-      {% elif checksum_type == "subaru" and sig.name == "CHECKSUM" %}
-      .type = SignalType::SUBARU_CHECKSUM,
-      {% elif checksum_type == "chrysler" and sig.name == "CHECKSUM" %}
-      .type = SignalType::CHRYSLER_CHECKSUM,
-      {% elif address in [512, 513] and sig.name == "CHECKSUM_PEDAL" %}
-      .type = SignalType::PEDAL_CHECKSUM,
-      {% elif address in [512, 513] and sig.name == "COUNTER_PEDAL" %}
-      .type = SignalType::PEDAL_COUNTER,
-      {% else %}
-      .type = SignalType::DEFAULT,
-      {% endif %}
+      .type = SignalType::{{sig_type(address, sig)}},
     },
   {% endfor %}
 };
 {% endfor %}
 
+{% for address, msg_name, msg_size, sigs in msgs %}
+bool decode_{{address}}(const uint8_t *dat, bool check_checksum, double *vals, int64_t *counter) {
+  const uint64_t dat_le = read_u64_le(dat);
+  const uint64_t dat_be = read_u64_be(dat);
+  int64_t tmp;
+
+  {% for sig in sigs %}
+    {% set type = sig_type(address, sig)|trim %}
+    {% if sig.is_little_endian %}
+  tmp = (dat_le >> {{sig.start_bit}}) & {{"0x%XULL" % ((1 << sig.size) - 1)}};
+    {% else %}
+      {% set b1 = (sig.start_bit//8)*8  + (-sig.start_bit-1) % 8 %}
+  tmp = (dat_be >> {{64 - (b1 + sig.size)}}) & {{"0x%XULL" % ((1 << sig.size) - 1)}};
+    {% endif %}
+    {% if sig.is_signed %}
+  tmp -= (tmp >> {{sig.size - 1}}) ? (1ULL << {{sig.size}}) : 0;
+    {% endif %}
+    {% if type == "HONDA_CHECKSUM" %}
+  if (check_checksum && honda_checksum({{address}}, dat_be, {{msg_size}}) != tmp) return false;
+    {% elif type == "TOYOTA_CHECKSUM" %}
+  if (check_checksum && toyota_checksum({{address}}, dat_be, {{msg_size}}) != tmp) return false;
+    {% elif type == "VOLKSWAGEN_CHECKSUM" %}
+  if (check_checksum && volkswagen_crc({{address}}, dat_le, {{msg_size}}) != tmp) return false;
+    {% elif type == "SUBARU_CHECKSUM" %}
+  if (check_checksum && subaru_checksum({{address}}, dat_be, {{msg_size}}) != tmp) return false;
+    {% elif type == "CHRYSLER_CHECKSUM" %}
+  if (check_checksum && chrysler_checksum({{address}}, dat_le, {{msg_size}}) != tmp) return false;
+    {% elif type == "PEDAL_CHECKSUM" %}
+  if (check_checksum && pedal_checksum(dat_be, {{msg_size}}) != tmp) return false;
+    {% elif type in ["HONDA_COUNTER", "VOLKSWAGEN_COUNTER", "PEDAL_COUNTER"] %}
+  *counter = tmp;
+    {% endif %}
+  vals[{{loop.index0}}] = tmp{% if sig.factor != 1 %} * {{sig.factor}}{% endif %}{% if sig.offset != 0 %} + {{sig.offset}}{% endif %};
+
+  {% endfor %}
+  return true;
+}
+
+{% endfor %}
 const Msg msgs[] = {
 {% for address, msg_name, msg_size, sigs in msgs %}
   {% set address_hex = "0x%X" % address %}
@@ -54,6 +87,7 @@ const Msg msgs[] = {
     .size = {{msg_size}},
     .num_sigs = ARRAYSIZE(sigs_{{address}}),
     .sigs = sigs_{{address}},
+    .decode = decode_{{address}},
   },
 {% endfor %}
 };
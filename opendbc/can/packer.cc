@@ -48,34 +48,39 @@ CANPacker::CANPacker(const std::string& dbc_name) {
   init_crc_lookup_tables();
 }
 
-uint64_t CANPacker::pack(uint32_t address, const std::vector<SignalPackValue> &signals, int counter) {
-  uint64_t ret = 0;
-  for (const auto& sigval : signals) {
-    std::string name = std::string(sigval.name);
-    double value = sigval.value;
+PackPlan CANPacker::plan(uint32_t address, const std::vector<std::string> &signal_names) {
+  PackPlan plan = {.address = address, .size = message_lookup[address].size};
 
+  for (const auto& name : signal_names) {
     auto sig_it = signal_lookup.find(std::make_pair(address, name));
     if (sig_it == signal_lookup.end()) {
       WARN("undefined signal %s - %d\n", name.c_str(), address);
+      plan.sigs.push_back(NULL);
       continue;
     }
-    const auto& sig = sig_it->second;
+    plan.sigs.push_back(&sig_it->second);
+  }
 
-    int64_t ival = (int64_t)(round((value - sig.offset) / sig.factor));
-    if (ival < 0) {
-      ival = (1ULL << sig.b2) + ival;
-    }
+  auto sig_it_counter = signal_lookup.find(std::make_pair(address, "COUNTER"));
+  if (sig_it_counter != signal_lookup.end()) {
+    plan.counter_sig = &sig_it_counter->second;
+  }
 
-    ret = set_value(ret, sig, ival);
+  auto sig_it_checksum = signal_lookup.find(std::make_pair(address, "CHECKSUM"));
+  if (sig_it_checksum != signal_lookup.end()) {
+    plan.checksum_sig = &sig_it_checksum->second;
   }
+  return plan;
+}
 
+uint64_t CANPacker::set_counter_checksum(uint32_t address, unsigned int size, const Signal *counter_sig,
+                                         const Signal *checksum_sig, uint64_t ret, int counter) {
   if (counter >= 0){
-    auto sig_it = signal_lookup.find(std::make_pair(address, "COUNTER"));
-    if (sig_it == signal_lookup.end()) {
+    if (counter_sig == NULL) {
       WARN("COUNTER not defined\n");
       return ret;
     }
-    const auto& sig = sig_it->second;
+    const auto& sig = *counter_sig;
 
     if ((sig.type != SignalType::HONDA_COUNTER) && (sig.type != SignalType::VOLKSWAGEN_COUNTER)) {
       WARN("COUNTER signal type not valid\n");
@@ -84,26 +89,25 @@ uint64_t CANPacker::pack(uint32_t address, const std::vector<SignalPackValue> &s
     ret = set_value(ret, sig, counter);
   }
 
-  auto sig_it_checksum = signal_lookup.find(std::make_pair(address, "CHECKSUM"));
-  if (sig_it_checksum != signal_lookup.end()) {
-    const auto& sig = sig_it_checksum->second;
+  if (checksum_sig != NULL) {
+    const auto& sig = *checksum_sig;
     if (sig.type == SignalType::HONDA_CHECKSUM) {
-      unsigned int chksm = honda_checksum(address, ret, message_lookup[address].size);
+      unsigned int chksm = honda_checksum(address, ret, size);
       ret = set_value(ret, sig, chksm);
     } else if (sig.type == SignalType::TOYOTA_CHECKSUM) {
-      unsigned int chksm = toyota_checksum(address, ret, message_lookup[address].size);
+      unsigned int chksm = toyota_checksum(address, ret, size);
       ret = set_value(ret, sig, chksm);
     } else if (sig.type == SignalType::VOLKSWAGEN_CHECKSUM) {
       // FIXME: Hackish fix for an endianness issue. The message is in reverse byte order
       // until later in the pack process. Checksums can be run backwards, CRCs not so much.
       // The correct fix is unclear but this works for the moment.
-      unsigned int chksm = volkswagen_crc(address, ReverseBytes(ret), message_lookup[address].size);
+      unsigned int chksm = volkswagen_crc(address, ReverseBytes(ret), size);
       ret = set_value(ret, sig, chksm);
     } else if (sig.type == SignalType::SUBARU_CHECKSUM) {
-      unsigned int chksm = subaru_checksum(address, ret, message_lookup[address].size);
+      unsigned int chksm = subaru_checksum(address, ret, size);
       ret = set_value(ret, sig, chksm);
     } else if (sig.type == SignalType::CHRYSLER_CHECKSUM) {
-      unsigned int chksm = chrysler_checksum(address, ReverseBytes(ret), message_lookup[address].size);
+      unsigned int chksm = chrysler_checksum(address, ReverseBytes(ret), size);
       ret = set_value(ret, sig, chksm);
     } else {
       //WARN("CHECKSUM signal type not valid\n");
@@ -113,6 +117,55 @@ uint64_t CANPacker::pack(uint32_t address, const std::vector<SignalPackValue> &s
   return ret;
 }
 
+uint64_t CANPacker::pack(const PackPlan &plan, const double *values, int counter) {
+  uint64_t ret = 0;
+  for (int i = 0; i < plan.sigs.size(); i++) {
+    if (plan.sigs[i] == NULL) continue;
+    const auto& sig = *plan.sigs[i];
+
+    int64_t ival = (int64_t)(round((values[i] - sig.offset) / sig.factor));
+    if (ival < 0) {
+      ival = (1ULL << sig.b2) + ival;
+    }
+
+    ret = set_value(ret, sig, ival);
+  }
+
+  return set_counter_checksum(plan.address, plan.size, plan.counter_sig, plan.checksum_sig, ret, counter);
+}
+
+uint64_t CANPacker::pack(uint32_t address, const std::vector<SignalPackValue> &signals, int counter) {
+  uint64_t ret = 0;
+  for (const auto& sigval : signals) {
+    std::string name = std::string(sigval.name);
+    double value = sigval.value;
+
+    auto sig_it = signal_lookup.find(std::make_pair(address, name));
+    if (sig_it == signal_lookup.end()) {
+      WARN("undefined signal %s - %d\n", name.c_str(), address);
+      continue;
+    }
+    const auto& sig = sig_it->second;
+
+    int64_t ival = (int64_t)(round((value - sig.offset) / sig.factor));
+    if (ival < 0) {
+      ival = (1ULL << sig.b2) + ival;
+    }
+
+    ret = set_value(ret, sig, ival);
+  }
+
+  const Signal *counter_sig = NULL, *checksum_sig = NULL;
+  if (counter >= 0) {
+    auto sig_it = signal_lookup.find(std::make_pair(address, "COUNTER"));
+    if (sig_it != signal_lookup.end()) counter_sig = &sig_it->second;
+  }
+  auto sig_it_checksum = signal_lookup.find(std::make_pair(address, "CHECKSUM"));
+  if (sig_it_checksum != signal_lookup.end()) checksum_sig = &sig_it_checksum->second;
+
+  return set_counter_checksum(address, message_lookup[address].size, counter_sig, checksum_sig, ret, counter);
+}
+
 Msg* CANPacker::lookup_message(uint32_t address) {
   return &message_lookup[address];
 }
@@ -0,0 +1,47 @@
+// Compares packing a message by signal names against a precomputed PackPlan.
+//
+// usage: packer_bench [iterations]
+
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <string>
+#include <vector>
+
+#include "common.h"
+
+int main(int argc, char **argv) {
+  int iterations = argc > 1 ? atoi(argv[1]) : 1000000;
+
+  // honda STEERING_CONTROL, sent at 100 Hz
+  CANPacker packer("honda_civic_touring_2016_can_generated");
+  const uint32_t address = 0xE4;
+  const std::vector<std::string> names = {"STEER_TORQUE", "STEER_TORQUE_REQUEST", "SET_ME_X00", "SET_ME_X00_2"};
+  PackPlan plan = packer.plan(address, names);
+
+  uint64_t check = 0;
+  auto start = std::chrono::steady_clock::now();
+  for (int i = 0; i < iterations; i++) {
+    std::vector<SignalPackValue> values = {
+      {"STEER_TORQUE", (double)(i % 7681 - 3840)},
+      {"STEER_TORQUE_REQUEST", 1},
+      {"SET_ME_X00", 0},
+      {"SET_ME_X00_2", 0},
+    };
+    check ^= packer.pack(address, values, i % 4);
+  }
+  double t_names = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+  uint64_t check_plan = 0;
+  start = std::chrono::steady_clock::now();
+  for (int i = 0; i < iterations; i++) {
+    const double values[] = {(double)(i % 7681 - 3840), 1, 0, 0};
+    check_plan ^= packer.pack(plan, values, i % 4);
+  }
+  double t_plan = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+  printf("names: %8.1f ns/pack\n", t_names / iterations * 1e9);
+  printf("plan:  %8.1f ns/pack\n", t_plan / iterations * 1e9);
+  printf("speedup: %.2fx, results %s\n", t_names / t_plan, check == check_plan ? "match" : "DIFFER");
+  return check != check_plan;
+}
@@ -9,7 +9,7 @@ from libcpp cimport bool
 from posix.dlfcn cimport dlopen, dlsym, RTLD_LAZY
 
 from .common cimport CANPacker as cpp_CANPacker
-from .common cimport dbc_lookup, SignalPackValue, DBC
+from .common cimport dbc_lookup, SignalPackValue, PackPlan, DBC
 
 
 cdef class CANPacker:
@@ -18,6 +18,9 @@ cdef class CANPacker:
     const DBC *dbc
     map[string, (int, int)] name_to_address_and_size
     map[int, int] address_to_size
+    vector[PackPlan] plans
+    vector[double] plan_values
+    dict plan_ids
 
   def __init__(self, dbc_name):
     self.dbc = dbc_lookup(dbc_name)
@@ -25,27 +28,37 @@ cdef class CANPacker:
       raise RuntimeError(f"Can't lookup {dbc_name}")
 
     self.packer = new cpp_CANPacker(dbc_name)
+    self.plan_ids = {}
     num_msgs = self.dbc[0].num_msgs
     for i in range(num_msgs):
       msg = self.dbc[0].msgs[i]
       self.name_to_address_and_size[string(msg.name)] = (msg.address, msg.size)
       self.address_to_size[msg.address] = msg.size
 
-  cdef uint64_t pack(self, addr, values, counter):
-    cdef vector[SignalPackValue] values_thing
-    cdef SignalPackValue spv
-
-    names = []
-
-    for name, value in values.iteritems():
-      n = name.encode('utf8')
-      names.append(n) # TODO: find better way to keep reference to temp string around
+  cpdef int plan(self, name_or_addr, signal_names):
+    """Resolves the signals of a message once, returns the id of the plan for make_can_msg_plan.
+    Plans are cached by address and signal names."""
+    cdef vector[string] names
+    addr = name_or_addr if type(name_or_addr) == int else self.name_to_address_and_size[name_or_addr.encode('utf8')][0]
+    key = (addr, tuple(signal_names))
+    plan_id = self.plan_ids.get(key)
+    if plan_id is None:
+      for name in key[1]:
+        names.push_back(name.encode('utf8'))
+      plan_id = self.plans.size()
+      self.plans.push_back(self.packer.plan(addr, names))
+      self.plan_ids[key] = plan_id
+    return plan_id
 
-      spv.name = n
-      spv.value = value
-      values_thing.push_back(spv)
+  cdef uint64_t pack_plan(self, int plan_id, values, counter):
+    self.plan_values.clear()
+    for value in values:
+      self.plan_values.push_back(value)
+    return self.packer.pack(self.plans[plan_id], self.plan_values.data(), counter)
 
-    return self.packer.pack(addr, values_thing, counter)
+  cdef uint64_t pack(self, addr, values, counter):
+    # a message is packed with the same signals every time, so its signals are only looked up once
+    return self.pack_plan(self.plan(addr, values.keys()), values.values(), counter)
 
   cdef inline uint64_t ReverseBytes(self, uint64_t x):
     return (((x & 0xff00000000000000ull) >> 56) |
@@ -67,3 +80,11 @@ cdef class CANPacker:
     cdef uint64_t val = self.pack(addr, values, counter)
     val = self.ReverseBytes(val)
     return [addr, 0, (<char *>&val)[:size], bus]
+
+  cpdef make_can_msg_plan(self, int plan_id, bus, values, counter=-1):
+    """Like make_can_msg, with values in the order of the signal names the plan was made with"""
+    if plan_id < 0 or plan_id >= self.plans.size():
+      raise IndexError(f"invalid plan {plan_id}")
+    cdef uint64_t val = self.pack_plan(plan_id, values, counter)
+    val = self.ReverseBytes(val)
+    return [self.plans[plan_id].address, 0, (<char *>&val)[:self.plans[plan_id].size], bus]
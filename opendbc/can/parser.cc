@@ -13,7 +13,61 @@
 // #define DEBUG printf
 #define INFO printf
 
-bool MessageState::parse(uint64_t sec, uint16_t ts_, uint8_t * dat) {
+void MessageState::init_decoder(const Msg *msg) {
+  decode = msg->decode;
+  msg_vals.resize(msg->num_sigs);
+  sig_index.clear();
+  for (const auto &sig : parse_sigs) {
+    for (int i = 0; i < msg->num_sigs; i++) {
+      if (strcmp(sig.name, msg->sigs[i].name) == 0) {
+        sig_index.push_back(i);
+        break;
+      }
+    }
+  }
+  assert(sig_index.size() == parse_sigs.size());
+
+  counter_size = 0;
+  for (int i = 0; i < msg->num_sigs; i++) {
+    SignalType type = msg->sigs[i].type;
+    if (type == SignalType::HONDA_COUNTER || type == SignalType::VOLKSWAGEN_COUNTER || type == SignalType::PEDAL_COUNTER) {
+      counter_size = msg->sigs[i].b2;
+    }
+  }
+}
+
+bool MessageState::parse(uint64_t sec, uint16_t ts_, const uint8_t * dat) {
+  bool ret = (decode == NULL || generic_decode) ? parse_generic(sec, ts_, dat) : parse_generated(sec, ts_, dat);
+
+  if (ret && record_columns) {
+    col_sec.push_back(sec);
+    for (int i = 0; i < vals.size(); i++) {
+      col_vals[i].push_back(vals[i]);
+    }
+  }
+  return ret;
+}
+
+bool MessageState::parse_generated(uint64_t sec, uint16_t ts_, const uint8_t * dat) {
+  int64_t cnt = 0;
+  if (!decode(dat, !ignore_checksum, msg_vals.data(), &cnt)) {
+    INFO("0x%X CHECKSUM FAIL\n", address);
+    return false;
+  }
+  if (!ignore_counter && counter_size > 0 && !update_counter_generic(cnt, counter_size)) {
+    return false;
+  }
+
+  for (int i = 0; i < sig_index.size(); i++) {
+    vals[i] = msg_vals[sig_index[i]];
+  }
+  ts = ts_;
+  seen = sec;
+
+  return true;
+}
+
+bool MessageState::parse_generic(uint64_t sec, uint16_t ts_, const uint8_t * dat) {
   uint64_t dat_le = read_u64_le(dat);
   uint64_t dat_be = read_u64_be(dat);
 
@@ -118,8 +172,9 @@ CANParser::CANParser(int abus, const std::string& dbc_name,
   assert(dbc);
   init_crc_lookup_tables();
 
+  std::map<uint32_t, MessageState> states;
   for (const auto& op : options) {
-    MessageState &state = message_states[op.address];
+    MessageState &state = states[op.address];
     state.address = op.address;
     // state.check_frequency = op.check_frequency,
 
@@ -165,7 +220,10 @@ CANParser::CANParser(int abus, const std::string& dbc_name,
         }
       }
     }
+
+    state.init_decoder(msg);
   }
+  init_lookup(states);
 }
 
 CANParser::CANParser(int abus, const std::string& dbc_name, bool ignore_checksum, bool ignore_counter)
@@ -176,6 +234,7 @@ CANParser::CANParser(int abus, const std::string& dbc_name, bool ignore_checksum
   assert(dbc);
   init_crc_lookup_tables();
 
+  std::map<uint32_t, MessageState> states;
   for (int i = 0; i < dbc->num_msgs; i++) {
     const Msg* msg = &dbc->msgs[i];
     MessageState state = {
@@ -191,8 +250,37 @@ CANParser::CANParser(int abus, const std::string& dbc_name, bool ignore_checksum
       state.vals.push_back(0);
     }
 
-    message_states[state.address] = state;
+    state.init_decoder(msg);
+    states[state.address] = state;
+  }
+  init_lookup(states);
+}
+
+void CANParser::init_lookup(std::map<uint32_t, MessageState> &states) {
+  const uint32_t max_std_address = 0x7FF;
+  for (auto& kv : states) {
+    if (kv.first <= max_std_address) {
+      if (std_index.size() <= kv.first) std_index.resize(kv.first + 1, 0);
+      std_index[kv.first] = message_states.size() + 1;
+    }
+    if (kv.second.check_threshold > 0) {
+      checked_states.push_back(message_states.size());
+    }
+    addresses.push_back(kv.first);
+    message_states.push_back(std::move(kv.second));
+  }
+  assert(message_states.size() < UINT16_MAX);
+}
+
+inline MessageState *CANParser::find_state(uint32_t address) {
+  if (address < std_index.size()) {
+    uint16_t idx = std_index[address];
+    return idx ? &message_states[idx - 1] : NULL;
   }
+
+  auto it = std::lower_bound(addresses.begin(), addresses.end(), address);
+  if (it == addresses.end() || *it != address) return NULL;
+  return &message_states[it - addresses.begin()];
 }
 
 #ifndef DYNAMIC_CAPNP
@@ -216,6 +304,50 @@ void CANParser::update_string(const std::string &data, bool sendcan) {
   UpdateValid(last_sec);
 }
 
+// calls fn with the logMonoTime and frames of each CAN (or sendcan) event in a decompressed rlog
+template <class F>
+static void for_each_can_event(const std::string &log_data, bool sendcan, F fn) {
+  // copied once to be word aligned
+  kj::Array<capnp::word> words = kj::heapArray<capnp::word>(log_data.size() / sizeof(capnp::word));
+  memcpy(words.begin(), log_data.data(), words.size() * sizeof(capnp::word));
+
+  const cereal::Event::Which which = sendcan ? cereal::Event::SENDCAN : cereal::Event::CAN;
+  kj::ArrayPtr<const capnp::word> remaining = words;
+  while (remaining.size() > 0) {
+    capnp::FlatArrayMessageReader cmsg(remaining, {.traversalLimitInWords = kj::maxValue});
+    cereal::Event::Reader event = cmsg.getRoot<cereal::Event>();
+    if (event.which() == which) {
+      fn(event.getLogMonoTime(), sendcan ? event.getSendcan() : event.getCan());
+    }
+    remaining = kj::arrayPtr(cmsg.getEnd(), remaining.end());
+  }
+}
+
+std::vector<CanFrameEvent> can_frames_from_log(const std::string &log_data, bool sendcan) {
+  std::vector<CanFrameEvent> ret;
+  for_each_can_event(log_data, sendcan, [&](uint64_t sec, const capnp::List<cereal::CanData>::Reader &cans) {
+    CanFrameEvent e = {.sec = sec};
+    e.frames.reserve(cans.size());
+    for (auto c : cans) {
+      PandaCanFrame f = {};
+      f.f1 = c.getAddress() > 0x7FF ? ((c.getAddress() << 3) | 4) : (c.getAddress() << 21);
+      f.f2 = ((uint32_t)c.getBusTime() << 16) | ((c.getSrc() & 0xFF) << 4) | (c.getDat().size() & 0xF);
+      memcpy(f.dat, c.getDat().begin(), std::min<size_t>(c.getDat().size(), 8));
+      e.frames.push_back(f);
+    }
+    ret.push_back(std::move(e));
+  });
+  return ret;
+}
+
+void CANParser::update_log(const std::string &log_data, bool sendcan) {
+  for_each_can_event(log_data, sendcan, [&](uint64_t sec, const capnp::List<cereal::CanData>::Reader &cans) {
+    last_sec = sec;
+    UpdateCans(sec, cans);
+  });
+  UpdateValid(last_sec);
+}
+
 void CANParser::UpdateCans(uint64_t sec, const capnp::List<cereal::CanData>::Reader& cans) {
   int msg_count = cans.size();
 
@@ -228,8 +360,8 @@ void CANParser::UpdateCans(uint64_t sec, const capnp::List<cereal::CanData>::Rea
       // DEBUG("skip %d: wrong bus\n", cmsg.getAddress());
       continue;
     }
-    auto state_it = message_states.find(cmsg.getAddress());
-    if (state_it == message_states.end()) {
+    MessageState *state = find_state(cmsg.getAddress());
+    if (state == NULL) {
       // DEBUG("skip %d: not specified\n", cmsg.getAddress());
       continue;
     }
@@ -238,7 +370,7 @@ void CANParser::UpdateCans(uint64_t sec, const capnp::List<cereal::CanData>::Rea
     uint8_t dat[8] = {0};
     memcpy(dat, cmsg.getDat().begin(), cmsg.getDat().size());
 
-    state_it->second.parse(sec, cmsg.getBusTime(), dat);
+    state->parse(sec, cmsg.getBusTime(), dat);
   }
 }
 #endif
@@ -252,8 +384,8 @@ void CANParser::UpdateCans(uint64_t sec, const capnp::DynamicStruct::Reader& cms
     return;
   }
 
-  auto state_it = message_states.find(cmsg.get("address").as<uint32_t>());
-  if (state_it == message_states.end()) {
+  MessageState *state = find_state(cmsg.get("address").as<uint32_t>());
+  if (state == NULL) {
     DEBUG("skip %d: not specified\n", cmsg.get("address").as<uint32_t>());
     return;
   }
@@ -262,14 +394,35 @@ void CANParser::UpdateCans(uint64_t sec, const capnp::DynamicStruct::Reader& cms
   if (dat.size() > 8) return; //shouldn't ever happen
   uint8_t data[8] = {0};
   memcpy(data, dat.begin(), dat.size());
-  state_it->second.parse(sec, cmsg.get("busTime").as<uint16_t>(), data);
+  state->parse(sec, cmsg.get("busTime").as<uint16_t>(), data);
+}
+
+void CANParser::UpdateCans(uint64_t sec, const PandaCanFrame *frames, size_t num_frames) {
+  for (size_t i = 0; i < num_frames; i++) {
+    const PandaCanFrame &frame = frames[i];
+    if (((frame.f2 >> 4) & 0xFF) != bus) continue;
+
+    uint32_t address = (frame.f1 & 4) ? (frame.f1 >> 3) : (frame.f1 >> 21);
+    MessageState *state = find_state(address);
+    if (state == NULL) continue;
+
+    int len = frame.f2 & 0xF;
+    if (len >= 8) {
+      state->parse(sec, frame.f2 >> 16, frame.dat);
+    } else {
+      // bytes past the length are not guaranteed to be zero
+      uint8_t dat[8] = {0};
+      memcpy(dat, frame.dat, len);
+      state->parse(sec, frame.f2 >> 16, dat);
+    }
+  }
 }
 
 void CANParser::UpdateValid(uint64_t sec) {
   can_valid = true;
-  for (const auto& kv : message_states) {
-    const auto& state = kv.second;
-    if (state.check_threshold > 0 && (sec - state.seen) > state.check_threshold) {
+  for (size_t i : checked_states) {
+    const auto& state = message_states[i];
+    if ((sec - state.seen) > state.check_threshold) {
       if (state.seen > 0) {
         DEBUG("0x%X TIMEOUT\n", state.address);
       } else {
@@ -280,11 +433,40 @@ void CANParser::UpdateValid(uint64_t sec) {
   }
 }
 
+void CANParser::set_generic_decode(bool generic) {
+  for (auto& state : message_states) {
+    state.generic_decode = generic;
+  }
+}
+
+void CANParser::set_record_columns(bool record) {
+  for (auto& state : message_states) {
+    state.record_columns = record;
+    state.col_vals.resize(state.vals.size());
+  }
+}
+
+std::vector<MessageColumns> CANParser::take_columns() {
+  std::vector<MessageColumns> ret;
+  for (auto& state : message_states) {
+    if (state.col_sec.empty()) continue;
+
+    MessageColumns cols = {.address = state.address, .sec = std::move(state.col_sec)};
+    for (int i = 0; i < state.parse_sigs.size(); i++) {
+      cols.names.push_back(state.parse_sigs[i].name);
+      cols.values.push_back(std::move(state.col_vals[i]));
+      state.col_vals[i].clear();
+    }
+    state.col_sec.clear();
+    ret.push_back(std::move(cols));
+  }
+  return ret;
+}
+
 std::vector<SignalValue> CANParser::query_latest() {
   std::vector<SignalValue> ret;
 
-  for (const auto& kv : message_states) {
-    const auto& state = kv.second;
+  for (const auto& state : message_states) {
     if (last_sec != 0 && state.seen != last_sec) continue;
 
     for (int i=0; i<state.parse_sigs.size(); i++) {
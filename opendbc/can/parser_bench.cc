@@ -0,0 +1,122 @@
+// Replays the can messages of a log through CANParser, once with the generated
+// per message decoders and once with the generic per signal loop. Also times
+// decoding the same frames from raw panda buffers, and recording columns.
+//
+// usage: parser_bench <dbc name> <decompressed rlog> [bus] [iterations]
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <iterator>
+#include <string>
+#include <vector>
+
+#include "common.h"
+
+static std::vector<std::string> read_can_events(const std::string &data) {
+  kj::Array<capnp::word> words = kj::heapArray<capnp::word>(data.size() / sizeof(capnp::word));
+  memcpy(words.begin(), data.data(), words.size() * sizeof(capnp::word));
+
+  std::vector<std::string> events;
+  kj::ArrayPtr<const capnp::word> remaining = words;
+  while (remaining.size() > 0) {
+    capnp::FlatArrayMessageReader cmsg(remaining, {.traversalLimitInWords = kj::maxValue});
+    cereal::Event::Reader event = cmsg.getRoot<cereal::Event>();
+    const capnp::word *end = cmsg.getEnd();
+    if (event.which() == cereal::Event::CAN) {
+      events.emplace_back((const char *)remaining.begin(), (const char *)end);
+    }
+    remaining = kj::arrayPtr(end, remaining.end());
+  }
+  return events;
+}
+
+static double run_raw(CANParser &parser, const std::vector<CanFrameEvent> &events, int iterations) {
+  auto start = std::chrono::steady_clock::now();
+  for (int i = 0; i < iterations; i++) {
+    for (const auto &e : events) {
+      parser.UpdateCans(e.sec, e.frames.data(), e.frames.size());
+      parser.UpdateValid(e.sec);
+    }
+  }
+  return std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+}
+
+static double run(CANParser &parser, const std::vector<std::string> &events, int iterations) {
+  auto start = std::chrono::steady_clock::now();
+  for (int i = 0; i < iterations; i++) {
+    for (const auto &e : events) {
+      parser.update_string(e, false);
+    }
+  }
+  return std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+}
+
+int main(int argc, char **argv) {
+  if (argc < 3) {
+    printf("usage: %s <dbc name> <decompressed rlog> [bus] [iterations]\n", argv[0]);
+    return 1;
+  }
+  std::string dbc_name = argv[1];
+  int bus = argc > 3 ? atoi(argv[3]) : 0;
+  int iterations = argc > 4 ? atoi(argv[4]) : 10;
+
+  std::ifstream f(argv[2], std::ios::binary);
+  const std::string data((std::istreambuf_iterator<char>(f)), std::istreambuf_iterator<char>());
+  std::vector<std::string> events = read_can_events(data);
+  printf("%zu can events\n", events.size());
+  if (events.empty()) return 1;
+
+  // check that both paths agree on every update
+  CANParser generated(bus, dbc_name, false, false);
+  CANParser generic(bus, dbc_name, false, false);
+  generic.set_generic_decode(true);
+
+  size_t mismatches = 0;
+  for (const auto &e : events) {
+    generated.update_string(e, false);
+    generic.update_string(e, false);
+
+    auto a = generated.query_latest();
+    auto b = generic.query_latest();
+    if (a.size() != b.size()) {
+      mismatches++;
+      continue;
+    }
+    for (int i = 0; i < a.size(); i++) {
+      if (a[i].address != b[i].address || a[i].value != b[i].value) {
+        if (!(std::isnan(a[i].value) && std::isnan(b[i].value))) mismatches++;
+      }
+    }
+  }
+  printf("%zu mismatching signals\n", mismatches);
+
+  double t_generated = run(generated, events, iterations);
+  double t_generic = run(generic, events, iterations);
+  double n = events.size() * iterations;
+  printf("generated: %8.2f us/event\n", t_generated / n * 1e6);
+  printf("generic:   %8.2f us/event\n", t_generic / n * 1e6);
+  printf("speedup:   %8.2fx\n", t_generic / t_generated);
+
+  std::vector<CanFrameEvent> raw = can_frames_from_log(data);
+  size_t num_frames = 0;
+  for (const auto &e : raw) num_frames += e.frames.size();
+
+  CANParser raw_parser(bus, dbc_name, false, false);
+  double t_raw = run_raw(raw_parser, raw, iterations);
+  printf("raw:       %8.2f us/event, %.2f M frames/s\n", t_raw / n * 1e6, num_frames * iterations / t_raw * 1e-6);
+
+  CANParser col_parser(bus, dbc_name, false, false);
+  col_parser.set_record_columns(true);
+  double t_col = run_raw(col_parser, raw, 1);
+  size_t num_values = 0;
+  for (const auto &cols : col_parser.take_columns()) {
+    num_values += cols.sec.size() * cols.values.size();
+  }
+  printf("columns:   %.2f M frames/s, %zu values\n", num_frames / t_col * 1e-6, num_values);
+  return mismatches > 0;
+}
@@ -9,12 +9,14 @@ from libcpp.map cimport map
 from libcpp cimport bool
 
 from .common cimport CANParser as cpp_CANParser
-from .common cimport SignalParseOptions, MessageParseOptions, dbc_lookup, SignalValue, DBC
+from .common cimport SignalParseOptions, MessageParseOptions, dbc_lookup, SignalValue, DBC, MessageColumns
 
 import os
 import numbers
 from collections import defaultdict
 
+import numpy as np
+
 cdef int CAN_INVALID_CNT = 5
 
 cdef class CANParser:
@@ -144,6 +146,30 @@ cdef class CANParser:
 
     return updated_vals
 
+  def set_record_columns(self, record):
+    """Keep every decoded value instead of only the latest, see take_columns"""
+    self.can.set_record_columns(record)
+
+  def update_log(self, dat, sendcan=False):
+    """Decodes every can event of a whole decompressed rlog at once"""
+    self.can.update_log(dat, sendcan)
+    return self.update_vl()
+
+  def take_columns(self):
+    """Values decoded since the last call while recording columns, as
+    {message name: {'t': logMonoTimes, signal name: values}} of numpy arrays"""
+    cdef vector[MessageColumns] columns = self.can.take_columns()
+    cdef MessageColumns cols
+    cdef size_t i
+    ret = {}
+    for cols in columns:
+      name = <unicode>self.address_to_msg_name[cols.address].c_str()
+      msg = {'t': np.array(cols.sec, dtype=np.uint64)}
+      for i in range(cols.names.size()):
+        msg[<unicode>cols.names[i]] = np.array(cols.values[i], dtype=np.float64)
+      ret[name] = msg
+    return ret
+
 cdef class CANDefine():
   cdef:
     const DBC *dbc
@@ -0,0 +1,68 @@
+// Throughput of the checksum functions against the serial reference implementations.
+//
+// usage: checksum_bench [frames]
+
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <random>
+#include <vector>
+
+#include "opendbc/can/common_dbc.h"
+#include "opendbc/can/tests/checksum_reference.h"
+
+typedef unsigned int (*ChecksumFn)(unsigned int, uint64_t, int);
+
+struct Frame {
+  unsigned int address;
+  uint64_t d;
+  int l;
+};
+
+static double frames_per_sec(ChecksumFn fn, const std::vector<Frame> &frames) {
+  volatile unsigned int sink = 0;
+  auto start = std::chrono::steady_clock::now();
+  for (const auto &f : frames) {
+    sink = sink + fn(f.address, f.d, f.l);
+  }
+  return frames.size() / std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+}
+
+static unsigned int pedal(unsigned int address, uint64_t d, int l) { return pedal_checksum(d, l); }
+static unsigned int pedal_ref(unsigned int address, uint64_t d, int l) { return reference::pedal_checksum(d, l); }
+// undefined addresses make volkswagen_crc print a warning
+static unsigned int volkswagen(unsigned int address, uint64_t d, int l) { return volkswagen_crc(0x9F, d, l); }
+
+int main(int argc, char **argv) {
+  size_t n = argc > 1 ? atoi(argv[1]) : 10000000;
+  init_crc_lookup_tables();
+
+  std::mt19937_64 rng(0);
+  std::vector<Frame> frames(n);
+  for (auto &f : frames) {
+    f = {(unsigned int)(rng() & 0x7FF), rng(), 8};
+  }
+
+  struct {
+    const char *name;
+    ChecksumFn fn, ref;
+  } families[] = {
+    {"honda", honda_checksum, reference::honda_checksum},
+    {"toyota", toyota_checksum, reference::toyota_checksum},
+    {"subaru", subaru_checksum, reference::subaru_checksum},
+    {"chrysler", chrysler_checksum, reference::chrysler_checksum},
+    {"pedal", pedal, pedal_ref},
+    {"volkswagen", volkswagen, NULL},
+  };
+
+  for (const auto &f : families) {
+    double fps = frames_per_sec(f.fn, frames);
+    if (f.ref) {
+      double ref_fps = frames_per_sec(f.ref, frames);
+      printf("%-10s %8.1f M frames/s  (reference %8.1f M frames/s, %.1fx)\n", f.name, fps * 1e-6, ref_fps * 1e-6, fps / ref_fps);
+    } else {
+      printf("%-10s %8.1f M frames/s\n", f.name, fps * 1e-6);
+    }
+  }
+  return 0;
+}
@@ -0,0 +1,41 @@
+#define CATCH_CONFIG_MAIN
+#include "catch2/catch.hpp"
+
+#include <random>
+
+#include "opendbc/can/common_dbc.h"
+#include "opendbc/can/tests/checksum_reference.h"
+
+// right_aligned is for chrysler, which reads the frame from the low bytes of d
+static void check_random_frames(unsigned int (*fn)(unsigned int, uint64_t, int),
+                                unsigned int (*ref)(unsigned int, uint64_t, int), bool right_aligned = false) {
+  std::mt19937_64 rng(0);
+  for (int i = 0; i < 100000; i++) {
+    // standard and extended addresses, all frame lengths
+    unsigned int address = (i % 2) ? (rng() & 0x7FF) : (rng() & 0x1FFFFFFF);
+    int l = 1 + i % 8;
+    uint64_t d = rng();
+    if (l < 8) {
+      // only the frame's bytes are set
+      d &= right_aligned ? (1ULL << (l * 8)) - 1 : ~0ULL << ((8 - l) * 8);
+    }
+    REQUIRE(fn(address, d, l) == ref(address, d, l));
+  }
+}
+
+TEST_CASE("checksums match the reference implementations") {
+  init_crc_lookup_tables();
+
+  SECTION("honda") { check_random_frames(honda_checksum, reference::honda_checksum); }
+  SECTION("toyota") { check_random_frames(toyota_checksum, reference::toyota_checksum); }
+  SECTION("subaru") { check_random_frames(subaru_checksum, reference::subaru_checksum); }
+  SECTION("chrysler") { check_random_frames(chrysler_checksum, reference::chrysler_checksum, true); }
+  SECTION("pedal") {
+    std::mt19937_64 rng(0);
+    for (int i = 0; i < 100000; i++) {
+      int l = 1 + i % 8;
+      uint64_t d = rng();
+      REQUIRE(pedal_checksum(d, l) == reference::pedal_checksum(d, l));
+    }
+  }
+}
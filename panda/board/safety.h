@@ -96,7 +96,83 @@ uint32_t get_ts_elapsed(uint32_t ts, uint32_t ts_last) {
   return ts - ts_last;
 }
 
+AddrCheckSlot addr_check_table[ADDR_CHECK_HASH_SIZE];
+const AddrCheckStruct *addr_check_table_list = NULL;  // list the table was built for
+bool addr_check_table_full = false;                   // list too long, scan it instead
+
+uint32_t addr_check_hash(uint32_t addr, uint32_t bus, uint32_t len) {
+  uint32_t key = (addr << 7) ^ (bus << 4) ^ len;
+  return (key * 2654435761U) >> (32U - ADDR_CHECK_HASH_BITS);
+}
+
+// Called when the safety mode is set. Msgs are inserted in list order, linear probing
+// then finds msgs sharing addr, bus and len in the same order as scanning the list.
+void build_addr_check_table(const AddrCheckStruct addr_list[], const int len) {
+  for (uint32_t s = 0U; s < ADDR_CHECK_HASH_SIZE; s++) {
+    addr_check_table[s].check = 0U;
+  }
+  addr_check_table_list = addr_list;
+  addr_check_table_full = false;
+
+  uint32_t count = 0U;
+  for (int i = 0; (i < len) && !addr_check_table_full; i++) {
+    for (uint8_t j = 0U; (j < 3U) && (addr_list[i].msg[j].addr != 0); j++) {
+      // keep the load factor at most 1/2
+      if (count >= (ADDR_CHECK_HASH_SIZE / 2U)) {
+        addr_check_table_full = true;
+        break;
+      }
+      const CanMsgCheck *m = &addr_list[i].msg[j];
+      uint32_t s = addr_check_hash((uint32_t)m->addr, (uint32_t)m->bus, (uint32_t)m->len);
+      while (addr_check_table[s].check != 0U) {
+        s = (s + 1U) & (ADDR_CHECK_HASH_SIZE - 1U);
+      }
+      addr_check_table[s].addr = (uint32_t)m->addr;
+      addr_check_table[s].bus = (uint8_t)m->bus;
+      addr_check_table[s].len = (uint8_t)m->len;
+      addr_check_table[s].check = (uint8_t)(i + 1);
+      addr_check_table[s].msg = j;
+      count++;
+    }
+  }
+}
+
 int get_addr_check_index(CAN_FIFOMailBox_TypeDef *to_push, AddrCheckStruct addr_list[], const int len) {
+  if (addr_list != addr_check_table_list) {
+    build_addr_check_table(addr_list, len);
+  }
+
+  int index = -1;
+  if (addr_check_table_full) {
+    index = get_addr_check_index_scan(to_push, addr_list, len);
+  } else {
+    uint32_t bus = GET_BUS(to_push);
+    uint32_t addr = GET_ADDR(to_push);
+    uint32_t length = GET_LEN(to_push);
+
+    uint32_t s = addr_check_hash(addr, bus, length);
+    while (addr_check_table[s].check != 0U) {
+      const AddrCheckSlot *slot = &addr_check_table[s];
+      if ((addr == slot->addr) && (bus == slot->bus) && (length == slot->len)) {
+        int i = (int)slot->check - 1;
+        // if multiple msgs are allowed, the first one present on the bus is checked
+        if (!addr_list[i].msg_seen) {
+          addr_list[i].index = (int)slot->msg;
+          addr_list[i].msg_seen = true;
+        }
+        if (addr_list[i].index == (int)slot->msg) {
+          index = i;
+          break;
+        }
+      }
+      s = (s + 1U) & (ADDR_CHECK_HASH_SIZE - 1U);
+    }
+  }
+  return index;
+}
+
+// reference implementation, linear in the number of msgs
+int get_addr_check_index_scan(CAN_FIFOMailBox_TypeDef *to_push, AddrCheckStruct addr_list[], const int len) {
   int bus = GET_BUS(to_push);
   int addr = GET_ADDR(to_push);
   int length = GET_LEN(to_push);
@@ -303,6 +379,7 @@ int set_safety_hooks(uint16_t mode, int16_t param) {
       safety_hook_registry[i].hooks->addr_check[j].msg_seen = false;
     }
   }
+  build_addr_check_table(current_hooks->addr_check, current_hooks->addr_check_len);
   if ((set_status == 0) && (current_hooks->init != NULL)) {
     current_hooks->init(param);
   }
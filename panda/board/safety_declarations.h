@@ -43,6 +43,19 @@ typedef struct {
   bool lagging;                      // true if and only if the time between updates is excessive
 } AddrCheckStruct;
 
+// Every msg of the current mode's AddrCheckStruct list in an open addressing hash table,
+// so the rx hook finds the entry of a frame in constant time instead of scanning the list
+#define ADDR_CHECK_HASH_BITS 6U
+#define ADDR_CHECK_HASH_SIZE (1U << ADDR_CHECK_HASH_BITS)  // at least twice the msgs of any mode
+
+typedef struct {
+  uint32_t addr;
+  uint8_t bus;
+  uint8_t len;
+  uint8_t check;                     // index + 1 of the entry in the AddrCheckStruct list, 0 if the slot is empty
+  uint8_t msg;                       // index of the msg in the entry
+} AddrCheckSlot;
+
 int safety_rx_hook(CAN_FIFOMailBox_TypeDef *to_push);
 int safety_tx_hook(CAN_FIFOMailBox_TypeDef *to_send);
 int safety_tx_lin_hook(int lin_num, uint8_t *data, int len);
@@ -59,6 +72,8 @@ bool rt_rate_limit_check(int val, int val_last, const int MAX_RT_DELTA);
 float interpolate(struct lookup_t xy, float x);
 void gen_crc_lookup_table(uint8_t poly, uint8_t crc_lut[]);
 bool msg_allowed(CAN_FIFOMailBox_TypeDef *to_send, const CanMsg msg_list[], int len);
+void build_addr_check_table(const AddrCheckStruct addr_list[], const int len);
+int get_addr_check_index_scan(CAN_FIFOMailBox_TypeDef *to_push, AddrCheckStruct addr_list[], const int len);
 int get_addr_check_index(CAN_FIFOMailBox_TypeDef *to_push, AddrCheckStruct addr_list[], const int len);
 void update_counter(AddrCheckStruct addr_list[], int index, uint8_t counter);
 void update_addr_timestamp(AddrCheckStruct addr_list[], int index);
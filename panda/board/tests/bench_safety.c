@@ -0,0 +1,233 @@
+/*
+gcc -O2 -DALLOW_DEBUG bench_safety.c -o bench_safety && ./bench_safety [frames.bin]
+
+Runs the rx hook of every safety mode over CAN traffic and reports the cost per frame,
+of the whole hook and of the addr check lookup alone, against the linear scan it replaced.
+Also checks that the lookup and the scan agree on every frame.
+
+frames.bin holds frames in the panda USB format (RIR, RDTR, RDLR, RDHR), e.g. from an
+rlog with rlog_to_frames.py. Without it every mode gets synthetic traffic: its checked
+msgs at their expected rate on a bus with 100 other addresses.
+*/
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+typedef struct {
+  uint32_t RIR;
+  uint32_t RDTR;
+  uint32_t RDLR;
+  uint32_t RDHR;
+} CAN_FIFOMailBox_TypeDef;
+
+#define MIN(a,b) \
+ ({ __typeof__ (a) _a = (a); \
+     __typeof__ (b) _b = (b); \
+   (_a < _b) ? _a : _b; })
+
+#define MAX(a,b) \
+ ({ __typeof__ (a) _a = (a); \
+     __typeof__ (b) _b = (b); \
+   (_a > _b) ? _a : _b; })
+
+#define ABS(a) \
+ ({ __typeof__ (a) _a = (a); \
+   (_a > 0) ? _a : (-_a); })
+
+#define GET_BUS(msg) (((msg)->RDTR >> 4) & 0xFF)
+#define GET_LEN(msg) ((msg)->RDTR & 0xF)
+#define GET_ADDR(msg) ((((msg)->RIR & 4) != 0) ? ((msg)->RIR >> 3) : ((msg)->RIR >> 21))
+#define GET_BYTE(msg, b) (((int)(b) > 3) ? (((msg)->RDHR >> (8U * ((unsigned int)(b) % 4U))) & 0xFFU) : (((msg)->RDLR >> (8U * (unsigned int)(b))) & 0xFFU))
+#define GET_BYTES_04(msg) ((msg)->RDLR)
+#define GET_BYTES_48(msg) ((msg)->RDHR)
+#define GET_FLAG(value, mask) (((__typeof__(mask))(value) & (mask)) == (mask))
+
+#define UNUSED(x) ((void)(x))
+
+#define CAN_MODE_NORMAL 0U
+#define CAN_MODE_OBD_CAN2 3U
+#define FAULT_RELAY_MALFUNCTION (1U << 0)
+
+uint32_t timer_us = 0U;
+uint32_t microsecond_timer_get(void) { return timer_us; }
+void set_can_mode(uint8_t mode) { (void)mode; }
+void fault_occurred(uint32_t fault) { (void)fault; }
+void fault_recovered(uint32_t fault) { (void)fault; }
+void puth(unsigned int i) { (void)i; }
+
+#include "../safety.h"
+
+#define SYNTHETIC_FRAMES 100000
+#define SYNTHETIC_OTHER_ADDRS 100
+#define REPEATS 20
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+static uint64_t cycles(void) { return __rdtsc(); }
+#else
+static uint64_t cycles(void) {
+  struct timespec t;
+  clock_gettime(CLOCK_MONOTONIC, &t);
+  return (t.tv_sec * 1000000000ULL) + t.tv_nsec;
+}
+#endif
+
+static void set_frame(CAN_FIFOMailBox_TypeDef *f, uint32_t addr, uint32_t bus, uint32_t len, uint32_t seed) {
+  f->RIR = (addr >= 0x800U) ? ((addr << 3) | 4U) : (addr << 21);
+  f->RDTR = (bus << 4) | len;
+  f->RDLR = seed * 2654435761U;
+  f->RDHR = seed * 40503U;
+}
+
+// checked msgs at their expected timestep, the rest of the bus round robin between them.
+// Entries with several msgs take turns, so the lookup sees msgs other than the locked one.
+static int synthetic_frames(const safety_hooks *hooks, CAN_FIFOMailBox_TypeDef *frames, int max_frames) {
+  int n = 0;
+  uint32_t t = 0U;
+  while (n < max_frames) {
+    for (int i = 0; (i < hooks->addr_check_len) && (n < max_frames); i++) {
+      int alternatives = (hooks->addr_check[i].msg[1].addr != 0) ? 2 : 1;
+      const CanMsgCheck *m = &hooks->addr_check[i].msg[(t / 1000U) % alternatives];
+      if ((t % m->expected_timestep) == 0U) {
+        set_frame(&frames[n], m->addr, m->bus, m->len, n);
+        n++;
+      }
+    }
+    for (int i = 0; (i < 10) && (n < max_frames); i++) {
+      uint32_t addr = 0x100U + ((n * 7U) % SYNTHETIC_OTHER_ADDRS) * 0x10U;
+      set_frame(&frames[n], addr, n % 3, 8U, n);
+      n++;
+    }
+    t += 1000U;
+  }
+  return n;
+}
+
+static bool check_lookup(AddrCheckStruct *list, int len, CAN_FIFOMailBox_TypeDef *frames, int n) {
+  bool seen[64];
+  int index[64];
+  for (int i = 0; i < len; i++) {
+    list[i].msg_seen = false;
+    list[i].index = 0;
+  }
+  build_addr_check_table(list, len);
+
+  for (int f = 0; f < n; f++) {
+    for (int i = 0; i < len; i++) {
+      seen[i] = list[i].msg_seen;
+      index[i] = list[i].index;
+    }
+    int expected = get_addr_check_index_scan(&frames[f], list, len);
+    for (int i = 0; i < len; i++) {
+      bool scan_seen = list[i].msg_seen;
+      int scan_index = list[i].index;
+      list[i].msg_seen = seen[i];
+      list[i].index = index[i];
+      seen[i] = scan_seen;
+      index[i] = scan_index;
+    }
+    if (get_addr_check_index(&frames[f], list, len) != expected) {
+      return false;
+    }
+    for (int i = 0; i < len; i++) {
+      if ((list[i].msg_seen != seen[i]) || (list[i].index != index[i])) {
+        return false;
+      }
+    }
+  }
+  return true;
+}
+
+static double lookup_cycles(AddrCheckStruct *list, int len, CAN_FIFOMailBox_TypeDef *frames, int n,
+                            int (*lookup)(CAN_FIFOMailBox_TypeDef *, AddrCheckStruct *, const int)) {
+  volatile int sink = 0;
+  uint64_t start = cycles();
+  for (int r = 0; r < REPEATS; r++) {
+    for (int f = 0; f < n; f++) {
+      sink += lookup(&frames[f], list, len);
+    }
+  }
+  (void)sink;
+  return (double)(cycles() - start) / ((double)n * REPEATS);
+}
+
+int main(int argc, char **argv) {
+  CAN_FIFOMailBox_TypeDef *recorded = NULL;
+  int recorded_n = 0;
+  if (argc > 1) {
+    FILE *f = fopen(argv[1], "rb");
+    if (f == NULL) {
+      perror(argv[1]);
+      return 1;
+    }
+    fseek(f, 0, SEEK_END);
+    recorded_n = ftell(f) / sizeof(CAN_FIFOMailBox_TypeDef);
+    fseek(f, 0, SEEK_SET);
+    recorded = malloc(recorded_n * sizeof(CAN_FIFOMailBox_TypeDef));
+    recorded_n = fread(recorded, sizeof(CAN_FIFOMailBox_TypeDef), recorded_n, f);
+    fclose(f);
+    printf("%d recorded frames from %s\n", recorded_n, argv[1]);
+  }
+  CAN_FIFOMailBox_TypeDef *synthetic = malloc(SYNTHETIC_FRAMES * sizeof(CAN_FIFOMailBox_TypeDef));
+
+#if defined(__x86_64__) || defined(__i386__)
+  const char *unit = "cycles";
+#else
+  const char *unit = "ns";
+#endif
+  printf("%6s %6s %12s %12s %12s %12s\n", "mode", "msgs", "rx hook", "lookup", "scan", unit);
+
+  bool ok = true;
+  int hook_config_count = sizeof(safety_hook_registry) / sizeof(safety_hook_config);
+  for (int c = 0; c < hook_config_count; c++) {
+    uint16_t mode = safety_hook_registry[c].id;
+    const safety_hooks *hooks = safety_hook_registry[c].hooks;
+
+    CAN_FIFOMailBox_TypeDef *frames = recorded;
+    int n = recorded_n;
+    if (frames == NULL) {
+      frames = synthetic;
+      n = synthetic_frames(hooks, synthetic, SYNTHETIC_FRAMES);
+    }
+
+    int msgs = 0;
+    for (int i = 0; i < hooks->addr_check_len; i++) {
+      for (int j = 0; (j < 3) && (hooks->addr_check[i].msg[j].addr != 0); j++) {
+        msgs++;
+      }
+    }
+
+    // whole rx hook, with the timer advancing like on the bus
+    set_safety_hooks(mode, 0);
+    uint64_t start = cycles();
+    for (int r = 0; r < REPEATS; r++) {
+      for (int f = 0; f < n; f++) {
+        timer_us += 100U;
+        safety_rx_hook(&frames[f]);
+      }
+    }
+    double hook = (double)(cycles() - start) / ((double)n * REPEATS);
+
+    double lookup = 0.0, scan = 0.0;
+    if (hooks->addr_check != NULL) {
+      if (!check_lookup(hooks->addr_check, hooks->addr_check_len, frames, n)) {
+        printf("mode %d: lookup and scan disagree\n", mode);
+        ok = false;
+      }
+      if (addr_check_table_full) {
+        printf("mode %d: %d msgs don't fit in the addr check table\n", mode, msgs);
+        ok = false;
+      }
+      lookup = lookup_cycles(hooks->addr_check, hooks->addr_check_len, frames, n, get_addr_check_index);
+      scan = lookup_cycles(hooks->addr_check, hooks->addr_check_len, frames, n, get_addr_check_index_scan);
+    }
+    printf("%6d %6d %12.1f %12.1f %12.1f\n", mode, msgs, hook, lookup, scan);
+  }
+
+  free(recorded);
+  free(synthetic);
+  return ok ? 0 : 1;
+}
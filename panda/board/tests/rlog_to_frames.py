@@ -0,0 +1,25 @@
+#!/usr/bin/env python3
+# Writes the can frames of a decompressed rlog in the panda USB format for bench_safety.
+#
+# usage: rlog_to_frames.py rlog frames.bin
+import struct
+import sys
+
+from cereal import log
+
+if __name__ == "__main__":
+  with open(sys.argv[1], "rb") as f:
+    events = log.Event.read_multiple_bytes(f.read())
+
+  with open(sys.argv[2], "wb") as out:
+    n = 0
+    for event in events:
+      if event.which() != "can":
+        continue
+      for c in event.can:
+        dat = c.dat[:8].ljust(8, b"\x00")
+        rir = ((c.address << 3) | 4) if c.address >= 0x800 else (c.address << 21)
+        rdtr = ((c.busTime & 0xFFFF) << 16) | ((c.src & 0xFF) << 4) | min(len(c.dat), 8)
+        out.write(struct.pack("<II", rir, rdtr) + dat)
+        n += 1
+  print(f"wrote {n} frames")
@@ -27,6 +27,7 @@
 #include "selfdrive/locationd/ublox_msg.h"
 
 #include "selfdrive/boardd/panda.h"
+#include "selfdrive/boardd/panda_sim.h"
 #include "selfdrive/boardd/pigeon.h"
 
 #define MAX_IR_POWER 0.5f
@@ -101,13 +102,27 @@ void safety_setter_thread() {
 }
 
 
+// BOARDD_SIM replaces the panda with a software one, generating BOARDD_SIM_RATE frames/s
+// or replaying the can messages of the decompressed rlog BOARDD_SIM_REPLAY
+static std::unique_ptr<PandaTransport> sim_transport() {
+  PandaSimConfig config;
+  if (const char *rate = getenv("BOARDD_SIM_RATE")) config.frame_rate = atof(rate);
+  if (const char *replay = getenv("BOARDD_SIM_REPLAY")) config.replay_path = replay;
+  if (const char *speed = getenv("BOARDD_SIM_SPEED")) config.replay_speed = atof(speed);
+  return std::make_unique<PandaSimTransport>(config);
+}
+
 bool usb_connect() {
   static bool connected_once = false;
 
   std::unique_ptr<Panda> tmp_panda;
   try {
     assert(panda == nullptr);
-    tmp_panda = std::make_unique<Panda>();
+    if (getenv("BOARDD_SIM")) {
+      tmp_panda = std::make_unique<Panda>(sim_transport());
+    } else {
+      tmp_panda = std::make_unique<Panda>();
+    }
   } catch (std::exception &e) {
     return false;
   }
@@ -180,57 +195,63 @@ static bool usb_retry_connect() {
 }
 
 void can_recv(PubMaster &pm) {
-  kj::Array<capnp::word> can_data;
-  panda->can_receive(can_data);
-  auto bytes = can_data.asBytes();
-  pm.send("can", bytes.begin(), bytes.size());
+  panda->can_publish(pm);
 }
 
 void can_send_thread(bool fake_send) {
   LOGD("start send thread");
+  set_thread_name("boardd_can_send");
 
-  AlignedBuffer aligned_buf;
   Context * context = Context::create();
   SubSocket * subscriber = SubSocket::create(context, "sendcan");
   assert(subscriber != NULL);
-  subscriber->setTimeout(100);
+  Poller * poller = Poller::create({subscriber});
+
+  // reused between iterations, sendcan is received without allocations
+  std::vector<SubSocket*> ready;
+  ready.reserve(1);
+  MessageArena arena;
+  arena.reserve(SENDCAN_BATCH_BYTES);
+  const std::function<void(capnp::List<cereal::CanData>::Reader)> send = [&](auto can_data_list) {
+    if (!fake_send) {
+      panda->can_send(can_data_list);
+    }
+  };
 
   // run as fast as messages come in
   while (!do_exit && panda->connected) {
-    Message * msg = subscriber->receive();
-
-    if (!msg) {
-      if (errno == EINTR) {
-        do_exit = true;
-      }
-      continue;
-    }
+    poller->poll(100, ready);
+    if (ready.empty()) continue;
 
-    capnp::FlatArrayMessageReader cmsg(aligned_buf.align(msg));
-    cereal::Event::Reader event = cmsg.getRoot<cereal::Event>();
-
-    //Dont send if older than 1 second
-    if (nanos_since_boot() - event.getLogMonoTime() < 1e9) {
-      if (!fake_send) {
-        panda->can_send(event.getSendcan());
-      }
-    }
-
-    delete msg;
+    panda_sendcan_receive(subscriber, arena, send);
   }
 
+  delete poller;
   delete subscriber;
   delete context;
 }
 
 void can_recv_thread() {
   LOGD("start recv thread");
+  set_thread_name("boardd_can_recv");
 
   // can = 8006
   PubMaster pm({"can"});
 
-  // run at 100hz
-  const uint64_t dt = 10000000ULL;
+  // Frames arrive asynchronously and are published in batches of BOARDD_CAN_PUBLISH_MS.
+  // The default of 10 keeps the 100hz can rate that controlsd steps on, 0 publishes
+  // every usb transfer as soon as it arrives.
+  const char *publish_ms = getenv("BOARDD_CAN_PUBLISH_MS");
+  const uint64_t dt = (publish_ms ? atoi(publish_ms) : 10) * 1000000ULL;
+  if (dt == 0) {
+    while (!do_exit && panda->connected) {
+      if (panda->can_wait(100)) {
+        can_recv(pm);
+      }
+    }
+    return;
+  }
+
   uint64_t next_frame_time = nanos_since_boot() + dt;
 
   while (!do_exit && panda->connected) {
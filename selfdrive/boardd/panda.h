@@ -3,18 +3,16 @@
 #include <atomic>
 #include <cstdint>
 #include <ctime>
-#include <mutex>
+#include <memory>
 #include <optional>
 #include <vector>
 
-#include <libusb-1.0/libusb.h>
-
 #include "cereal/gen/cpp/car.capnp.h"
 #include "cereal/gen/cpp/log.capnp.h"
+#include "selfdrive/boardd/panda_can.h"
+#include "selfdrive/boardd/panda_transport.h"
 
-// double the FIFO size
-#define RECV_SIZE (0x1000)
-#define TIMEOUT 0
+#define CAN_RX_MAX_PENDING (RECV_SIZE * 16)  // received bytes not yet published
 
 // copied from panda/board/main.c
 struct __attribute__((packed)) health_t {
@@ -42,18 +40,17 @@ struct __attribute__((packed)) health_t {
 
 class Panda {
  private:
-  libusb_context *ctx = NULL;
-  libusb_device_handle *dev_handle = NULL;
-  std::mutex usb_lock;
-  void handle_usb_issue(int err, const char func[]);
-  void cleanup();
+  std::unique_ptr<PandaTransport> transport;
+  PandaCanRx can_rx{CAN_RX_MAX_PENDING};
 
  public:
+  // first panda found on usb
   Panda();
+  Panda(std::unique_ptr<PandaTransport> transport);
   ~Panda();
 
-  std::atomic<bool> connected = true;
-  std::atomic<bool> comms_healthy = true;
+  std::atomic<bool> &connected;
+  std::atomic<bool> &comms_healthy;
   cereal::PandaState::PandaType hw_type = cereal::PandaState::PandaType::UNKNOWN;
   bool is_pigeon = false;
   bool has_rtc = false;
@@ -81,5 +78,8 @@ class Panda {
   void set_usb_power_mode(cereal::PandaState::UsbPowerMode power_mode);
   void send_heartbeat();
   void can_send(capnp::List<cereal::CanData>::Reader can_data_list);
-  int can_receive(kj::Array<capnp::word>& out_buf);
+  // wait up to timeout_ms for received CAN data, true if there is some
+  bool can_wait(int timeout_ms);
+  // publishes the CAN data received so far
+  void can_publish(PubMaster &pm);
 };
@@ -0,0 +1,109 @@
+#include "selfdrive/boardd/panda_can.h"
+
+#include <cassert>
+#include <chrono>
+#include <cstring>
+
+#include "cereal/messaging/messaging.h"
+#include "selfdrive/common/swaglog.h"
+#include "selfdrive/common/timing.h"
+
+PandaCanRx::PandaCanRx(size_t max_pending) : max_pending(max_pending) {
+  pending.reserve(max_pending);
+  data.reserve(max_pending);
+}
+
+bool PandaCanRx::push(const uint8_t *buf, size_t size) {
+  {
+    std::lock_guard lk(lock);
+    if (pending.size() + size > max_pending) {
+      LOGW("Receive buffer full, dropping 0x%zx bytes", size);
+      return false;
+    }
+    pending.insert(pending.end(), buf, buf + size);
+  }
+  cv.notify_all();
+  return true;
+}
+
+bool PandaCanRx::wait(int timeout_ms) {
+  std::unique_lock lk(lock);
+  return cv.wait_for(lk, std::chrono::milliseconds(timeout_ms), [&] { return !pending.empty(); });
+}
+
+size_t PandaCanRx::collect() {
+  // both buffers keep their capacity
+  data.clear();
+  std::lock_guard lk(lock);
+  data.swap(pending);
+  return data.size();
+}
+
+int PandaCanRx::build(MessageBuilder &msg, bool valid) {
+  const uint32_t *frames = (const uint32_t *)data.data();
+  int recv = data.size();
+
+  size_t num_msg = recv / 0x10;
+  auto evt = msg.initEvent();
+  evt.setValid(valid);
+
+  // populate message
+  auto canData = evt.initCan(num_msg);
+  for (int i = 0; i < num_msg; i++) {
+    if (frames[i*4] & 4) {
+      // extended
+      canData[i].setAddress(frames[i*4] >> 3);
+    } else {
+      // normal
+      canData[i].setAddress(frames[i*4] >> 21);
+    }
+    canData[i].setBusTime(frames[i*4+1] >> 16);
+    int len = frames[i*4+1]&0xF;
+    canData[i].setDat(kj::arrayPtr((uint8_t*)&frames[i*4+2], len));
+    canData[i].setSrc((frames[i*4+1] >> 4) & 0xff);
+  }
+  data.clear();
+  return recv;
+}
+
+void panda_can_pack(capnp::List<cereal::CanData>::Reader can_data_list, std::vector<uint32_t> &send) {
+  const int msg_count = can_data_list.size();
+  send.assign(msg_count*4, 0);
+
+  for (int i = 0; i < msg_count; i++) {
+    auto cmsg = can_data_list[i];
+    if (cmsg.getAddress() >= 0x800) { // extended
+      send[i*4] = (cmsg.getAddress() << 3) | 5;
+    } else { // normal
+      send[i*4] = (cmsg.getAddress() << 21) | 1;
+    }
+    auto can_data = cmsg.getDat();
+    assert(can_data.size() <= 8);
+    send[i*4+1] = can_data.size() | (cmsg.getSrc() << 4);
+    memcpy(&send[i*4+2], can_data.begin(), can_data.size());
+  }
+}
+
+void panda_can_publish(PubMaster &pm, PandaCanRx &can_rx, bool valid) {
+  // build the can message in place in the msgq ring, sized for the
+  // received data so it always fits in the reserved segment
+  size_t recv = can_rx.collect();
+  MessageBuilder &msg = pm.reserve("can", CAN_RESERVE_SIZE(recv));
+  can_rx.build(msg, valid);
+  pm.commit("can");
+}
+
+void panda_sendcan_receive(SubSocket *sock, MessageArena &arena,
+                           const std::function<void(capnp::List<cereal::CanData>::Reader)> &send) {
+  arena.clear();
+  sock->receive_batch(&arena, SENDCAN_BATCH_MSGS, SENDCAN_BATCH_BYTES);
+  for (size_t i = 0; i < arena.size(); i++) {
+    capnp::FlatArrayMessageReader cmsg(arena.getWords(i));
+    cereal::Event::Reader event = cmsg.getRoot<cereal::Event>();
+
+    //Dont send if older than 1 second
+    if (nanos_since_boot() - event.getLogMonoTime() < 1e9) {
+      send(event.getSendcan());
+    }
+  }
+}
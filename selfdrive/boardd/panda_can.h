@@ -0,0 +1,55 @@
+#pragma once
+
+#include <condition_variable>
+#include <cstdint>
+#include <functional>
+#include <mutex>
+#include <vector>
+
+#include "cereal/gen/cpp/log.capnp.h"
+
+// worst case can message for recv_bytes of received frames
+#define CAN_RESERVE_SIZE(recv_bytes) ((recv_bytes) / 0x10 * 48 + 1024)
+#define SENDCAN_BATCH_MSGS 16
+#define SENDCAN_BATCH_BYTES (64 * 1024)
+
+class MessageArena;
+class MessageBuilder;
+class PubMaster;
+class SubSocket;
+
+// Frames received from the panda in its USB format, collected until they are
+// published. Both buffers are allocated up front and swapped, so the steady
+// state receive path does not touch the heap.
+class PandaCanRx {
+ public:
+  PandaCanRx(size_t max_pending);
+
+  // appends received frames, drops them if max_pending bytes are already waiting
+  bool push(const uint8_t *buf, size_t size);
+  // wait up to timeout_ms for frames, true if there are some
+  bool wait(int timeout_ms);
+  // takes everything received so far for the next build(), returns its size in bytes.
+  // Frames of an earlier collect() that were not built are dropped.
+  size_t collect();
+  // builds a can event from the collected frames, returns their size in bytes
+  int build(MessageBuilder &msg, bool valid);
+
+ private:
+  const size_t max_pending;
+  std::mutex lock;
+  std::condition_variable cv;
+  std::vector<uint8_t> pending;  // filled by push
+  std::vector<uint8_t> data;     // swapped out by collect
+};
+
+// Converts sendcan to the panda USB format. send keeps its capacity between calls.
+void panda_can_pack(capnp::List<cereal::CanData>::Reader can_data_list, std::vector<uint32_t> &send);
+
+// One step of the can loop: publishes everything received since the last call as a
+// can event, built in place in the msgq ring.
+void panda_can_publish(PubMaster &pm, PandaCanRx &can_rx, bool valid);
+// One step of the sendcan loop: receives a batch of sendcan into arena and passes each
+// one that is less than a second old to send.
+void panda_sendcan_receive(SubSocket *sock, MessageArena &arena,
+                           const std::function<void(capnp::List<cereal::CanData>::Reader)> &send);
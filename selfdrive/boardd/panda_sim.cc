@@ -0,0 +1,219 @@
+#include "selfdrive/boardd/panda_sim.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cstring>
+#include <stdexcept>
+
+#include "cereal/messaging/messaging.h"
+#include "selfdrive/boardd/panda.h"
+#include "selfdrive/common/swaglog.h"
+#include "selfdrive/common/timing.h"
+#include "selfdrive/common/util.h"
+
+#define SIM_TICK_NS 1000000ULL  // USB full speed frame interval
+#define FRAMES_PER_TRANSFER (RECV_SIZE / 0x10)
+
+PandaSimTransport::PandaSimTransport(const PandaSimConfig &config) : config(config) {
+  if (!config.replay_path.empty()) {
+    load_replay(config.replay_path);
+    if (replay.empty()) {
+      LOGE("no can messages to replay in %s", config.replay_path.c_str());
+      throw std::runtime_error("Error connecting to simulated panda");
+    }
+  }
+  send.reserve(RECV_SIZE / 4);
+  echo.reserve(RECV_SIZE / 2);
+}
+
+PandaSimTransport::~PandaSimTransport() {
+  can_stop();
+  connected = false;
+}
+
+void PandaSimTransport::load_replay(const std::string &path) {
+  std::string data = util::read_file(path);
+  kj::Array<capnp::word> words = kj::heapArray<capnp::word>(data.size() / sizeof(capnp::word));
+  memcpy(words.begin(), data.data(), words.size() * sizeof(capnp::word));
+
+  uint64_t first = 0;
+  kj::ArrayPtr<const capnp::word> remaining = words;
+  while (remaining.size() > 0) {
+    capnp::FlatArrayMessageReader cmsg(remaining, {.traversalLimitInWords = kj::maxValue});
+    cereal::Event::Reader event = cmsg.getRoot<cereal::Event>();
+    remaining = kj::arrayPtr(cmsg.getEnd(), remaining.end());
+    if (event.which() != cereal::Event::CAN) continue;
+
+    if (replay.empty()) first = event.getLogMonoTime();
+    ReplayEvent e = {.t = event.getLogMonoTime() - first};
+    for (auto c : event.getCan()) {
+      auto dat = c.getDat();
+      uint32_t f[4] = {};
+      f[0] = c.getAddress() >= 0x800 ? ((c.getAddress() << 3) | 4) : (c.getAddress() << 21);
+      f[1] = ((uint32_t)c.getBusTime() << 16) | ((c.getSrc() & 0xFF) << 4) | std::min<size_t>(dat.size(), 8);
+      memcpy(&f[2], dat.begin(), std::min<size_t>(dat.size(), 8));
+      e.frames.insert(e.frames.end(), f, f + 4);
+    }
+    replay.push_back(std::move(e));
+  }
+  LOGW("simulated panda replaying %zu can messages from %s", replay.size(), path.c_str());
+}
+
+int PandaSimTransport::control_write(uint8_t bRequest, uint16_t wValue, uint16_t wIndex, unsigned int timeout) {
+  if (!connected) return -1;
+
+  if (bRequest == 0xe5) {
+    loopback = wValue != 0;
+  } else if (bRequest == 0xdc) {
+    safety_model = wValue;
+  }
+  return 0;
+}
+
+int PandaSimTransport::control_read(uint8_t bRequest, uint16_t wValue, uint16_t wIndex, unsigned char *data, uint16_t wLength, unsigned int timeout) {
+  if (!connected) return -1;
+
+  memset(data, 0, wLength);
+  switch (bRequest) {
+    case 0xc1: {  // hw type
+      data[0] = (uint8_t)config.hw_type;
+      return 1;
+    }
+    case 0xd2: {  // health
+      health_t health = {};
+      health.uptime = nanos_since_boot() / 1000000000ULL;
+      health.voltage = 12000;
+      health.ignition_line = config.ignition;
+      health.car_harness_status = 1;
+      health.safety_model = safety_model;
+      memcpy(data, &health, std::min<size_t>(wLength, sizeof(health)));
+      return std::min<size_t>(wLength, sizeof(health));
+    }
+    case 0xd3:    // firmware signature, first and second half
+    case 0xd4: {
+      memset(data, bRequest == 0xd3 ? 0x5a : 0xa5, wLength);
+      return wLength;
+    }
+    case 0xd0: {  // serial
+      strncpy((char *)data, "simulatedpanda00", wLength);
+      return std::min<size_t>(wLength, 16);
+    }
+    case 0xe0:    // gps, nothing to read
+      return 0;
+    default:
+      return wLength;
+  }
+}
+
+int PandaSimTransport::bulk_write(unsigned char endpoint, unsigned char *data, int length, unsigned int timeout) {
+  return connected ? length : 0;
+}
+
+int PandaSimTransport::bulk_read(unsigned char endpoint, unsigned char *data, int length, unsigned int timeout) {
+  return 0;
+}
+
+int PandaSimTransport::can_start(PandaCanRx *rx) {
+  can_rx = rx;
+  sim_exit = false;
+  thread = std::thread(&PandaSimTransport::run, this);
+  return 0;
+}
+
+void PandaSimTransport::can_stop() {
+  sim_exit = true;
+  if (thread.joinable()) {
+    thread.join();
+  }
+}
+
+void PandaSimTransport::push(const uint32_t *frames, size_t num_frames) {
+  frames_generated += num_frames;
+  if (!can_rx->push((const uint8_t *)frames, num_frames * 0x10)) {
+    frames_dropped += num_frames;
+  }
+}
+
+void PandaSimTransport::run() {
+  set_thread_name("panda_sim");
+
+  std::vector<uint32_t> buf(FRAMES_PER_TRANSFER * 4);
+  size_t n = 0;
+  auto add_frame = [&](const uint32_t *f) {
+    memcpy(&buf[n * 4], f, 0x10);
+    if (++n == FRAMES_PER_TRANSFER) {
+      push(buf.data(), n);
+      n = 0;
+    }
+  };
+
+  const uint64_t start = nanos_since_boot();
+  uint64_t seq = 0;
+  uint64_t replay_start = start;
+  size_t replay_idx = 0;
+
+  for (uint64_t tick = 1; !sim_exit; tick++) {
+    uint64_t next = start + tick * SIM_TICK_NS;
+    uint64_t now = nanos_since_boot();
+    if (next > now) {
+      std::this_thread::sleep_for(std::chrono::nanoseconds(next - now));
+      now = nanos_since_boot();
+    }
+
+    if (replay.empty()) {
+      // everything that became due since the last tick
+      const uint64_t due = (now - start) * 1e-9 * config.frame_rate;
+      const uint32_t t_us = now / 1000;
+      for (; seq < due; seq++) {
+        uint32_t bus = seq % config.num_buses;
+        uint32_t f[4] = {
+          (uint32_t)(0x100 + seq % 0x400) << 21,
+          ((t_us & 0xFFFF) << 16) | (bus << 4) | 8,
+          (uint32_t)seq,
+          t_us,
+        };
+        add_frame(f);
+      }
+    } else {
+      while (replay_start + replay[replay_idx].t / config.replay_speed <= now) {
+        const auto &frames = replay[replay_idx].frames;
+        for (size_t i = 0; i < frames.size(); i += 4) {
+          add_frame(&frames[i]);
+        }
+        if (++replay_idx == replay.size()) {
+          replay_idx = 0;
+          replay_start = now + SIM_TICK_NS;
+        }
+      }
+    }
+
+    if (n > 0) {
+      push(buf.data(), n);
+      n = 0;
+    }
+  }
+}
+
+void PandaSimTransport::can_send(capnp::List<cereal::CanData>::Reader can_data_list) {
+  if (!connected || can_rx == nullptr) return;
+
+  std::lock_guard lk(send_lock);
+  panda_can_pack(can_data_list, send);
+
+  echo.clear();
+  const uint32_t bus_time = (nanos_since_boot() / 1000) & 0xFFFF;
+  for (size_t i = 0; i < send.size(); i += 4) {
+    // drop the transmit bit, mark the echo as sent by us
+    uint32_t address = send[i] & ~1U;
+    uint32_t src = (send[i+1] >> 4) & 0xFF;
+    uint32_t len = send[i+1] & 0xF;
+    uint32_t f[4] = {address, (bus_time << 16) | ((src | 0x80) << 4) | len, send[i+2], send[i+3]};
+    echo.insert(echo.end(), f, f + 4);
+    if (loopback) {
+      f[1] = (bus_time << 16) | (src << 4) | len;
+      echo.insert(echo.end(), f, f + 4);
+    }
+  }
+  frames_sent += send.size() / 4;
+  can_rx->push((const uint8_t *)echo.data(), echo.size() * sizeof(uint32_t));
+}
@@ -0,0 +1,70 @@
+#pragma once
+
+#include <atomic>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "selfdrive/boardd/panda_transport.h"
+
+struct PandaSimConfig {
+  cereal::PandaState::PandaType hw_type = cereal::PandaState::PandaType::WHITE_PANDA;
+  bool ignition = true;
+
+  // synthetic bus load, frames per second spread round robin over num_buses
+  double frame_rate = 3000;
+  int num_buses = 3;
+
+  // decompressed rlog whose can messages are replayed in a loop instead
+  std::string replay_path;
+  double replay_speed = 1.0;
+};
+
+// A panda in software, for load testing boardd without hardware.
+//
+// Received frames are produced on a thread once per millisecond, the USB frame
+// interval, in chunks of at most RECV_SIZE like bulk transfers. Synthetic frames
+// carry a sequence number in dat[0:4] and their creation time in microseconds of
+// nanos_since_boot() in dat[4:8], so subscribers can measure loss and latency.
+// Sent frames are echoed back with src + 0x80 like the real panda acknowledges
+// them, and with their original src as well in loopback mode.
+class PandaSimTransport : public PandaTransport {
+ public:
+  PandaSimTransport(const PandaSimConfig &config);
+  ~PandaSimTransport();
+
+  int control_write(uint8_t bRequest, uint16_t wValue, uint16_t wIndex, unsigned int timeout);
+  int control_read(uint8_t bRequest, uint16_t wValue, uint16_t wIndex, unsigned char *data, uint16_t wLength, unsigned int timeout);
+  int bulk_write(unsigned char endpoint, unsigned char *data, int length, unsigned int timeout);
+  int bulk_read(unsigned char endpoint, unsigned char *data, int length, unsigned int timeout);
+
+  int can_start(PandaCanRx *rx);
+  void can_stop();
+  void can_send(capnp::List<cereal::CanData>::Reader can_data_list);
+
+  std::atomic<uint64_t> frames_generated = 0;
+  std::atomic<uint64_t> frames_dropped = 0;  // rx buffer was full
+  std::atomic<uint64_t> frames_sent = 0;
+
+ private:
+  struct ReplayEvent {
+    uint64_t t;                   // ns since the first event
+    std::vector<uint32_t> frames; // panda USB format
+  };
+
+  void run();
+  void push(const uint32_t *frames, size_t num_frames);
+  void load_replay(const std::string &path);
+
+  const PandaSimConfig config;
+  std::vector<ReplayEvent> replay;
+  std::atomic<bool> loopback = false;
+  std::atomic<uint16_t> safety_model = 0;
+  std::atomic<bool> sim_exit = false;
+  std::thread thread;
+  PandaCanRx *can_rx = nullptr;
+
+  std::mutex send_lock;
+  std::vector<uint32_t> send, echo;
+};
@@ -0,0 +1,34 @@
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+
+#include "cereal/gen/cpp/log.capnp.h"
+#include "selfdrive/boardd/panda_can.h"
+
+// double the FIFO size
+#define RECV_SIZE (0x1000)
+#define TIMEOUT 0
+
+// How Panda talks to the hardware: vendor control requests, bulk endpoints and
+// the CAN stream. Implemented over libusb by PandaUsbTransport and in software
+// by PandaSimTransport.
+class PandaTransport {
+ public:
+  virtual ~PandaTransport() {}
+
+  std::atomic<bool> connected = true;
+  std::atomic<bool> comms_healthy = true;
+
+  virtual int control_write(uint8_t bRequest, uint16_t wValue, uint16_t wIndex, unsigned int timeout) = 0;
+  virtual int control_read(uint8_t bRequest, uint16_t wValue, uint16_t wIndex, unsigned char *data, uint16_t wLength, unsigned int timeout) = 0;
+  virtual int bulk_write(unsigned char endpoint, unsigned char *data, int length, unsigned int timeout) = 0;
+  virtual int bulk_read(unsigned char endpoint, unsigned char *data, int length, unsigned int timeout) = 0;
+
+  // Starts streaming received CAN frames into rx, returns 0 on success.
+  // can_stop() must be called before rx goes away.
+  virtual int can_start(PandaCanRx *rx) = 0;
+  virtual void can_stop() = 0;
+  // Queues sendcan without blocking, dropped if the panda can't keep up
+  virtual void can_send(capnp::List<cereal::CanData>::Reader can_data_list) = 0;
+};
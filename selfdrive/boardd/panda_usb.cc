@@ -0,0 +1,299 @@
+#include "selfdrive/boardd/panda_usb.h"
+
+#include <stdexcept>
+
+#include "selfdrive/common/swaglog.h"
+
+PandaUsbTransport::PandaUsbTransport() {
+  // init libusb
+  int err = libusb_init(&ctx);
+  if (err != 0) { goto fail; }
+
+#if LIBUSB_API_VERSION >= 0x01000106
+  libusb_set_option(ctx, LIBUSB_OPTION_LOG_LEVEL, LIBUSB_LOG_LEVEL_INFO);
+#else
+  libusb_set_debug(ctx, 3);
+#endif
+
+  dev_handle = libusb_open_device_with_vid_pid(ctx, 0xbbaa, 0xddcc);
+  if (dev_handle == NULL) { goto fail; }
+
+  if (libusb_kernel_driver_active(dev_handle, 0) == 1) {
+    libusb_detach_kernel_driver(dev_handle, 0);
+  }
+
+  err = libusb_set_configuration(dev_handle, 1);
+  if (err != 0) { goto fail; }
+
+  err = libusb_claim_interface(dev_handle, 0);
+  if (err != 0) { goto fail; }
+
+  return;
+
+fail:
+  cleanup();
+  throw std::runtime_error("Error connecting to panda");
+}
+
+PandaUsbTransport::~PandaUsbTransport() {
+  can_stop();
+
+  std::lock_guard lk(usb_lock);
+  cleanup();
+  connected = false;
+}
+
+void PandaUsbTransport::cleanup() {
+  if (dev_handle) {
+    libusb_release_interface(dev_handle, 0);
+    libusb_close(dev_handle);
+  }
+
+  if (ctx) {
+    libusb_exit(ctx);
+  }
+}
+
+int PandaUsbTransport::can_start(PandaCanRx *rx) {
+  can_rx = rx;
+
+  for (int i = 0; i < CAN_RX_TRANSFERS + CAN_TX_TRANSFERS; i++) {
+    auto t = std::make_unique<CanTransfer>();
+    t->usb = this;
+    t->transfer = libusb_alloc_transfer(0);
+    if (t->transfer == NULL) return LIBUSB_ERROR_NO_MEM;
+
+    if (i < CAN_RX_TRANSFERS) {
+      t->buf.resize(RECV_SIZE / 4);
+      libusb_fill_bulk_transfer(t->transfer, dev_handle, 0x81, (unsigned char*)t->buf.data(), RECV_SIZE, can_rx_callback, t.get(), 0);
+      can_rx_transfers.push_back(std::move(t));
+    } else {
+      t->buf.reserve(RECV_SIZE / 4);
+      can_tx_free.push_back(t.get());
+      can_tx_transfers.push_back(std::move(t));
+    }
+  }
+
+  usb_event_thread = std::thread(&PandaUsbTransport::handle_usb_events, this);
+
+  // several reads in flight, so the panda always has somewhere to put new frames
+  for (auto &t : can_rx_transfers) {
+    can_transfers_active++;
+    int err = libusb_submit_transfer(t->transfer);
+    if (err != 0) {
+      can_transfers_active--;
+      return err;
+    }
+  }
+  return 0;
+}
+
+void PandaUsbTransport::can_stop() {
+  {
+    // the rx callback resubmits under can_rx_submit_lock, nothing is resubmitted after this
+    std::lock_guard lk(can_rx_submit_lock);
+    can_transfers_exit = true;
+  }
+  for (auto &t : can_rx_transfers) {
+    libusb_cancel_transfer(t->transfer);
+  }
+
+  // tx transfers finish within CAN_TX_TIMEOUT
+  if (usb_event_thread.joinable()) {
+    usb_event_thread.join();
+  }
+
+  for (auto &t : can_rx_transfers) libusb_free_transfer(t->transfer);
+  for (auto &t : can_tx_transfers) libusb_free_transfer(t->transfer);
+  can_rx_transfers.clear();
+  can_tx_transfers.clear();
+  can_tx_free.clear();
+}
+
+void PandaUsbTransport::handle_usb_events() {
+  // a transfer may only be freed once it completed
+  while (!can_transfers_exit || can_transfers_active > 0) {
+    struct timeval tv = {.tv_sec = 0, .tv_usec = 100000};
+    int err = libusb_handle_events_timeout_completed(ctx, &tv, NULL);
+    if (err != 0 && err != LIBUSB_ERROR_INTERRUPTED) {
+      handle_usb_issue(err, __func__);
+    }
+  }
+}
+
+void LIBUSB_CALL PandaUsbTransport::can_rx_callback(libusb_transfer *transfer) {
+  PandaUsbTransport *p = ((CanTransfer *)transfer->user_data)->usb;
+
+  if (transfer->status == LIBUSB_TRANSFER_OVERFLOW) {
+    p->comms_healthy = false;
+    LOGE_100("overflow got 0x%x", transfer->actual_length);
+  } else if (transfer->status == LIBUSB_TRANSFER_NO_DEVICE) {
+    p->handle_usb_issue(LIBUSB_ERROR_NO_DEVICE, __func__);
+  } else if (transfer->status != LIBUSB_TRANSFER_COMPLETED && transfer->status != LIBUSB_TRANSFER_CANCELLED) {
+    LOGE_100("can rx transfer failed with status %d", transfer->status);
+  }
+
+  if (transfer->status == LIBUSB_TRANSFER_COMPLETED && transfer->actual_length > 0) {
+    p->can_rx->push(transfer->buffer, transfer->actual_length);
+  }
+
+  std::lock_guard lk(p->can_rx_submit_lock);
+  bool resubmit = !p->can_transfers_exit && p->connected && transfer->status != LIBUSB_TRANSFER_CANCELLED;
+  if (resubmit) {
+    int err = libusb_submit_transfer(transfer);
+    if (err != 0) {
+      p->handle_usb_issue(err, __func__);
+      resubmit = false;
+    }
+  }
+  if (!resubmit) {
+    p->can_transfers_active--;
+  }
+}
+
+void LIBUSB_CALL PandaUsbTransport::can_tx_callback(libusb_transfer *transfer) {
+  CanTransfer *t = (CanTransfer *)transfer->user_data;
+  PandaUsbTransport *p = t->usb;
+
+  // If the receive buffer on the panda is full it will NAK until the transfer
+  // times out. We drop the messages.
+  if (transfer->status == LIBUSB_TRANSFER_TIMED_OUT) {
+    LOGW("Transmit buffer full");
+  } else if (transfer->status == LIBUSB_TRANSFER_NO_DEVICE) {
+    p->handle_usb_issue(LIBUSB_ERROR_NO_DEVICE, __func__);
+  } else if (transfer->status != LIBUSB_TRANSFER_COMPLETED && transfer->status != LIBUSB_TRANSFER_CANCELLED) {
+    LOGE_100("can tx transfer failed with status %d", transfer->status);
+  }
+
+  std::lock_guard lk(p->can_tx_lock);
+  p->can_tx_free.push_back(t);
+  p->can_transfers_active--;
+}
+
+void PandaUsbTransport::handle_usb_issue(int err, const char func[]) {
+  LOGE_100("usb error %d \"%s\" in %s", err, libusb_strerror((enum libusb_error)err), func);
+  if (err == LIBUSB_ERROR_NO_DEVICE) {
+    LOGE("lost connection");
+    connected = false;
+  }
+  // TODO: check other errors, is simply retrying okay?
+}
+
+int PandaUsbTransport::control_write(uint8_t bRequest, uint16_t wValue, uint16_t wIndex, unsigned int timeout) {
+  int err;
+  const uint8_t bmRequestType = LIBUSB_ENDPOINT_OUT | LIBUSB_REQUEST_TYPE_VENDOR | LIBUSB_RECIPIENT_DEVICE;
+
+  if (!connected) {
+    return LIBUSB_ERROR_NO_DEVICE;
+  }
+
+  std::lock_guard lk(usb_lock);
+  do {
+    err = libusb_control_transfer(dev_handle, bmRequestType, bRequest, wValue, wIndex, NULL, 0, timeout);
+    if (err < 0) handle_usb_issue(err, __func__);
+  } while (err < 0 && connected);
+
+  return err;
+}
+
+int PandaUsbTransport::control_read(uint8_t bRequest, uint16_t wValue, uint16_t wIndex, unsigned char *data, uint16_t wLength, unsigned int timeout) {
+  int err;
+  const uint8_t bmRequestType = LIBUSB_ENDPOINT_IN | LIBUSB_REQUEST_TYPE_VENDOR | LIBUSB_RECIPIENT_DEVICE;
+
+  if (!connected) {
+    return LIBUSB_ERROR_NO_DEVICE;
+  }
+
+  std::lock_guard lk(usb_lock);
+  do {
+    err = libusb_control_transfer(dev_handle, bmRequestType, bRequest, wValue, wIndex, data, wLength, timeout);
+    if (err < 0) handle_usb_issue(err, __func__);
+  } while (err < 0 && connected);
+
+  return err;
+}
+
+int PandaUsbTransport::bulk_write(unsigned char endpoint, unsigned char* data, int length, unsigned int timeout) {
+  int err;
+  int transferred = 0;
+
+  if (!connected) {
+    return 0;
+  }
+
+  std::lock_guard lk(usb_lock);
+  do {
+    // Try sending can messages. If the receive buffer on the panda is full it will NAK
+    // and libusb will try again. After 5ms, it will time out. We will drop the messages.
+    err = libusb_bulk_transfer(dev_handle, endpoint, data, length, &transferred, timeout);
+
+    if (err == LIBUSB_ERROR_TIMEOUT) {
+      LOGW("Transmit buffer full");
+      break;
+    } else if (err != 0 || length != transferred) {
+      handle_usb_issue(err, __func__);
+    }
+  } while(err != 0 && connected);
+
+  return transferred;
+}
+
+int PandaUsbTransport::bulk_read(unsigned char endpoint, unsigned char* data, int length, unsigned int timeout) {
+  int err;
+  int transferred = 0;
+
+  if (!connected) {
+    return 0;
+  }
+
+  std::lock_guard lk(usb_lock);
+
+  do {
+    err = libusb_bulk_transfer(dev_handle, endpoint, data, length, &transferred, timeout);
+
+    if (err == LIBUSB_ERROR_TIMEOUT) {
+      break; // timeout is okay to exit, recv still happened
+    } else if (err == LIBUSB_ERROR_OVERFLOW) {
+      comms_healthy = false;
+      LOGE_100("overflow got 0x%x", transferred);
+    } else if (err != 0) {
+      handle_usb_issue(err, __func__);
+    }
+
+  } while(err != 0 && connected);
+
+  return transferred;
+}
+
+void PandaUsbTransport::can_send(capnp::List<cereal::CanData>::Reader can_data_list) {
+  if (!connected || can_transfers_exit) {
+    return;
+  }
+
+  CanTransfer *t = nullptr;
+  {
+    std::lock_guard lk(can_tx_lock);
+    if (!can_tx_free.empty()) {
+      t = can_tx_free.back();
+      can_tx_free.pop_back();
+    }
+  }
+  if (t == nullptr) {
+    // all CAN_TX_TRANSFERS are still waiting for the panda
+    LOGW("Transmit buffer full");
+    return;
+  }
+
+  std::vector<uint32_t> &send = t->buf;
+  panda_can_pack(can_data_list, send);
+
+  libusb_fill_bulk_transfer(t->transfer, dev_handle, 3, (unsigned char*)send.data(), send.size() * sizeof(uint32_t), can_tx_callback, t, CAN_TX_TIMEOUT);
+  can_transfers_active++;
+  int err = libusb_submit_transfer(t->transfer);
+  if (err != 0) {
+    handle_usb_issue(err, __func__);
+    std::lock_guard lk(can_tx_lock);
+    can_tx_free.push_back(t);
+    can_transfers_active--;
+  }
+}
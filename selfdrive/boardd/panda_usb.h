@@ -0,0 +1,59 @@
+#pragma once
+
+#include <atomic>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include <libusb-1.0/libusb.h>
+
+#include "selfdrive/boardd/panda_transport.h"
+
+// asynchronous CAN transfers
+#define CAN_RX_TRANSFERS 4                   // bulk reads kept in flight
+#define CAN_TX_TRANSFERS 8                   // sendcan messages in flight before dropping
+#define CAN_TX_TIMEOUT 5                     // ms, the panda NAKs while its send buffer is full
+
+class PandaUsbTransport : public PandaTransport {
+ public:
+  PandaUsbTransport();
+  ~PandaUsbTransport();
+
+  int control_write(uint8_t bRequest, uint16_t wValue, uint16_t wIndex, unsigned int timeout);
+  int control_read(uint8_t bRequest, uint16_t wValue, uint16_t wIndex, unsigned char *data, uint16_t wLength, unsigned int timeout);
+  int bulk_write(unsigned char endpoint, unsigned char *data, int length, unsigned int timeout);
+  int bulk_read(unsigned char endpoint, unsigned char *data, int length, unsigned int timeout);
+
+  int can_start(PandaCanRx *rx);
+  void can_stop();
+  void can_send(capnp::List<cereal::CanData>::Reader can_data_list);
+
+ private:
+  libusb_context *ctx = NULL;
+  libusb_device_handle *dev_handle = NULL;
+  std::mutex usb_lock;
+  void handle_usb_issue(int err, const char func[]);
+  void cleanup();
+
+  // CAN goes through asynchronous bulk transfers that complete on usb_event_thread,
+  // so sends and control transfers under usb_lock never stall receiving
+  struct CanTransfer {
+    PandaUsbTransport *usb;
+    libusb_transfer *transfer;
+    std::vector<uint32_t> buf;
+  };
+  std::thread usb_event_thread;
+  std::atomic<bool> can_transfers_exit = false;
+  std::atomic<int> can_transfers_active = 0;
+  std::vector<std::unique_ptr<CanTransfer>> can_rx_transfers, can_tx_transfers;
+  std::mutex can_rx_submit_lock;
+  PandaCanRx *can_rx = nullptr;
+
+  std::mutex can_tx_lock;
+  std::vector<CanTransfer *> can_tx_free;
+
+  void handle_usb_events();
+  static void LIBUSB_CALL can_rx_callback(libusb_transfer *transfer);
+  static void LIBUSB_CALL can_tx_callback(libusb_transfer *transfer);
+};
@@ -0,0 +1,195 @@
+// Runs boardd against the simulated panda at increasing bus loads and reports
+// can publish latency, lost frames, the sendcan round trip and the CPU use of
+// the can threads. Run from selfdrive/boardd.
+//
+// usage: tests/boardd_bench [seconds per rate] [BOARDD_CAN_PUBLISH_MS] [frames/s ...]
+
+#include <dirent.h>
+#include <signal.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cassert>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <map>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#include "cereal/messaging/messaging.h"
+#include "selfdrive/common/timing.h"
+
+#define SENDCAN_FRAMES 4
+
+struct BenchResult {
+  double offered = 0;                   // frames/s
+  uint64_t received = 0, expected = 0;  // synthetic frames
+  std::vector<uint32_t> latency_us, sendcan_us;
+  std::map<std::string, double> cpu;    // thread name -> % of one core
+};
+
+// utime + stime in seconds of every thread of pid, by thread name
+static std::map<std::string, double> thread_cpu(pid_t pid) {
+  std::map<std::string, double> cpu;
+  std::string task_dir = "/proc/" + std::to_string(pid) + "/task";
+  DIR *d = opendir(task_dir.c_str());
+  if (d == NULL) return cpu;
+
+  while (struct dirent *de = readdir(d)) {
+    if (de->d_name[0] == '.') continue;
+    std::ifstream stat_file(task_dir + "/" + de->d_name + "/stat");
+    std::string stat((std::istreambuf_iterator<char>(stat_file)), std::istreambuf_iterator<char>());
+
+    // comm is in parentheses and may contain spaces
+    size_t open = stat.find('('), close = stat.rfind(')');
+    if (open == std::string::npos || close == std::string::npos) continue;
+    std::string name = stat.substr(open + 1, close - open - 1);
+
+    std::istringstream fields(stat.substr(close + 2));
+    std::string field;
+    unsigned long long utime = 0, stime = 0;
+    for (int i = 3; i <= 15 && fields >> field; i++) {
+      if (i == 14) utime = std::stoull(field);
+      if (i == 15) stime = std::stoull(field);
+    }
+    cpu[name] += (double)(utime + stime) / sysconf(_SC_CLK_TCK);
+  }
+  closedir(d);
+  return cpu;
+}
+
+static void send_sendcan(PubMaster &pm, uint32_t seq) {
+  MessageBuilder msg;
+  auto sendcan = msg.initEvent().initSendcan(SENDCAN_FRAMES);
+  uint32_t dat[2] = {seq, (uint32_t)(nanos_since_boot() / 1000)};
+  for (int i = 0; i < SENDCAN_FRAMES; i++) {
+    sendcan[i].setAddress(0x300 + i);
+    sendcan[i].setDat(kj::arrayPtr((uint8_t *)dat, sizeof(dat)));
+    sendcan[i].setSrc(0);
+  }
+  pm.send("sendcan", msg);
+}
+
+static BenchResult run(double rate, int seconds, const char *publish_ms) {
+  BenchResult r = {.offered = rate};
+
+  pid_t pid = fork();
+  assert(pid >= 0);
+  if (pid == 0) {
+    setenv("BOARDD_SIM", "1", 1);
+    setenv("BOARDD_SIM_RATE", std::to_string(rate).c_str(), 1);
+    setenv("BOARDD_CAN_PUBLISH_MS", publish_ms, 1);
+    execl("./boardd", "./boardd", (char *)NULL);
+    perror("exec boardd");
+    _exit(1);
+  }
+
+  Context *context = Context::create();
+  SubSocket *can_sock = SubSocket::create(context, "can");
+  Poller *poller = Poller::create({can_sock});
+  PubMaster pm({"sendcan"});
+  MessageArena arena;
+  std::vector<SubSocket *> ready;
+
+  const uint64_t start = nanos_since_boot();
+  const uint64_t measure_start = start + 2 * 1000000000ULL;  // connect and warm up
+  const uint64_t end = measure_start + seconds * 1000000000ULL;
+  uint64_t next_sendcan = start;
+  uint32_t sendcan_seq = 0;
+  uint64_t min_seq = UINT64_MAX, max_seq = 0;
+  std::map<std::string, double> cpu_start;
+  bool measuring = false;
+
+  while (nanos_since_boot() < end) {
+    uint64_t now = nanos_since_boot();
+    if (!measuring && now >= measure_start) {
+      measuring = true;
+      cpu_start = thread_cpu(pid);
+    }
+    if (now >= next_sendcan) {
+      send_sendcan(pm, sendcan_seq++);
+      next_sendcan += 10000000ULL;  // controlsd rate
+    }
+
+    poller->poll(1, ready);
+    if (ready.empty()) continue;
+
+    arena.clear();
+    can_sock->receive_batch(&arena, 64, 1 << 22);
+    if (!measuring) continue;
+
+    const uint32_t now_us = nanos_since_boot() / 1000;
+    for (size_t i = 0; i < arena.size(); i++) {
+      capnp::FlatArrayMessageReader cmsg(arena.getWords(i));
+      for (auto c : cmsg.getRoot<cereal::Event>().getCan()) {
+        auto dat = c.getDat();
+        if (dat.size() != 8) continue;
+
+        uint32_t seq, t_us;
+        memcpy(&seq, dat.begin(), sizeof(seq));
+        memcpy(&t_us, dat.begin() + 4, sizeof(t_us));
+        if (c.getSrc() >= 0x80) {
+          // sendcan echo, once per message
+          if (c.getAddress() == 0x300) r.sendcan_us.push_back(now_us - t_us);
+        } else {
+          r.latency_us.push_back(now_us - t_us);
+          r.received++;
+          min_seq = std::min<uint64_t>(min_seq, seq);
+          max_seq = std::max<uint64_t>(max_seq, seq);
+        }
+      }
+    }
+  }
+
+  auto cpu_end = thread_cpu(pid);
+  for (auto &[name, t] : cpu_end) {
+    r.cpu[name] = (t - cpu_start[name]) / seconds * 100.0;
+  }
+  r.expected = r.received > 0 ? max_seq - min_seq + 1 : rate * seconds;
+
+  kill(pid, SIGINT);
+  waitpid(pid, NULL, 0);
+
+  delete poller;
+  delete can_sock;
+  delete context;
+  return r;
+}
+
+static double pct(std::vector<uint32_t> &v, double p) {
+  if (v.empty()) return 0;
+  std::sort(v.begin(), v.end());
+  return v[std::min(v.size() - 1, (size_t)(p * v.size()))] / 1e3;
+}
+
+int main(int argc, char **argv) {
+  int seconds = argc > 1 ? atoi(argv[1]) : 5;
+  const char *publish_ms = argc > 2 ? argv[2] : "10";
+  std::vector<double> rates;
+  for (int i = 3; i < argc; i++) rates.push_back(atof(argv[i]));
+  if (rates.empty()) rates = {1000, 3000, 10000, 30000, 100000, 300000};
+
+  double max_sustained = 0;
+  printf("%10s %10s %8s %24s %24s %8s %8s %8s\n", "offered/s", "recv/s", "lost %",
+         "latency ms p50/p99/max", "sendcan ms p50/p99/max", "recv %", "send %", "sim %");
+  for (double rate : rates) {
+    BenchResult r = run(rate, seconds, publish_ms);
+    double lost = r.expected > 0 ? 100.0 * (1.0 - (double)r.received / r.expected) : 100.0;
+    char latency[64], sendcan[64];
+    snprintf(latency, sizeof(latency), "%.2f/%.2f/%.2f", pct(r.latency_us, 0.5), pct(r.latency_us, 0.99), pct(r.latency_us, 1.0));
+    snprintf(sendcan, sizeof(sendcan), "%.2f/%.2f/%.2f", pct(r.sendcan_us, 0.5), pct(r.sendcan_us, 0.99), pct(r.sendcan_us, 1.0));
+    printf("%10.0f %10.0f %8.3f %24s %24s %8.1f %8.1f %8.1f\n", rate, (double)r.received / seconds, lost, latency, sendcan,
+           r.cpu["boardd_can_recv"], r.cpu["boardd_can_send"], r.cpu["panda_sim"]);
+    fflush(stdout);
+
+    if (r.received > 0 && lost <= 0.0) {
+      max_sustained = std::max(max_sustained, rate);
+    }
+  }
+  printf("max sustained without loss: %.0f frames/s\n", max_sustained);
+  return 0;
+}
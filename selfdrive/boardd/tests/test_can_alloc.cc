@@ -0,0 +1,113 @@
+#define CATCH_CONFIG_MAIN
+#include "catch2/catch.hpp"
+
+#include <atomic>
+#include <cstdlib>
+
+#include "cereal/messaging/messaging.h"
+#include "selfdrive/boardd/panda_can.h"
+
+// Counts heap allocations while enabled. operator new ends up in malloc too.
+static std::atomic<bool> count_allocs = false;
+static std::atomic<size_t> num_allocs = 0;
+
+extern "C" {
+void *__libc_malloc(size_t size);
+void *__libc_calloc(size_t n, size_t size);
+void *__libc_realloc(void *ptr, size_t size);
+
+void *malloc(size_t size) {
+  if (count_allocs) num_allocs++;
+  return __libc_malloc(size);
+}
+
+void *calloc(size_t n, size_t size) {
+  if (count_allocs) num_allocs++;
+  return __libc_calloc(n, size);
+}
+
+void *realloc(void *ptr, size_t size) {
+  if (count_allocs) num_allocs++;
+  return __libc_realloc(ptr, size);
+}
+}
+
+#define MAX_PENDING (0x1000 * 16)
+
+// Stands in for the USB side of Panda. Received frames are pushed like the rx
+// callback does, sendcan is packed and looped back like set_loopback(true).
+class FakePanda {
+ public:
+  PandaCanRx can_rx{MAX_PENDING};
+  std::vector<uint32_t> send;
+
+  FakePanda() { send.reserve(0x1000 / 4); }
+
+  void receive_frames(int n, uint32_t t) {
+    for (int i = 0; i < n; i++) {
+      uint32_t frame[4] = {(uint32_t)(0x100 + i) << 21, (t << 16) | 8, (uint32_t)i, t};
+      can_rx.push((const uint8_t *)frame, sizeof(frame));
+    }
+  }
+
+  void can_send(capnp::List<cereal::CanData>::Reader can_data_list) {
+    panda_can_pack(can_data_list, send);
+    can_rx.push((const uint8_t *)send.data(), send.size() * sizeof(uint32_t));
+  }
+};
+
+TEST_CASE("boardd can loop does not allocate in steady state") {
+  const int warmup = 100, iterations = 1000;
+  const int num_recv = 50, num_send = 4;
+
+  FakePanda panda;
+  PubMaster pm({"can", "sendcan"});
+  Context *context = Context::create();
+  SubSocket *can_sock = SubSocket::create(context, "can");
+  SubSocket *sendcan_sock = SubSocket::create(context, "sendcan");
+  MessageArena can_arena, sendcan_arena;
+  sendcan_arena.reserve(SENDCAN_BATCH_BYTES);
+  // the same loop steps boardd runs, with the fake panda in place of USB
+  const std::function<void(capnp::List<cereal::CanData>::Reader)> send = [&](auto can_data_list) {
+    panda.can_send(can_data_list);
+  };
+
+  size_t total_allocs = 0;
+  for (int i = 0; i < warmup + iterations; i++) {
+    // controlsd side, not counted
+    MessageBuilder sendcan_msg;
+    auto sendcan = sendcan_msg.initEvent().initSendcan(num_send);
+    for (int j = 0; j < num_send; j++) {
+      uint8_t dat[8] = {(uint8_t)i, (uint8_t)j};
+      sendcan[j].setAddress(0x200 + j);
+      sendcan[j].setDat(kj::arrayPtr(dat, 8));
+      sendcan[j].setSrc(0);
+    }
+    pm.send("sendcan", sendcan_msg);
+    panda.receive_frames(num_recv, i);
+
+    // the first iterations size the buffers
+    num_allocs = 0;
+    count_allocs = i >= warmup;
+    panda_sendcan_receive(sendcan_sock, sendcan_arena, send);
+    panda_can_publish(pm, panda.can_rx, true);
+    count_allocs = false;
+    total_allocs += num_allocs;
+
+    // received frames and the looped back sendcan are published together
+    can_arena.clear();
+    REQUIRE(can_sock->receive_batch(&can_arena, 16, 1 << 20) == 1);
+    capnp::FlatArrayMessageReader cmsg(can_arena.getWords(0));
+    auto can = cmsg.getRoot<cereal::Event>().getCan();
+    REQUIRE(can.size() == num_recv + num_send);
+    REQUIRE(can[0].getAddress() == 0x100);
+    REQUIRE(can[0].getBusTime() == (i & 0xFFFF));
+    REQUIRE(can[num_recv].getAddress() == 0x200);
+    REQUIRE(can[num_recv].getDat()[0] == (uint8_t)i);
+  }
+  REQUIRE(total_allocs == 0);
+
+  delete can_sock;
+  delete sendcan_sock;
+  delete context;
+}
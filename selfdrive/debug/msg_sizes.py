@@ -0,0 +1,28 @@
+#!/usr/bin/env python3
+# Measures the serialized size of every service in an rlog, printed as the
+# message_sizes table in cereal/services.py: (typical, largest) in bytes.
+import sys
+from collections import defaultdict
+
+import numpy as np
+
+from cereal.services import DEFAULT_MESSAGE_SIZE
+from tools.lib.logreader import LogReader
+
+
+def kib(n):
+  return int(np.ceil(n / 1024.)) * 1024
+
+
+if __name__ == "__main__":
+  sizes = defaultdict(list)
+  for path in sys.argv[1:]:
+    for msg in LogReader(path):
+      sizes[msg.which()].append(len(msg.as_builder().to_bytes()))
+
+  print("message_sizes = {")
+  for name in sorted(sizes):
+    typical, largest = kib(np.median(sizes[name])), kib(max(sizes[name]))
+    if typical > DEFAULT_MESSAGE_SIZE[0] or largest > DEFAULT_MESSAGE_SIZE[1]:
+      print(f'  "{name}": ({typical}, {largest}),  # {len(sizes[name])} messages')
+  print("}")
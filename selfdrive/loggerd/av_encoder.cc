@@ -0,0 +1,217 @@
+#pragma clang diagnostic ignored "-Wdeprecated-declarations"
+
+#include "selfdrive/loggerd/av_encoder.h"
+
+#include <fcntl.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cassert>
+#include <cstdio>
+#include <cstdlib>
+
+#define __STDC_CONSTANT_MACROS
+
+extern "C" {
+#include <libavcodec/avcodec.h>
+#include <libavformat/avformat.h>
+#include <libavutil/opt.h>
+}
+
+#include "libyuv.h"
+
+#include "selfdrive/common/swaglog.h"
+#include "selfdrive/common/util.h"
+
+// LOGGERD_ENCODER<suffix> for HEVC, LOGGERD_QCAM_ENCODER<suffix> for H.264
+static const char *encoder_env(bool h265, const char *suffix) {
+  const std::string name = std::string(h265 ? "LOGGERD_ENCODER" : "LOGGERD_QCAM_ENCODER") + suffix;
+  return getenv(name.c_str());
+}
+
+static std::string default_codec_name(bool h265) {
+  const char *env = encoder_env(h265, "");
+  return env != nullptr ? env : (h265 ? "libx265" : "libx264");
+}
+
+bool AvEncoder::available(bool h265) {
+  av_register_all();
+  return avcodec_find_encoder_by_name(default_codec_name(h265).c_str()) != NULL;
+}
+
+AvEncoder::AvEncoder(const char* filename, int width, int height, int fps, int bitrate, bool h265, bool downscale)
+  : filename(filename), width(width), height(height), fps(fps), bitrate(bitrate), h265(h265), downscale(downscale) {
+  av_register_all();
+  codec_name = default_codec_name(h265);
+  codec = avcodec_find_encoder_by_name(codec_name.c_str());
+  assert(codec);
+
+  const char *env = encoder_env(h265, "_PRESET");
+  preset = env != nullptr ? env : (h265 ? AV_ENCODER_H265_PRESET : AV_ENCODER_H264_PRESET);
+  env = encoder_env(h265, "_THREADS");
+  threads = env != nullptr ? atoi(env) : AV_ENCODER_THREADS;
+  LOGD("%s: %s preset %s, %d threads", filename, codec_name.c_str(), preset.c_str(), threads);
+
+  frame = av_frame_alloc();
+  assert(frame);
+  frame->format = AV_PIX_FMT_YUV420P;
+  frame->width = width;
+  frame->height = height;
+  frame->linesize[0] = width;
+  frame->linesize[1] = width/2;
+  frame->linesize[2] = width/2;
+
+  pkt = av_packet_alloc();
+  assert(pkt);
+
+  if (downscale) {
+    y_ptr2 = (uint8_t *)malloc(width*height);
+    u_ptr2 = (uint8_t *)malloc(width*height/4);
+    v_ptr2 = (uint8_t *)malloc(width*height/4);
+  }
+}
+
+AvEncoder::~AvEncoder() {
+  assert(!is_open);
+  av_packet_free(&pkt);
+  av_frame_free(&frame);
+  if (downscale) {
+    free(y_ptr2);
+    free(u_ptr2);
+    free(v_ptr2);
+  }
+}
+
+void AvEncoder::encoder_open(const char* path) {
+  vid_path = util::string_format("%s/%s", path, filename);
+  LOGD("encoder_open %s", vid_path.c_str());
+
+  // the muxer is picked by the extension
+  avformat_alloc_output_context2(&format_ctx, NULL, NULL, vid_path.c_str());
+  assert(format_ctx);
+
+  // the codec is reopened for every file, a flushed encoder can't take more frames
+  codec_ctx = avcodec_alloc_context3(codec);
+  assert(codec_ctx);
+  codec_ctx->width = width;
+  codec_ctx->height = height;
+  codec_ctx->pix_fmt = AV_PIX_FMT_YUV420P;
+  codec_ctx->time_base = (AVRational){ 1, fps };
+  codec_ctx->framerate = (AVRational){ fps, 1 };
+  codec_ctx->bit_rate = bitrate;
+  // a keyframe every second, so a file can be cut anywhere
+  codec_ctx->gop_size = fps;
+  codec_ctx->max_b_frames = 0;
+  // frames in parallel and slices of a frame in parallel, whichever the codec supports
+  codec_ctx->thread_count = threads;
+  codec_ctx->thread_type = FF_THREAD_FRAME | FF_THREAD_SLICE;
+  if (format_ctx->oformat->flags & AVFMT_GLOBALHEADER) {
+    codec_ctx->flags |= AV_CODEC_FLAG_GLOBAL_HEADER;
+  }
+
+  AVDictionary *opts = NULL;
+  av_dict_set(&opts, "preset", preset.c_str(), 0);
+  if (codec_name == "libx265") {
+    // x265 has its own thread pool and ignores thread_count
+    std::string params = "log-level=error";
+    if (threads > 0) {
+      params += util::string_format(":pools=%d:frame-threads=%d", threads, std::min(threads, 4));
+    }
+    av_dict_set(&opts, "x265-params", params.c_str(), 0);
+  }
+  int err = avcodec_open2(codec_ctx, codec, &opts);
+  av_dict_free(&opts);
+  assert(err >= 0);
+
+  stream = avformat_new_stream(format_ctx, NULL);
+  assert(stream);
+  stream->time_base = codec_ctx->time_base;
+  err = avcodec_parameters_from_context(stream->codecpar, codec_ctx);
+  assert(err >= 0);
+
+  err = avio_open(&format_ctx->pb, vid_path.c_str(), AVIO_FLAG_WRITE);
+  assert(err >= 0);
+  err = avformat_write_header(format_ctx, NULL);
+  assert(err >= 0);
+
+  // create camera lock file
+  lock_path = util::string_format("%s/%s.lock", path, filename);
+  int lock_fd = open(lock_path.c_str(), O_RDWR | O_CREAT, 0777);
+  assert(lock_fd >= 0);
+  close(lock_fd);
+
+  is_open = true;
+  counter = 0;
+}
+
+// muxes what the encoder has ready
+void AvEncoder::write_packets() {
+  while (avcodec_receive_packet(codec_ctx, pkt) == 0) {
+    av_packet_rescale_ts(pkt, codec_ctx->time_base, stream->time_base);
+    pkt->stream_index = stream->index;
+    int err = av_interleaved_write_frame(format_ctx, pkt);
+    if (err < 0) {
+      LOGW_100("%s: write error %d", vid_path.c_str(), err);
+    }
+    av_packet_unref(pkt);
+  }
+}
+
+void AvEncoder::encoder_close() {
+  if (!is_open) return;
+
+  // flush the frames still in the encoder's threads
+  avcodec_send_frame(codec_ctx, NULL);
+  write_packets();
+
+  int err = av_write_trailer(format_ctx);
+  assert(err == 0);
+  err = avio_closep(&format_ctx->pb);
+  assert(err == 0);
+  avformat_free_context(format_ctx);
+  format_ctx = NULL;
+  stream = NULL;
+  avcodec_free_context(&codec_ctx);
+
+  unlink(lock_path.c_str());
+  is_open = false;
+}
+
+int AvEncoder::encode_frame(const uint8_t *y_ptr, const uint8_t *u_ptr, const uint8_t *v_ptr,
+                            int in_width, int in_height, uint64_t ts) {
+  if (!is_open) {
+    return -1;
+  }
+
+  if (downscale) {
+    libyuv::I420Scale(y_ptr, in_width,
+                      u_ptr, in_width/2,
+                      v_ptr, in_width/2,
+                      in_width, in_height,
+                      y_ptr2, width,
+                      u_ptr2, width/2,
+                      v_ptr2, width/2,
+                      width, height,
+                      libyuv::kFilterNone);
+    y_ptr = y_ptr2;
+    u_ptr = u_ptr2;
+    v_ptr = v_ptr2;
+  }
+
+  // not reference counted, so libavcodec copies it if it keeps it for a frame thread
+  frame->data[0] = (uint8_t*)y_ptr;
+  frame->data[1] = (uint8_t*)u_ptr;
+  frame->data[2] = (uint8_t*)v_ptr;
+  frame->pts = counter;
+
+  int ret = counter;
+  int err = avcodec_send_frame(codec_ctx, frame);
+  if (err < 0) {
+    LOGE("encoding error %d", err);
+    ret = -1;
+  } else {
+    counter++;
+  }
+  write_packets();
+  return ret;
+}
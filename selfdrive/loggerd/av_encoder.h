@@ -0,0 +1,58 @@
+#pragma once
+
+#include <cstdint>
+#include <string>
+
+extern "C" {
+#include <libavcodec/avcodec.h>
+#include <libavformat/avformat.h>
+}
+
+#include "selfdrive/loggerd/encoder.h"
+
+// Encoder threads, 0 lets the codec pick from the number of cores
+#define AV_ENCODER_THREADS 0
+#define AV_ENCODER_H265_PRESET "ultrafast"
+#define AV_ENCODER_H264_PRESET "veryfast"
+
+// AvEncoder, lossy codec using libavcodec in software. HEVC goes through libx265 and
+// H.264 through libx264. The HEVC cameras are configured with LOGGERD_ENCODER,
+// LOGGERD_ENCODER_PRESET and LOGGERD_ENCODER_THREADS, qcamera with the same variables
+// prefixed LOGGERD_QCAM_ENCODER, to override the codec and the defaults above. Files
+// are muxed by their extension like on device, raw hevc for the cameras and mpegts
+// for qcamera. Only built into loggerd with scons --av-encoder.
+class AvEncoder : public VideoEncoder {
+public:
+  AvEncoder(const char* filename, int width, int height, int fps, int bitrate, bool h265, bool downscale);
+  ~AvEncoder();
+  int encode_frame(const uint8_t *y_ptr, const uint8_t *u_ptr, const uint8_t *v_ptr,
+                   int in_width, int in_height, uint64_t ts);
+  void encoder_open(const char* path);
+  void encoder_close();
+
+  // false if libavcodec doesn't have the codec
+  static bool available(bool h265);
+
+private:
+  void write_packets();
+
+  const char* filename;
+  int width, height, fps, bitrate;
+  bool h265;
+  std::string codec_name, preset;
+  int threads;
+
+  int counter = 0;
+  bool is_open = false;
+  std::string vid_path, lock_path;
+
+  AVCodec *codec = NULL;
+  AVCodecContext *codec_ctx = NULL;
+  AVFormatContext *format_ctx = NULL;
+  AVStream *stream = NULL;
+  AVFrame *frame = NULL;
+  AVPacket *pkt = NULL;
+
+  bool downscale;
+  uint8_t *y_ptr2, *u_ptr2, *v_ptr2;
+};
@@ -0,0 +1,320 @@
+#include "selfdrive/loggerd/compressor.h"
+
+#include <algorithm>
+#include <cassert>
+#include <cstring>
+
+#include <bzlib.h>
+#include <zstd.h>
+
+#include "selfdrive/common/swaglog.h"
+#include "selfdrive/common/util.h"
+
+#define LOG_COMPRESS_THREADS 2
+#define LOG_COMPRESS_QUEUE 16
+#define LOG_INDEX_CHUNK_SIZE (64 * 1024)
+
+LogCompression log_compression_from_env() {
+  const char *env = getenv("LOGGERD_COMPRESSION");
+  return (env != nullptr && strcmp(env, "zstd") == 0) ? LogCompression::ZSTD : LogCompression::BZ2;
+}
+
+const char *log_compression_ext(LogCompression compression) {
+  return compression == LogCompression::ZSTD ? "zst" : "bz2";
+}
+
+bool log_decompress(const char *data, size_t size, std::string &out) {
+  char buf[64 * 1024];
+  if (size >= 3 && memcmp(data, "BZh", 3) == 0) {
+    bz_stream strm = {};
+    int ret = BZ_STREAM_END;
+    while (size > 0 && ret == BZ_STREAM_END) {
+      // one stream per block
+      if (BZ2_bzDecompressInit(&strm, 0, 0) != BZ_OK) return false;
+      strm.next_in = (char *)data;
+      strm.avail_in = size;
+      do {
+        strm.next_out = buf;
+        strm.avail_out = sizeof(buf);
+        ret = BZ2_bzDecompress(&strm);
+        out.append(buf, sizeof(buf) - strm.avail_out);
+      } while (ret == BZ_OK && (strm.avail_in > 0 || strm.avail_out == 0));
+      data = strm.next_in;
+      size = strm.avail_in;
+      BZ2_bzDecompressEnd(&strm);
+    }
+    return ret == BZ_STREAM_END;
+  }
+
+  const uint32_t ZSTD_MAGIC = 0xFD2FB528;
+  uint32_t magic = 0;
+  memcpy(&magic, data, std::min(size, sizeof(magic)));
+  if (magic != ZSTD_MAGIC && (magic & 0xFFFFFFF0) != 0x184D2A50) {
+    // not compressed
+    out.append(data, size);
+    return true;
+  }
+
+  // zstd frames, skippable frames like the seek table are ignored
+  ZSTD_DStream *dstream = ZSTD_createDStream();
+  ZSTD_inBuffer in = {data, size, 0};
+  size_t ret = 0;
+  while (in.pos < in.size) {
+    ZSTD_outBuffer o = {buf, sizeof(buf), 0};
+    ret = ZSTD_decompressStream(dstream, &o, &in);
+    if (ZSTD_isError(ret)) break;
+    out.append(buf, o.pos);
+  }
+  // flush what is left of the last frame
+  while (!ZSTD_isError(ret) && ret != 0) {
+    ZSTD_outBuffer o = {buf, sizeof(buf), 0};
+    ret = ZSTD_decompressStream(dstream, &o, &in);
+    if (!ZSTD_isError(ret)) out.append(buf, o.pos);
+    if (o.pos == 0) break;
+  }
+  ZSTD_freeDStream(dstream);
+  return !ZSTD_isError(ret) && ret == 0;
+}
+
+// ***** compressors *****
+
+class Bz2Compressor : public LogCompressor {
+ public:
+  bool compress(const std::string &in, std::string &out) {
+    // worst case from the bzip2 manual
+    unsigned int size = in.size() + in.size() / 100 + 600;
+    out.resize(size);
+    int bzerror = BZ2_bzBuffToBuffCompress(out.data(), &size, (char *)in.data(), in.size(), 9, 0, 30);
+    out.resize(bzerror == BZ_OK ? size : 0);
+    return bzerror == BZ_OK;
+  }
+};
+
+class ZstdCompressor : public LogCompressor {
+ public:
+  ZstdCompressor() : cctx(ZSTD_createCCtx()) { assert(cctx != NULL); }
+  ~ZstdCompressor() { ZSTD_freeCCtx(cctx); }
+
+  bool compress(const std::string &in, std::string &out) {
+    out.resize(ZSTD_compressBound(in.size()));
+    size_t rc = ZSTD_compressCCtx(cctx, out.data(), out.size(), in.data(), in.size(), LOG_ZSTD_LEVEL);
+    out.resize(ZSTD_isError(rc) ? 0 : rc);
+    return !ZSTD_isError(rc);
+  }
+
+ private:
+  ZSTD_CCtx *cctx;
+};
+
+std::unique_ptr<LogCompressor> LogCompressor::create(LogCompression compression) {
+  if (compression == LogCompression::ZSTD) {
+    return std::make_unique<ZstdCompressor>();
+  }
+  return std::make_unique<Bz2Compressor>();
+}
+
+// ***** thread pool *****
+
+LogCompressorPool::LogCompressorPool(int num_threads, int max_queued) : max_queued(max_queued) {
+  for (int i = 0; i < num_threads; i++) {
+    threads.push_back(std::thread(&LogCompressorPool::run, this));
+  }
+}
+
+LogCompressorPool::~LogCompressorPool() {
+  {
+    std::unique_lock lk(lock);
+    exit = true;
+  }
+  cv_job.notify_all();
+  for (auto &t : threads) t.join();
+}
+
+std::unique_ptr<LogCompressorPool> LogCompressorPool::create_from_env() {
+  const char *env = getenv("LOGGERD_COMPRESS_THREADS");
+  int num_threads = env != nullptr ? atoi(env) : LOG_COMPRESS_THREADS;
+  if (num_threads <= 0) {
+    return nullptr;
+  }
+  return std::make_unique<LogCompressorPool>(num_threads, LOG_COMPRESS_QUEUE);
+}
+
+void LogCompressorPool::submit(CompressedLogFile *file, LogBlock *block) {
+  std::unique_lock lk(lock);
+  if (queue.size() >= max_queued) {
+    LOGW_100("log compression falling behind, %zu blocks queued", queue.size());
+    cv_space.wait(lk, [&] { return queue.size() < max_queued; });
+  }
+  queue.push_back({file, block});
+  lk.unlock();
+  cv_job.notify_one();
+}
+
+void LogCompressorPool::run() {
+  set_thread_name("log_compress");
+
+  // compressors keep their state between blocks
+  std::unique_ptr<LogCompressor> compressors[2];
+  while (true) {
+    Job job;
+    {
+      std::unique_lock lk(lock);
+      cv_job.wait(lk, [&] { return exit || !queue.empty(); });
+      if (queue.empty()) break;
+      job = queue.front();
+      queue.pop_front();
+    }
+    cv_space.notify_one();
+
+    auto &compressor = compressors[(int)job.file->compression];
+    if (!compressor) {
+      compressor = LogCompressor::create(job.file->compression);
+    }
+    job.block->ok = compressor->compress(job.block->raw, job.block->compressed);
+    job.file->compressed(job.block);
+  }
+}
+
+// ***** log file *****
+
+CompressedLogFile::CompressedLogFile(const char *path, LogCompression compression, LogCompressorPool *pool,
+                                     const char *index_path, AsyncLogWriter *io, LogLatencyHistogram *latency)
+  : compression(compression),
+    block_size(compression == LogCompression::ZSTD ? LOG_ZSTD_BLOCK_SIZE : LOG_BZ2_BLOCK_SIZE),
+    pool(pool) {
+  file = std::make_unique<LogFile>(io, path, true, latency);
+  if (index_path != nullptr) {
+    // entries are buffered until a chunk fills, or the log is closed at rotation
+    index_file = std::make_unique<LogFile>(io, index_path, false, nullptr, LOG_INDEX_CHUNK_SIZE);
+    LogIndexHeader header = {.magic = LOG_INDEX_MAGIC, .version = LOG_INDEX_VERSION, .compression = (uint8_t)compression};
+    index_file->write(&header, sizeof(header));
+  }
+  if (pool == nullptr) {
+    compressor = LogCompressor::create(compression);
+  }
+  cur = std::make_unique<LogBlock>();
+  cur->raw.reserve(block_size);
+}
+
+CompressedLogFile::~CompressedLogFile() {
+  if (!cur->raw.empty()) {
+    submit();
+  }
+  {
+    std::unique_lock lk(lock);
+    cv.wait(lk, [&] { return pending.empty(); });
+  }
+  // the last blocks may still be being written
+  std::unique_lock wlk(write_lock);
+  if (compression == LogCompression::ZSTD) {
+    write_seek_table();
+  }
+  index_file.reset();
+  file.reset();
+}
+
+// a block is submitted once it is full, messages aren't split
+void CompressedLogFile::write(const void *data, size_t size) {
+  cur->raw.append((const char *)data, size);
+  if (cur->raw.size() >= block_size) {
+    submit();
+  }
+}
+
+// the index is taken from the caller, events aren't parsed here
+void CompressedLogFile::write_event(const void *data, size_t size, uint64_t mono_time, int which) {
+  if (index_file != nullptr) {
+    cur->info.add_event(mono_time, which);
+  }
+  write(data, size);
+}
+
+// hands the current block off and starts the next one in a recycled block
+void CompressedLogFile::submit() {
+  LogBlock *b = cur.get();
+  {
+    std::unique_lock lk(lock);
+    b->done = false;
+    pending.push_back(std::move(cur));
+    if (!free_blocks.empty()) {
+      cur = std::move(free_blocks.back());
+      free_blocks.pop_back();
+    } else {
+      cur = std::make_unique<LogBlock>();
+      cur->raw.reserve(block_size);
+    }
+    cur->info = {};
+  }
+
+  if (pool != nullptr) {
+    pool->submit(this, b);
+  } else {
+    b->ok = compressor->compress(b->raw, b->compressed);
+    compressed(b);
+  }
+}
+
+// writes out every block that is done, in order. Blocks are only taken off pending
+// under lock, the writes can wait for the I/O thread and don't hold up submit().
+void CompressedLogFile::compressed(LogBlock *b) {
+  std::unique_lock wlk(write_lock);
+  {
+    std::unique_lock lk(lock);
+    b->done = true;
+    while (!pending.empty() && pending.front()->done) {
+      ready.push_back(std::move(pending.front()));
+      pending.pop_front();
+    }
+  }
+
+  for (auto &front : ready) {
+    if (front->ok) {
+      file->write(front->compressed.data(), front->compressed.size());
+      seek_table.push_back({front->compressed.size(), front->raw.size()});
+      if (index_file != nullptr) {
+        LogIndexBlock &info = front->info;
+        info.offset = offset;
+        info.raw_offset = raw_offset;
+        info.size = front->compressed.size();
+        info.raw_size = front->raw.size();
+        index_file->write(&info, sizeof(info));
+      }
+      offset += front->compressed.size();
+      raw_offset += front->raw.size();
+    } else if (!error_logged) {
+      LOGE("log compression error, dropped %zu bytes", front->raw.size());
+      error_logged = true;
+    }
+    front->raw.clear();
+  }
+
+  std::unique_lock lk(lock);
+  for (auto &front : ready) {
+    free_blocks.push_back(std::move(front));
+  }
+  ready.clear();
+  if (pending.empty()) {
+    cv.notify_all();
+  }
+}
+
+// skippable frame at the end that maps blocks to file offsets
+void CompressedLogFile::write_seek_table() {
+  std::vector<uint32_t> table;
+  table.reserve(2 + seek_table.size() * 2 + 3);
+  table.push_back(ZSTD_SEEKABLE_SKIPPABLE_MAGIC);
+  table.push_back(seek_table.size() * 8 + 9);
+  for (auto &[compressed_size, decompressed_size] : seek_table) {
+    table.push_back(compressed_size);
+    table.push_back(decompressed_size);
+  }
+  table.push_back(seek_table.size());
+
+  // the footer is 9 bytes: number of frames, descriptor (no checksums), magic
+  uint8_t footer_end[5] = {0};
+  uint32_t magic = ZSTD_SEEKABLE_MAGIC;
+  memcpy(&footer_end[1], &magic, sizeof(magic));
+
+  file->write(table.data(), table.size() * sizeof(uint32_t));
+  file->write(footer_end, sizeof(footer_end));
+}
@@ -0,0 +1,133 @@
+#pragma once
+
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <utility>
+#include <vector>
+
+#include <capnp/serialize.h>
+#include <kj/array.h>
+
+#include "selfdrive/loggerd/log_index.h"
+#include "selfdrive/loggerd/log_writer.h"
+
+// Log files are written in independently compressed blocks of whole messages. Blocks
+// are compressed on a shared thread pool and appended to the file in order, so writers
+// only copy into the current block. Concatenated bz2 streams and zstd frames both
+// decompress as one file with the standard tools.
+enum class LogCompression {
+  BZ2,
+  ZSTD,
+};
+
+// bz2 level 9 works on 900k blocks, larger blocks wouldn't compress better
+#define LOG_BZ2_BLOCK_SIZE (900 * 1000)
+// zstd blocks are also the seek granularity
+#define LOG_ZSTD_BLOCK_SIZE (256 * 1024)
+#define LOG_ZSTD_LEVEL 3
+
+// zstd seekable format seek table, see zstd/contrib/seekable_format
+#define ZSTD_SEEKABLE_SKIPPABLE_MAGIC 0x184D2A5E
+#define ZSTD_SEEKABLE_MAGIC 0x8F92EAB1
+
+// from LOGGERD_COMPRESSION, bz2 unless set to zstd
+LogCompression log_compression_from_env();
+const char *log_compression_ext(LogCompression compression);
+// Decompresses concatenated bz2 streams or zstd frames, appending to out.
+// Data that is neither is appended as is.
+bool log_decompress(const char *data, size_t size, std::string &out);
+
+class LogCompressor {
+ public:
+  virtual ~LogCompressor() {}
+  // Compresses in into out as one self contained stream/frame, returns false on error
+  virtual bool compress(const std::string &in, std::string &out) = 0;
+
+  static std::unique_ptr<LogCompressor> create(LogCompression compression);
+};
+
+class CompressedLogFile;
+
+struct LogBlock {
+  std::string raw, compressed;
+  LogIndexBlock info;
+  bool done = false;
+  bool ok = false;
+};
+
+class LogCompressorPool {
+ public:
+  // Up to max_queued blocks wait for a thread, writers block when it's full
+  LogCompressorPool(int num_threads, int max_queued);
+  ~LogCompressorPool();
+
+  // from LOGGERD_COMPRESS_THREADS, 0 compresses on the writer's thread
+  static std::unique_ptr<LogCompressorPool> create_from_env();
+
+ private:
+  friend class CompressedLogFile;
+  struct Job {
+    CompressedLogFile *file;
+    LogBlock *block;
+  };
+
+  void submit(CompressedLogFile *file, LogBlock *block);
+  void run();
+
+  const size_t max_queued;
+  std::mutex lock;
+  std::condition_variable cv_job, cv_space;
+  std::deque<Job> queue;
+  bool exit = false;
+  std::vector<std::thread> threads;
+};
+
+class CompressedLogFile {
+ public:
+  // Without a pool blocks are compressed synchronously in write(), without an io writer
+  // they are written by the thread that compressed them. With an index_path events must
+  // be written with write_event() to be added to the index.
+  CompressedLogFile(const char *path, LogCompression compression, LogCompressorPool *pool = nullptr,
+                    const char *index_path = nullptr, AsyncLogWriter *io = nullptr,
+                    LogLatencyHistogram *latency = nullptr);
+  // Compresses what is left, waits for all blocks to be written and closes the file
+  ~CompressedLogFile();
+
+  void write(const void *data, size_t size);
+  inline void write(kj::ArrayPtr<capnp::byte> array) { write(array.begin(), array.size()); }
+  // writes one whole event, mono_time and which are its logMonoTime and type for the index
+  void write_event(const void *data, size_t size, uint64_t mono_time, int which);
+
+ private:
+  friend class LogCompressorPool;
+
+  void submit();
+  void compressed(LogBlock *b);
+  void write_seek_table();
+
+  const LogCompression compression;
+  const size_t block_size;
+  LogCompressorPool *pool;
+  std::unique_ptr<LogCompressor> compressor;  // when there is no pool
+  std::unique_ptr<LogFile> file, index_file;
+  std::unique_ptr<LogBlock> cur;
+
+  // Held only to hand blocks between threads. The writer's submit() takes it, so file
+  // writes that can wait for the I/O thread are done under write_lock instead.
+  std::mutex lock;
+  std::condition_variable cv;
+  std::deque<std::unique_ptr<LogBlock>> pending;  // submitted, in file order
+  std::vector<std::unique_ptr<LogBlock>> free_blocks;
+
+  // orders writing finished blocks, and guards what is below
+  std::mutex write_lock;
+  std::vector<std::unique_ptr<LogBlock>> ready;
+  std::vector<std::pair<uint32_t, uint32_t>> seek_table;  // compressed, decompressed size
+  uint64_t offset = 0, raw_offset = 0;
+  bool error_logged = false;
+};
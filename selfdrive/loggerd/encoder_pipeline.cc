@@ -0,0 +1,182 @@
+#include "selfdrive/loggerd/encoder_pipeline.h"
+
+#include <cassert>
+#include <cstring>
+
+#include "selfdrive/common/swaglog.h"
+#include "selfdrive/common/timing.h"
+#include "selfdrive/common/util.h"
+
+EncoderPipeline::EncoderPipeline(const std::string &name, std::vector<VideoEncoder *> encoders, int width, int height,
+                                 EncodedCallback on_encoded)
+  : name(name), width(width), height(height), on_encoded(on_encoded) {
+  assert(!encoders.empty());
+  for (auto e : encoders) {
+    auto w = std::make_unique<Worker>();
+    w->encoder = e;
+    workers.push_back(std::move(w));
+  }
+  push_targets.reserve(workers.size());
+  for (int i = 0; i < workers.size(); i++) {
+    workers[i]->thread = std::thread(&EncoderPipeline::encoder_thread, this, i);
+  }
+}
+
+EncoderPipeline::~EncoderPipeline() {
+  for (auto &w : workers) {
+    w->queue.push(nullptr);
+  }
+  for (auto &w : workers) {
+    w->thread.join();
+  }
+}
+
+EncoderFrame *EncoderPipeline::get_frame() {
+  std::unique_lock lk(lock);
+  if (free_frames.empty()) {
+    // an encoder with room in its queue holds fewer than ENCODER_QUEUE_SIZE frames, so
+    // there is always a free frame for it
+    if (frames.size() >= ENCODER_QUEUE_SIZE * workers.size()) {
+      return nullptr;
+    }
+    // allocated as needed, usually only a few are in use
+    const size_t y_size = width * height;
+    frame_data.push_back(std::make_unique<uint8_t[]>(y_size * 3 / 2));
+    frames.push_back(std::make_unique<EncoderFrame>());
+    EncoderFrame *f = frames.back().get();
+    f->y = frame_data.back().get();
+    f->u = f->y + y_size;
+    f->v = f->u + y_size / 4;
+    free_frames.push_back(f);
+  }
+  EncoderFrame *f = free_frames.back();
+  free_frames.pop_back();
+  return f;
+}
+
+void EncoderPipeline::release(EncoderFrame *f) {
+  if (--f->refs > 0) return;
+
+  // the last encoder drops the segment, which may close its log handle
+  f->segment.reset();
+  std::unique_lock lk(lock);
+  free_frames.push_back(f);
+}
+
+bool EncoderPipeline::push(const uint8_t *y, const uint8_t *u, const uint8_t *v, const VisionIpcBufExtra &extra,
+                           uint32_t encode_id, std::shared_ptr<EncoderSegment> segment) {
+  const uint64_t start_ns = nanos_since_boot();
+  // only this thread adds to the queues, so an encoder with room now still has it below
+  std::vector<Worker *> &targets = push_targets;
+  targets.clear();
+  {
+    std::unique_lock lk(lock);
+    num_pushed++;
+    for (int i = 0; i < workers.size(); i++) {
+      Worker *w = workers[i].get();
+      if (w->queued < ENCODER_QUEUE_SIZE) {
+        targets.push_back(w);
+      } else {
+        w->num_dropped++;
+        LOGW_100("%s: encoder %d falling behind, dropping frame %d", name.c_str(), i, extra.frame_id);
+      }
+    }
+  }
+  if (targets.empty()) {
+    return false;
+  }
+  EncoderFrame *f = get_frame();
+  assert(f != nullptr);
+
+  const size_t y_size = width * height;
+  memcpy(f->y, y, y_size);
+  memcpy(f->u, u, y_size / 4);
+  memcpy(f->v, v, y_size / 4);
+  f->extra = extra;
+  f->encode_id = encode_id;
+  f->segment = std::move(segment);
+  f->refs = targets.size();
+  f->push_ns = nanos_since_boot();
+  copy_latency.add(f->push_ns - start_ns);
+
+  for (auto w : targets) {
+    const int queued = ++w->queued;
+    {
+      std::unique_lock lk(lock);
+      w->max_queued = std::max(w->max_queued, queued);
+    }
+    w->queue.push(f);
+  }
+  return targets.size() == workers.size();
+}
+
+void EncoderPipeline::encoder_thread(int idx) {
+  Worker *w = workers[idx].get();
+  set_thread_name((name + ":" + std::to_string(idx)).c_str());
+
+  while (true) {
+    EncoderFrame *f = w->queue.pop();
+    if (f == nullptr) break;
+
+    uint64_t start_ns = nanos_since_boot();
+    w->wait_latency.add(start_ns - f->push_ns);
+
+    if (f->segment != w->segment) {
+      if (w->segment) {
+        w->encoder->encoder_close();
+      }
+      w->segment = f->segment;
+      // the segment directory is created on the log I/O thread
+      if (w->segment->lh) {
+        lh_wait_ready(w->segment->lh);
+      }
+      w->encoder->encoder_open(w->segment->path.c_str());
+
+      const uint64_t ns = nanos_since_boot();
+      w->rotate_latency.add(ns - start_ns);
+      start_ns = ns;
+    }
+
+    int out_id = w->encoder->encode_frame(f->y, f->u, f->v, width, height, f->extra.timestamp_eof);
+    w->encode_latency.add(nanos_since_boot() - start_ns);
+    if (on_encoded) {
+      on_encoded(idx, *f, out_id);
+    }
+    release(f);
+    w->queued--;
+  }
+
+  if (w->segment) {
+    w->encoder->encoder_close();
+    w->segment.reset();
+  }
+}
+
+std::string EncoderPipeline::stats() {
+  std::string ret;
+  {
+    std::unique_lock lk(lock);
+    ret = util::string_format("%s: %lu frames, copy %s", name.c_str(), num_pushed, copy_latency.to_string().c_str());
+    num_pushed = 0;
+  }
+  copy_latency.reset();
+
+  for (int i = 0; i < workers.size(); i++) {
+    Worker *w = workers[i].get();
+    {
+      std::unique_lock lk(lock);
+      ret += util::string_format("; encoder %d: %lu dropped, max queued %d", i, w->num_dropped, w->max_queued);
+      w->num_dropped = 0;
+      w->max_queued = w->queued;
+    }
+    ret += util::string_format(", wait %s, encode %s", w->wait_latency.to_string().c_str(),
+                               w->encode_latency.to_string().c_str());
+    if (w->rotate_latency.count() > 0) {
+      ret += ", rotate " + w->rotate_latency.to_string();
+    }
+    w->wait_latency.reset();
+    w->encode_latency.reset();
+    w->rotate_latency.reset();
+  }
+  return ret;
+}
@@ -0,0 +1,96 @@
+#pragma once
+
+#include <atomic>
+#include <condition_variable>
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "cereal/visionipc/visionipc.h"
+#include "selfdrive/common/queue.h"
+#include "selfdrive/loggerd/encoder.h"
+#include "selfdrive/loggerd/log_writer.h"
+#include "selfdrive/loggerd/logger.h"
+
+// Frames of a camera are copied out of VisionIPC on the receiving thread and encoded by
+// one thread per encoder, so a slow encoder or a segment rotation doesn't hold up the
+// others or the camera. Each encoder has up to ENCODER_QUEUE_SIZE frames waiting or being
+// encoded, and new frames are dropped for an encoder whose queue is full. The frame pool
+// is sized so a stuck encoder can't take the frames of the others.
+#define ENCODER_QUEUE_SIZE 8
+
+// The segment frames are encoded into, encoders reopen their file when it changes
+struct EncoderSegment {
+  EncoderSegment(int num, const std::string &path, LoggerHandle *lh) : num(num), path(path), lh(lh) {}
+  ~EncoderSegment() {
+    if (lh) lh_close(lh);
+  }
+
+  const int num;
+  const std::string path;
+  LoggerHandle *const lh;
+};
+
+struct EncoderFrame {
+  uint8_t *y, *u, *v;  // I420
+  VisionIpcBufExtra extra;
+  uint32_t encode_id;
+  std::shared_ptr<EncoderSegment> segment;
+  uint64_t push_ns;
+  std::atomic<int> refs;  // encoders yet to encode it
+};
+
+class EncoderPipeline {
+ public:
+  // Called on an encoder's thread after each frame, out_id is what encode_frame returned
+  typedef std::function<void(int encoder_idx, const EncoderFrame &frame, int out_id)> EncodedCallback;
+
+  // The encoders are opened with the first frame's segment
+  EncoderPipeline(const std::string &name, std::vector<VideoEncoder *> encoders, int width, int height,
+                  EncodedCallback on_encoded = nullptr);
+  // Encodes what is queued and closes the encoders
+  ~EncoderPipeline();
+
+  // Copies the frame and queues it for every encoder with room for it, returns false if
+  // any encoder dropped it
+  bool push(const uint8_t *y, const uint8_t *u, const uint8_t *v, const VisionIpcBufExtra &extra,
+            uint32_t encode_id, std::shared_ptr<EncoderSegment> segment);
+  // Latency of every stage and queue depth since the last call
+  std::string stats();
+
+ private:
+  struct Worker {
+    VideoEncoder *encoder;
+    SafeQueue<EncoderFrame *> queue;
+    std::atomic<int> queued = 0;  // frames in the queue or being encoded
+    std::shared_ptr<EncoderSegment> segment;
+    LogLatencyHistogram wait_latency, encode_latency, rotate_latency;
+    std::thread thread;
+
+    // guarded by the pipeline's lock
+    int max_queued = 0;
+    uint64_t num_dropped = 0;
+  };
+
+  EncoderFrame *get_frame();
+  void release(EncoderFrame *f);
+  void encoder_thread(int idx);
+
+  const std::string name;
+  const int width, height;
+  EncodedCallback on_encoded;
+  std::vector<std::unique_ptr<Worker>> workers;
+  std::vector<Worker *> push_targets;  // reused by push
+
+  std::mutex lock;
+  std::vector<std::unique_ptr<EncoderFrame>> frames;
+  std::vector<std::unique_ptr<uint8_t[]>> frame_data;
+  std::vector<EncoderFrame *> free_frames;
+  uint64_t num_pushed = 0;
+
+  LogLatencyHistogram copy_latency;
+};
@@ -0,0 +1,168 @@
+#include "selfdrive/loggerd/log_index.h"
+
+#include <fcntl.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cstring>
+
+#include "selfdrive/common/swaglog.h"
+#include "selfdrive/common/util.h"
+#include "selfdrive/loggerd/compressor.h"
+
+// ***** writing *****
+
+void LogIndexBlock::add_event(uint64_t mono_time, int which) {
+  if (num_events == 0) {
+    min_mono_time = max_mono_time = mono_time;
+  } else {
+    min_mono_time = std::min(min_mono_time, mono_time);
+    max_mono_time = std::max(max_mono_time, mono_time);
+  }
+  if (which >= 0 && which < LOG_INDEX_MAX_SERVICES) {
+    services[which / 64] |= 1ULL << (which % 64);
+  }
+  num_events++;
+}
+
+bool LogIndexBlock::has_service(cereal::Event::Which which) const {
+  int i = (int)which;
+  return i < LOG_INDEX_MAX_SERVICES && (services[i / 64] & (1ULL << (i % 64))) != 0;
+}
+
+// ***** reading *****
+
+SeekableLogReader::~SeekableLogReader() {
+  if (fd >= 0) {
+    close(fd);
+  }
+}
+
+bool SeekableLogReader::load(const std::string &log_path) {
+  fd = open(log_path.c_str(), O_RDONLY | O_CLOEXEC);
+  if (fd < 0) {
+    LOGE("failed to open %s", log_path.c_str());
+    return false;
+  }
+
+  const uint64_t file_size = lseek(fd, 0, SEEK_END);
+  std::string data = util::read_file(log_path + LOG_INDEX_EXT);
+  LogIndexHeader header = {};
+  if (data.size() >= sizeof(header)) {
+    memcpy(&header, data.data(), sizeof(header));
+  }
+  has_index = header.magic == LOG_INDEX_MAGIC && header.version == LOG_INDEX_VERSION;
+  if (has_index) {
+    // a partial entry at the end means loggerd died while writing it
+    size_t num_blocks = (data.size() - sizeof(header)) / sizeof(LogIndexBlock);
+    index.resize(num_blocks);
+    memcpy(index.data(), data.data() + sizeof(header), num_blocks * sizeof(LogIndexBlock));
+  }
+
+  // blocks of unknown content after the indexed ones, or spanning the whole file
+  LogIndexBlock rest = {};
+  if (!index.empty()) {
+    rest.offset = index.back().offset + index.back().size;
+    rest.raw_offset = index.back().raw_offset + index.back().raw_size;
+  }
+  // the zstd seek table is only written after the whole index
+  uint32_t magic = 0;
+  bool seek_table = has_index && pread(fd, &magic, sizeof(magic), rest.offset) == sizeof(magic) &&
+                    magic == ZSTD_SEEKABLE_SKIPPABLE_MAGIC;
+  if (rest.offset < file_size && !seek_table) {
+    rest.size = file_size - rest.offset;
+    rest.max_mono_time = UINT64_MAX;
+    memset(rest.services, 0xff, sizeof(rest.services));
+    index.push_back(rest);
+  }
+
+  uint64_t max_mono_time = 0;
+  for (auto &b : index) {
+    max_mono_time = std::max(max_mono_time, b.max_mono_time);
+    prefix_max_mono_time.push_back(max_mono_time);
+  }
+  seek(0);
+  return true;
+}
+
+void SeekableLogReader::set_services(const std::vector<cereal::Event::Which> &which) {
+  memset(services, 0, sizeof(services));
+  for (auto w : which) {
+    int i = (int)w;
+    if (i < LOG_INDEX_MAX_SERVICES) {
+      services[i / 64] |= 1ULL << (i % 64);
+    }
+  }
+  all_services = which.empty();
+}
+
+void SeekableLogReader::seek(uint64_t mono_time) {
+  start_mono_time = mono_time;
+  // every block before this one only has earlier events
+  auto it = std::lower_bound(prefix_max_mono_time.begin(), prefix_max_mono_time.end(), mono_time);
+  next_block = it - prefix_max_mono_time.begin();
+  remaining = nullptr;
+  msg.reset();
+}
+
+bool SeekableLogReader::selected(int which) const {
+  return all_services || (which < LOG_INDEX_MAX_SERVICES && (services[which / 64] & (1ULL << (which % 64))) != 0);
+}
+
+bool SeekableLogReader::wanted(const LogIndexBlock &b) const {
+  if (b.max_mono_time < start_mono_time) return false;
+  if (all_services) return true;
+  for (int i = 0; i < LOG_INDEX_MAX_SERVICES / 64; i++) {
+    if (b.services[i] & services[i]) return true;
+  }
+  return false;
+}
+
+bool SeekableLogReader::load_block(size_t i) {
+  const LogIndexBlock &b = index[i];
+  compressed.resize(b.size);
+  if (pread(fd, compressed.data(), b.size, b.offset) != (ssize_t)b.size) {
+    LOGE("failed to read log block %zu", i);
+    return false;
+  }
+  raw.clear();
+  if (!log_decompress(compressed.data(), compressed.size(), raw)) {
+    LOGE("failed to decompress log block %zu", i);
+    return false;
+  }
+  blocks_decompressed++;
+
+  words = kj::heapArray<capnp::word>(raw.size() / sizeof(capnp::word));
+  memcpy(words.begin(), raw.data(), words.size() * sizeof(capnp::word));
+  remaining = words;
+  return true;
+}
+
+bool SeekableLogReader::next(cereal::Event::Reader &event) {
+  while (true) {
+    while (remaining.size() > 0) {
+      try {
+        msg.emplace(remaining, capnp::ReaderOptions{.traversalLimitInWords = kj::maxValue});
+        remaining = kj::arrayPtr(msg->getEnd(), remaining.end());
+        event = msg->getRoot<cereal::Event>();
+        if (event.getLogMonoTime() < start_mono_time) continue;
+        if (!selected((int)event.which())) continue;
+        return true;
+      } catch (const kj::Exception &e) {
+        LOGE("corrupt event in log block %zu", next_block - 1);
+        remaining = nullptr;
+      }
+    }
+
+    while (next_block < index.size() && !wanted(index[next_block])) {
+      next_block++;
+    }
+    if (next_block == index.size()) {
+      msg.reset();
+      return false;
+    }
+    if (!load_block(next_block++)) {
+      remaining = nullptr;
+    }
+  }
+}
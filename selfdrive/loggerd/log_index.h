@@ -0,0 +1,85 @@
+#pragma once
+
+#include <cstdint>
+#include <optional>
+#include <string>
+#include <vector>
+
+#include <capnp/serialize.h>
+
+#include "cereal/gen/cpp/log.capnp.h"
+
+// An index is written next to each log, at its path + ".idx". It is a LogIndexHeader
+// followed by one LogIndexBlock per compressed block. Entries are written a chunk at a
+// time and when the log is closed, so if loggerd dies the blocks after the last entry
+// are read as one unindexed block. Blocks only hold whole events, so each can be
+// decompressed and parsed on its own.
+#define LOG_INDEX_EXT ".idx"
+#define LOG_INDEX_MAGIC 0x58494c52  // "RLIX"
+#define LOG_INDEX_VERSION 1
+#define LOG_INDEX_MAX_SERVICES 128
+
+struct LogIndexHeader {
+  uint32_t magic;
+  uint16_t version;
+  uint8_t compression;  // LogCompression
+  uint8_t reserved;
+};
+static_assert(sizeof(LogIndexHeader) == 8, "LogIndexHeader is part of the index file format");
+
+struct LogIndexBlock {
+  uint64_t offset;         // of the compressed block in the log
+  uint64_t raw_offset;     // in the decompressed log
+  uint32_t size;
+  uint32_t raw_size;
+  uint64_t min_mono_time;
+  uint64_t max_mono_time;
+  uint32_t num_events;
+  uint32_t reserved;
+  uint64_t services[LOG_INDEX_MAX_SERVICES / 64];  // bit per cereal::Event::Which
+
+  // which is the cereal::Event::Which of the event, -1 if it is not known
+  void add_event(uint64_t mono_time, int which);
+  bool has_service(cereal::Event::Which which) const;
+};
+static_assert(sizeof(LogIndexBlock) == 64, "LogIndexBlock is part of the index file format");
+
+// Reads the events of a log written by loggerd, decompressing only the blocks that
+// can hold events at or after the seek time and of the selected services. Logs
+// without an index, or not compressed, are read from the start.
+class SeekableLogReader {
+ public:
+  SeekableLogReader() {}
+  ~SeekableLogReader();
+
+  bool load(const std::string &log_path);
+  // only events of these types are returned, all of them if empty
+  void set_services(const std::vector<cereal::Event::Which> &services);
+  // the next event is the first one with logMonoTime >= mono_time, in log order
+  void seek(uint64_t mono_time);
+  // the event is valid until the next call, returns false at the end of the log
+  bool next(cereal::Event::Reader &event);
+
+  const std::vector<LogIndexBlock> &blocks() const { return index; }
+  bool indexed() const { return has_index; }
+  size_t blocks_decompressed = 0;
+
+ private:
+  bool load_block(size_t i);
+  bool selected(int which) const;
+  bool wanted(const LogIndexBlock &b) const;
+
+  int fd = -1;
+  bool has_index = false;
+  std::vector<LogIndexBlock> index;
+  std::vector<uint64_t> prefix_max_mono_time;  // non decreasing, for binary search
+  uint64_t services[LOG_INDEX_MAX_SERVICES / 64] = {};
+  bool all_services = true;
+  uint64_t start_mono_time = 0;
+
+  size_t next_block = 0;
+  std::string compressed, raw;
+  kj::Array<capnp::word> words;
+  kj::ArrayPtr<const capnp::word> remaining;
+  std::optional<capnp::FlatArrayMessageReader> msg;
+};
@@ -0,0 +1,430 @@
+#include "selfdrive/loggerd/log_writer.h"
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cassert>
+#include <cerrno>
+#include <cstdlib>
+#include <cstring>
+
+#if defined(__linux__) && __has_include(<linux/io_uring.h>)
+#include <linux/io_uring.h>
+#define LOG_HAVE_IO_URING
+#endif
+
+#include "selfdrive/common/swaglog.h"
+#include "selfdrive/common/timing.h"
+#include "selfdrive/common/util.h"
+
+// bytes written or -errno, like io_uring
+static ssize_t pwrite_all(int fd, const char *data, size_t size, uint64_t offset) {
+  size_t written = 0;
+  while (written < size) {
+    ssize_t ret = pwrite(fd, data + written, size - written, offset + written);
+    if (ret < 0 && errno == EINTR) continue;
+    if (ret <= 0) return ret < 0 ? -errno : -EIO;
+    written += ret;
+  }
+  return written;
+}
+
+// ***** latency histogram *****
+
+void LogLatencyHistogram::add(uint64_t ns) {
+  const uint64_t us = ns / 1000;
+  const int bucket = us == 0 ? 0 : std::min(64 - __builtin_clzll(us), LOG_LATENCY_BUCKETS - 1);
+  std::unique_lock lk(lock);
+  buckets[bucket]++;
+  n++;
+  total_ns += ns;
+  max_ns = std::max(max_ns, ns);
+}
+
+void LogLatencyHistogram::reset() {
+  std::unique_lock lk(lock);
+  memset(buckets, 0, sizeof(buckets));
+  n = total_ns = max_ns = 0;
+}
+
+uint64_t LogLatencyHistogram::count() {
+  std::unique_lock lk(lock);
+  return n;
+}
+
+uint64_t LogLatencyHistogram::percentile_us(double p) {
+  std::unique_lock lk(lock);
+  uint64_t seen = 0;
+  for (int i = 0; i < LOG_LATENCY_BUCKETS - 1; i++) {
+    seen += buckets[i];
+    if (seen > 0 && seen >= p * n) {
+      return 1ULL << i;
+    }
+  }
+  return max_ns / 1000;
+}
+
+std::string LogLatencyHistogram::to_string() {
+  const uint64_t p50 = percentile_us(0.5), p99 = percentile_us(0.99);
+  std::unique_lock lk(lock);
+  return util::string_format("n=%lu mean=%luus p50<%luus p99<%luus max=%luus", n, n > 0 ? total_ns / n / 1000 : 0,
+                             p50, p99, max_ns / 1000);
+}
+
+// ***** io_uring *****
+
+#ifdef LOG_HAVE_IO_URING
+
+// Just the parts of liburing needed for writes, which isn't available on every device
+class IoUring {
+ public:
+  static std::unique_ptr<IoUring> create(unsigned entries) {
+    std::unique_ptr<IoUring> ring(new IoUring);
+    return ring->init(entries) ? std::move(ring) : nullptr;
+  }
+
+  ~IoUring() {
+    if (sqes != MAP_FAILED) munmap(sqes, sqes_size);
+    if (cq_ptr != MAP_FAILED) munmap(cq_ptr, cq_size);
+    if (sq_ptr != MAP_FAILED) munmap(sq_ptr, sq_size);
+    if (fd >= 0) close(fd);
+  }
+
+  bool write(int file_fd, LogChunk *c) {
+    const unsigned tail = *sq_tail;
+    const unsigned idx = tail & *sq_mask;
+    io_uring_sqe *sqe = &sqes[idx];
+    memset(sqe, 0, sizeof(*sqe));
+    sqe->opcode = IORING_OP_WRITEV;
+    sqe->fd = file_fd;
+    sqe->addr = (uint64_t)&c->iov;
+    sqe->len = 1;
+    sqe->off = c->offset;
+    sqe->user_data = (uint64_t)c;
+    sq_array[idx] = idx;
+    __atomic_store_n(sq_tail, tail + 1, __ATOMIC_RELEASE);
+
+    int ret;
+    do {
+      ret = syscall(__NR_io_uring_enter, fd, 1, 0, 0, nullptr, 0);
+    } while (ret < 0 && errno == EINTR);
+    if (ret != 1) {
+      // take it back and let the caller write it
+      __atomic_store_n(sq_tail, tail, __ATOMIC_RELEASE);
+      return false;
+    }
+    return true;
+  }
+
+  // the next completion, waiting for one if wait is set
+  bool pop(LogChunk **c, int *res, bool wait) {
+    unsigned head = *cq_head;
+    while (head == __atomic_load_n(cq_tail, __ATOMIC_ACQUIRE)) {
+      if (!wait) return false;
+      int ret = syscall(__NR_io_uring_enter, fd, 0, 1, IORING_ENTER_GETEVENTS, nullptr, 0);
+      if (ret < 0 && errno != EINTR) return false;
+    }
+    io_uring_cqe *cqe = &cqes[head & *cq_mask];
+    *c = (LogChunk *)cqe->user_data;
+    *res = cqe->res;
+    __atomic_store_n(cq_head, head + 1, __ATOMIC_RELEASE);
+    return true;
+  }
+
+ private:
+  IoUring() {}
+
+  bool init(unsigned entries) {
+    io_uring_params p = {};
+    fd = syscall(__NR_io_uring_setup, entries, &p);
+    if (fd < 0) return false;
+
+    sq_size = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    cq_size = p.cq_off.cqes + p.cq_entries * sizeof(io_uring_cqe);
+    sqes_size = p.sq_entries * sizeof(io_uring_sqe);
+    sq_ptr = mmap(nullptr, sq_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQ_RING);
+    cq_ptr = mmap(nullptr, cq_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_CQ_RING);
+    sqes = (io_uring_sqe *)mmap(nullptr, sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQES);
+    if (sq_ptr == MAP_FAILED || cq_ptr == MAP_FAILED || sqes == MAP_FAILED) return false;
+
+    sq_tail = (unsigned *)((char *)sq_ptr + p.sq_off.tail);
+    sq_mask = (unsigned *)((char *)sq_ptr + p.sq_off.ring_mask);
+    sq_array = (unsigned *)((char *)sq_ptr + p.sq_off.array);
+    cq_head = (unsigned *)((char *)cq_ptr + p.cq_off.head);
+    cq_tail = (unsigned *)((char *)cq_ptr + p.cq_off.tail);
+    cq_mask = (unsigned *)((char *)cq_ptr + p.cq_off.ring_mask);
+    cqes = (io_uring_cqe *)((char *)cq_ptr + p.cq_off.cqes);
+    return true;
+  }
+
+  int fd = -1;
+  void *sq_ptr = MAP_FAILED, *cq_ptr = MAP_FAILED;
+  io_uring_sqe *sqes = (io_uring_sqe *)MAP_FAILED;
+  size_t sq_size = 0, cq_size = 0, sqes_size = 0;
+  unsigned *sq_tail, *sq_mask, *sq_array;
+  unsigned *cq_head, *cq_tail, *cq_mask;
+  io_uring_cqe *cqes;
+};
+
+#else
+
+class IoUring {
+ public:
+  static std::unique_ptr<IoUring> create(unsigned entries) { return nullptr; }
+  bool write(int file_fd, LogChunk *c) { return false; }
+  bool pop(LogChunk **c, int *res, bool wait) { return false; }
+};
+
+#endif
+
+// ***** I/O thread *****
+
+AsyncLogWriter::AsyncLogWriter(bool use_io_uring) {
+  if (use_io_uring) {
+    uring = IoUring::create(LOG_IO_QUEUE_DEPTH);
+  }
+  LOG("log writer using %s", uring ? "io_uring" : "pwrite");
+  io_thread = std::thread(&AsyncLogWriter::thread, this);
+}
+
+AsyncLogWriter::~AsyncLogWriter() {
+  {
+    std::unique_lock lk(lock);
+    exit = true;
+  }
+  cv.notify_one();
+  io_thread.join();
+}
+
+std::future<void> AsyncLogWriter::run(std::function<void()> fn) {
+  auto task = std::make_shared<std::packaged_task<void()>>(std::move(fn));
+  std::future<void> done = task->get_future();
+  push({.chunk = nullptr, .fn = [task]() { (*task)(); }});
+  return done;
+}
+
+void AsyncLogWriter::push(Op op) {
+  {
+    std::unique_lock lk(lock);
+    queue.push_back(std::move(op));
+  }
+  cv.notify_one();
+}
+
+void AsyncLogWriter::thread() {
+  set_thread_name("log_io");
+
+  while (true) {
+    Op op = {};
+    bool have_op = false;
+    {
+      std::unique_lock lk(lock);
+      if (in_flight == 0) {
+        cv.wait(lk, [&] { return exit || !queue.empty(); });
+      }
+      if (!queue.empty()) {
+        op = std::move(queue.front());
+        queue.pop_front();
+        have_op = true;
+      } else if (in_flight == 0) {
+        break;
+      }
+    }
+
+    if (!have_op) {
+      reap(1);
+    } else if (op.chunk != nullptr) {
+      write(op.chunk);
+    } else {
+      // everything else waits for the writes before it, closing a file included
+      reap(in_flight);
+      op.fn();
+    }
+  }
+}
+
+void AsyncLogWriter::write(LogChunk *c) {
+  LogFile *f = c->file;
+  f->preallocate(c->offset + c->write_size);
+  if (uring && f->fd >= 0) {
+    if (in_flight == LOG_IO_QUEUE_DEPTH) {
+      reap(1);
+    }
+    if (uring->write(f->fd, c)) {
+      in_flight++;
+      return;
+    }
+  }
+  f->write_chunk(c);
+}
+
+void AsyncLogWriter::reap(unsigned min_complete) {
+  LogChunk *c;
+  int res;
+  unsigned n = 0;
+  while (in_flight > 0 && uring->pop(&c, &res, n < min_complete)) {
+    n++;
+    in_flight--;
+    if (res >= 0 && (size_t)res < c->write_size) {
+      // short write, finish it here. The rest is rewritten from the last LOG_WRITE_ALIGN
+      // boundary so buffer, offset and size stay aligned for O_DIRECT.
+      size_t done = (size_t)res / LOG_WRITE_ALIGN * LOG_WRITE_ALIGN;
+      ssize_t rest = pwrite_all(c->file->fd, c->data + done, c->write_size - done, c->offset + done);
+      res = rest < 0 ? rest : c->write_size;
+    }
+    c->file->completed(c, res);
+  }
+}
+
+// ***** files *****
+
+LogFile::LogFile(AsyncLogWriter *io, const std::string &path, bool direct, LogLatencyHistogram *latency,
+                 size_t chunk_size)
+  : io(io), path(path), direct(direct), chunk_size(chunk_size), latency(latency) {
+  assert(chunk_size % LOG_WRITE_ALIGN == 0);
+  if (io != nullptr) {
+    io->push({.chunk = nullptr, .fn = [this]() { open_file(); }});
+  } else {
+    open_file();
+  }
+}
+
+LogFile::~LogFile() {
+  submit();
+  if (io != nullptr) {
+    io->run([this]() { close_file(); }).wait();
+  } else {
+    close_file();
+  }
+  for (int i = 0; i < num_chunks; i++) {
+    free(chunks[i].data);
+  }
+}
+
+void LogFile::write(const void *data, size_t size) {
+  const char *p = (const char *)data;
+  while (size > 0) {
+    if (cur == nullptr) {
+      cur = get_chunk();
+      cur->offset = offset;
+      cur->size = 0;
+    }
+    size_t n = std::min(size, chunk_size - cur->size);
+    memcpy(cur->data + cur->size, p, n);
+    cur->size += n;
+    p += n;
+    size -= n;
+    if (cur->size == chunk_size) {
+      submit();
+    }
+  }
+}
+
+void LogFile::flush() {
+  assert(!direct);
+  submit();
+}
+
+void LogFile::submit() {
+  if (cur == nullptr || cur->size == 0) return;
+
+  LogChunk *c = cur;
+  cur = nullptr;
+  offset += c->size;
+  c->write_size = c->size;
+  if (direct && c->size % LOG_WRITE_ALIGN != 0) {
+    // only the last chunk, the padding is truncated on close
+    c->write_size = (c->size / LOG_WRITE_ALIGN + 1) * LOG_WRITE_ALIGN;
+    memset(c->data + c->size, 0, c->write_size - c->size);
+  }
+  c->iov = {c->data, c->write_size};
+  c->submit_ns = nanos_since_boot();
+
+  if (io != nullptr) {
+    io->push({.chunk = c, .fn = nullptr});
+  } else {
+    preallocate(c->offset + c->write_size);
+    write_chunk(c);
+  }
+}
+
+LogChunk *LogFile::get_chunk() {
+  std::unique_lock lk(lock);
+  if (free_chunks.empty() && num_chunks < LOG_WRITE_CHUNKS) {
+    LogChunk *c = &chunks[num_chunks++];
+    c->file = this;
+    int err = posix_memalign((void **)&c->data, LOG_WRITE_ALIGN, chunk_size);
+    assert(err == 0);
+    return c;
+  }
+  if (free_chunks.empty()) {
+    LOGW_100("log writes falling behind for %s", path.c_str());
+    cv.wait(lk, [&] { return !free_chunks.empty(); });
+  }
+  LogChunk *c = free_chunks.back();
+  free_chunks.pop_back();
+  return c;
+}
+
+void LogFile::open_file() {
+  int flags = O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC;
+#ifdef O_DIRECT
+  if (direct) {
+    fd = open(path.c_str(), flags | O_DIRECT, 0666);
+    // not every filesystem has it, tmpfs doesn't
+    if (fd >= 0 || errno != EINVAL) {
+      if (fd < 0) LOGE("failed to open %s: %s", path.c_str(), strerror(errno));
+      return;
+    }
+  }
+#endif
+  fd = open(path.c_str(), flags, 0666);
+  if (fd < 0) {
+    LOGE("failed to open %s: %s", path.c_str(), strerror(errno));
+  }
+}
+
+// keeps the file in contiguous extents and block allocation out of the writes
+void LogFile::preallocate(uint64_t end) {
+#ifdef __linux__
+  while (fd >= 0 && end > allocated) {
+    if (fallocate(fd, FALLOC_FL_KEEP_SIZE, allocated, LOG_PREALLOC_SIZE) != 0) {
+      allocated = UINT64_MAX;
+      break;
+    }
+    allocated += LOG_PREALLOC_SIZE;
+  }
+#endif
+}
+
+void LogFile::write_chunk(LogChunk *c) {
+  completed(c, fd >= 0 ? pwrite_all(fd, c->data, c->write_size, c->offset) : -EBADF);
+}
+
+void LogFile::completed(LogChunk *c, ssize_t written) {
+  if (written != (ssize_t)c->write_size && !error_logged) {
+    LOGE("log write error for %s: %s", path.c_str(), strerror(written < 0 ? -written : EIO));
+    error_logged = true;
+  }
+  if (latency != nullptr) {
+    latency->add(nanos_since_boot() - c->submit_ns);
+  }
+  {
+    std::unique_lock lk(lock);
+    free_chunks.push_back(c);
+  }
+  cv.notify_one();
+}
+
+void LogFile::close_file() {
+  if (fd < 0) return;
+  // drops the padding of the last chunk and what's left of the preallocation
+  if (ftruncate(fd, offset) != 0) {
+    LOGE("failed to truncate %s: %s", path.c_str(), strerror(errno));
+  }
+  close(fd);
+  fd = -1;
+}
@@ -0,0 +1,134 @@
+#pragma once
+
+#include <sys/uio.h>
+
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <functional>
+#include <future>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+// Log files are written from one I/O thread, so slow storage and segment rotation don't
+// stall the threads draining messages. Files are written in large chunks at aligned
+// offsets, with O_DIRECT where the filesystem allows it, into space preallocated ahead
+// of the writes. With io_uring a few chunks are in flight at once, without it they
+// are written one at a time.
+#define LOG_WRITE_ALIGN 4096
+#define LOG_WRITE_CHUNK_SIZE (1024 * 1024)
+#define LOG_WRITE_CHUNKS 4          // per file, writers wait when all are in flight
+#define LOG_PREALLOC_SIZE (16 * 1024 * 1024)
+#define LOG_IO_QUEUE_DEPTH 8
+#define LOG_LATENCY_BUCKETS 24      // log2 of microseconds, the last one is >= 8 s
+
+// Time from a chunk being handed to the I/O thread until it is written
+class LogLatencyHistogram {
+ public:
+  void add(uint64_t ns);
+  void reset();
+  uint64_t count();
+  // upper bound of the bucket the p-th percentile falls in
+  uint64_t percentile_us(double p);
+  // "n=120 mean=850us p50<1024us p99<8192us max=9870us"
+  std::string to_string();
+
+ private:
+  std::mutex lock;
+  uint32_t buckets[LOG_LATENCY_BUCKETS] = {};
+  uint64_t n = 0, total_ns = 0, max_ns = 0;
+};
+
+class LogFile;
+struct LogChunk;
+class IoUring;
+
+class AsyncLogWriter {
+ public:
+  explicit AsyncLogWriter(bool use_io_uring = true);
+  // Finishes everything queued
+  ~AsyncLogWriter();
+
+  // Runs fn on the I/O thread once everything queued before it is done
+  std::future<void> run(std::function<void()> fn);
+  bool has_io_uring() const { return uring != nullptr; }
+
+ private:
+  friend class LogFile;
+  struct Op {
+    LogChunk *chunk;  // a write, or
+    std::function<void()> fn;
+  };
+
+  void push(Op op);
+  void thread();
+  void write(LogChunk *c);
+  void reap(unsigned min_complete);
+
+  std::unique_ptr<IoUring> uring;
+  unsigned in_flight = 0;
+
+  std::mutex lock;
+  std::condition_variable cv;
+  std::deque<Op> queue;
+  bool exit = false;
+  std::thread io_thread;
+};
+
+struct LogChunk {
+  LogFile *file;
+  char *data;  // LOG_WRITE_ALIGN aligned
+  size_t size, write_size;
+  uint64_t offset, submit_ns;
+  struct iovec iov;
+};
+
+// An append only file. Without an AsyncLogWriter everything is done on the caller's thread.
+class LogFile {
+ public:
+  // Direct files are opened with O_DIRECT when possible and can only be flushed when closed
+  LogFile(AsyncLogWriter *io, const std::string &path, bool direct, LogLatencyHistogram *latency = nullptr,
+          size_t chunk_size = LOG_WRITE_CHUNK_SIZE);
+  // Writes what is buffered, truncates the file to its size and waits for it to be closed
+  ~LogFile();
+
+  void write(const void *data, size_t size);
+  // Hands what is buffered to the I/O thread
+  void flush();
+
+ private:
+  friend class AsyncLogWriter;
+
+  void submit();
+  LogChunk *get_chunk();
+  // on the I/O thread
+  void open_file();
+  void preallocate(uint64_t end);
+  void write_chunk(LogChunk *c);
+  void completed(LogChunk *c, ssize_t written);
+  void close_file();
+
+  AsyncLogWriter *io;
+  const std::string path;
+  const bool direct;
+  const size_t chunk_size;
+  LogLatencyHistogram *latency;
+
+  // I/O thread
+  int fd = -1;
+  uint64_t allocated = 0;
+  bool error_logged = false;
+
+  // writer
+  LogChunk *cur = nullptr;
+  uint64_t offset = 0;
+
+  std::mutex lock;
+  std::condition_variable cv;
+  LogChunk chunks[LOG_WRITE_CHUNKS] = {};  // buffers allocated as needed
+  std::vector<LogChunk *> free_chunks;
+  int num_chunks = 0;
+};
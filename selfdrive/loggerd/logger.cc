@@ -1,5 +1,6 @@
 #include "selfdrive/loggerd/logger.h"
 
+#include <fcntl.h>
 #include <sys/stat.h>
 #include <unistd.h>
 
@@ -125,19 +126,22 @@ std::string logger_get_route_name() {
 }
 
 void log_init_data(LoggerState *s) {
+  capnp::FlatArrayMessageReader cmsg(s->init_data);
+  auto event = cmsg.getRoot<cereal::Event>();
   auto bytes = s->init_data.asBytes();
-  logger_log(s, bytes.begin(), bytes.size(), s->has_qlog);
+  logger_log(s, bytes.begin(), bytes.size(), s->has_qlog, event.getLogMonoTime(), event.which());
 }
 
 
 static void log_sentinel(LoggerState *s, cereal::Sentinel::SentinelType type, int signal=0) {
   MessageBuilder msg;
-  auto sen = msg.initEvent().initSentinel();
+  auto event = msg.initEvent();
+  auto sen = event.initSentinel();
   sen.setType(type);
   sen.setSignal(signal);
   auto bytes = msg.toBytes();
 
-  logger_log(s, bytes.begin(), bytes.size(), true);
+  logger_log(s, bytes.begin(), bytes.size(), true, event.getLogMonoTime(), event.which());
 }
 
 // ***** logging functions *****
@@ -152,11 +156,12 @@ void logger_init(LoggerState *s, const char* log_name, bool has_qlog) {
   s->route_name = logger_get_route_name();
   snprintf(s->log_name, sizeof(s->log_name), "%s", log_name);
   s->init_data = logger_build_init_data();
+  s->compression = log_compression_from_env();
+  s->compressor_pool = LogCompressorPool::create_from_env();
+  s->io = std::make_unique<AsyncLogWriter>();
 }
 
 static LoggerHandle* logger_open(LoggerState *s, const char* root_path) {
-  int err;
-
   LoggerHandle *h = NULL;
   for (int i=0; i<LOGGER_MAX_HANDLES; i++) {
     if (s->handles[i].refcnt == 0) {
@@ -169,20 +174,33 @@ static LoggerHandle* logger_open(LoggerState *s, const char* root_path) {
   snprintf(h->segment_path, sizeof(h->segment_path),
           "%s/%s--%d", root_path, s->route_name.c_str(), s->part);
 
-  snprintf(h->log_path, sizeof(h->log_path), "%s/%s.bz2", h->segment_path, s->log_name);
-  snprintf(h->qlog_path, sizeof(h->qlog_path), "%s/qlog.bz2", h->segment_path);
+  const char *ext = log_compression_ext(s->compression);
+  snprintf(h->log_path, sizeof(h->log_path), "%s/%s.%s", h->segment_path, s->log_name, ext);
+  snprintf(h->qlog_path, sizeof(h->qlog_path), "%s/qlog.%s", h->segment_path, ext);
   snprintf(h->lock_path, sizeof(h->lock_path), "%s.lock", h->log_path);
 
-  err = logger_mkpath(h->log_path);
-  if (err) return NULL;
-
-  FILE* lock_file = fopen(h->lock_path, "wb");
-  if (lock_file == NULL) return NULL;
-  fclose(lock_file);
+  // on the I/O thread, ahead of creating the files
+  h->ready = s->io->run([log_path = std::string(h->log_path), lock_path = std::string(h->lock_path)]() mutable {
+    if (logger_mkpath(log_path.data()) != 0) {
+      LOGE("failed to create %s: %s", log_path.c_str(), strerror(errno));
+      return;
+    }
+    int lock_fd = open(lock_path.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0666);
+    if (lock_fd < 0) {
+      LOGE("failed to create %s: %s", lock_path.c_str(), strerror(errno));
+      return;
+    }
+    close(lock_fd);
+  }).share();
 
-  h->log = std::make_unique<BZFile>(h->log_path);
+  h->write_latency.reset();
+  const std::string log_index_path = std::string(h->log_path) + LOG_INDEX_EXT;
+  h->log = std::make_unique<CompressedLogFile>(h->log_path, s->compression, s->compressor_pool.get(),
+                                               log_index_path.c_str(), s->io.get(), &h->write_latency);
   if (s->has_qlog) {
-    h->q_log = std::make_unique<BZFile>(h->qlog_path);
+    const std::string qlog_index_path = std::string(h->qlog_path) + LOG_INDEX_EXT;
+    h->q_log = std::make_unique<CompressedLogFile>(h->qlog_path, s->compression, s->compressor_pool.get(),
+                                                   qlog_index_path.c_str(), s->io.get(), &h->write_latency);
   }
 
   pthread_mutex_init(&h->lock, NULL);
@@ -199,6 +217,11 @@ int logger_next(LoggerState *s, const char* root_path,
   pthread_mutex_lock(&s->lock);
   s->part++;
 
+  // the previous segment's handle may not be reused before it is closed
+  if (s->close_thread.joinable()) {
+    s->close_thread.join();
+  }
+
   LoggerHandle* next_h = logger_open(s, root_path);
   if (!next_h) {
     pthread_mutex_unlock(&s->lock);
@@ -206,7 +229,9 @@ int logger_next(LoggerState *s, const char* root_path,
   }
 
   if (s->cur_handle) {
-    lh_close(s->cur_handle);
+    // closing waits for the last blocks to be compressed and written, logging to the
+    // new segment doesn't have to
+    s->close_thread = std::thread(lh_close, s->cur_handle);
   }
   s->cur_handle = next_h;
 
@@ -237,10 +262,10 @@ LoggerHandle* logger_get_handle(LoggerState *s) {
   return h;
 }
 
-void logger_log(LoggerState *s, uint8_t* data, size_t data_size, bool in_qlog) {
+void logger_log(LoggerState *s, uint8_t* data, size_t data_size, bool in_qlog, uint64_t mono_time, int which) {
   pthread_mutex_lock(&s->lock);
   if (s->cur_handle) {
-    lh_log(s->cur_handle, data, data_size, in_qlog);
+    lh_log(s->cur_handle, data, data_size, in_qlog, mono_time, which);
   }
   pthread_mutex_unlock(&s->lock);
 }
@@ -250,22 +275,29 @@ void logger_close(LoggerState *s, ExitHandler *exit_handler) {
   log_sentinel(s, cereal::Sentinel::SentinelType::END_OF_ROUTE, signal);
 
   pthread_mutex_lock(&s->lock);
+  if (s->close_thread.joinable()) {
+    s->close_thread.join();
+  }
   if (s->cur_handle) {
     lh_close(s->cur_handle);
   }
   pthread_mutex_unlock(&s->lock);
 }
 
-void lh_log(LoggerHandle* h, uint8_t* data, size_t data_size, bool in_qlog) {
+void lh_log(LoggerHandle* h, uint8_t* data, size_t data_size, bool in_qlog, uint64_t mono_time, int which) {
   pthread_mutex_lock(&h->lock);
   assert(h->refcnt > 0);
-  h->log->write(data, data_size);
+  h->log->write_event(data, data_size, mono_time, which);
   if (in_qlog && h->q_log) {
-    h->q_log->write(data, data_size);
+    h->q_log->write_event(data, data_size, mono_time, which);
   }
   pthread_mutex_unlock(&h->lock);
 }
 
+void lh_wait_ready(LoggerHandle* h) {
+  h->ready.wait();
+}
+
 void lh_close(LoggerHandle* h) {
   pthread_mutex_lock(&h->lock);
   assert(h->refcnt > 0);
@@ -274,6 +306,7 @@ void lh_close(LoggerHandle* h) {
     h->log.reset(nullptr);
     h->q_log.reset(nullptr);
     unlink(h->lock_path);
+    LOGW("%s write latency %s", h->segment_path, h->write_latency.to_string().c_str());
     pthread_mutex_unlock(&h->lock);
     pthread_mutex_destroy(&h->lock);
     return;
@@ -5,7 +5,9 @@
 
 #include <cstdint>
 #include <cstdio>
+#include <future>
 #include <memory>
+#include <thread>
 
 #include <bzlib.h>
 #include <capnp/serialize.h>
@@ -14,6 +16,8 @@
 #include "selfdrive/common/util.h"
 #include "selfdrive/common/swaglog.h"
 #include "selfdrive/hardware/hw.h"
+#include "selfdrive/loggerd/compressor.h"
+#include "selfdrive/loggerd/log_writer.h"
 
 const std::string DEFAULT_LOG_ROOT =
     Hardware::PC() ? util::getenv_default("HOME", "/.comma/media/0/realdata", "/data/media/0/realdata")
@@ -64,7 +68,9 @@ typedef struct LoggerHandle {
   char log_path[4096];
   char qlog_path[4096];
   char lock_path[4096];
-  std::unique_ptr<BZFile> log, q_log;
+  std::unique_ptr<CompressedLogFile> log, q_log;
+  std::shared_future<void> ready;  // the segment directory and lock file exist
+  LogLatencyHistogram write_latency;
 } LoggerHandle;
 
 typedef struct LoggerState {
@@ -75,6 +81,11 @@ typedef struct LoggerState {
   char log_name[64];
   bool has_qlog;
 
+  LogCompression compression;
+  std::unique_ptr<LogCompressorPool> compressor_pool;  // null to compress on the caller's thread
+  std::unique_ptr<AsyncLogWriter> io;
+  std::thread close_thread;  // closes the previous segment
+
   LoggerHandle handles[LOGGER_MAX_HANDLES];
   LoggerHandle* cur_handle;
 } LoggerState;
@@ -88,7 +99,9 @@ int logger_next(LoggerState *s, const char* root_path,
                             int* out_part);
 LoggerHandle* logger_get_handle(LoggerState *s);
 void logger_close(LoggerState *s, ExitHandler *exit_handler=nullptr);
-void logger_log(LoggerState *s, uint8_t* data, size_t data_size, bool in_qlog);
+// mono_time and which are the event's logMonoTime and cereal::Event::Which, for the log index
+void logger_log(LoggerState *s, uint8_t* data, size_t data_size, bool in_qlog, uint64_t mono_time, int which);
 
-void lh_log(LoggerHandle* h, uint8_t* data, size_t data_size, bool in_qlog);
+void lh_log(LoggerHandle* h, uint8_t* data, size_t data_size, bool in_qlog, uint64_t mono_time, int which);
+void lh_wait_ready(LoggerHandle* h);
 void lh_close(LoggerHandle* h);
@@ -1,17 +1,16 @@
 #include <ftw.h>
-#include <pthread.h>
 #include <sys/resource.h>
 #include <unistd.h>
 
+#include <algorithm>
 #include <atomic>
 #include <cassert>
 #include <cerrno>
-#include <condition_variable>
 #include <cstdint>
 #include <cstdio>
 #include <cstdlib>
 #include <cstring>
-#include <mutex>
+#include <memory>
 #include <random>
 #include <string>
 #include <thread>
@@ -28,13 +27,15 @@
 #include "selfdrive/hardware/hw.h"
 
 #include "selfdrive/loggerd/encoder.h"
+#include "selfdrive/loggerd/encoder_pipeline.h"
 #include "selfdrive/loggerd/logger.h"
 #if defined(QCOM) || defined(QCOM2)
 #include "selfdrive/loggerd/omx_encoder.h"
-#define Encoder OmxEncoder
 #else
 #include "selfdrive/loggerd/raw_logger.h"
-#define Encoder RawLogger
+#ifdef AV_ENCODER
+#include "selfdrive/loggerd/av_encoder.h"
+#endif
 #endif
 
 namespace {
@@ -46,6 +47,10 @@ const int DCAM_BITRATE = Hardware::TICI() ? MAIN_BITRATE : 2500000;
 
 #define NO_CAMERA_PATIENCE 500 // fall back to time-based rotation if all cameras are dead
 
+// sockets are drained in batches of up to this many messages/bytes
+#define DRAIN_BATCH_MSGS 256
+#define DRAIN_BATCH_BYTES (1024 * 1024)
+
 const int SEGMENT_LENGTH = getenv("LOGGERD_TEST") ? atoi(getenv("LOGGERD_SEGMENT_LENGTH")) : 60;
 
 ExitHandler do_exit;
@@ -92,72 +97,82 @@ LogCameraInfo cameras_logged[LOG_CAMERA_ID_MAX] = {
   },
 };
 
-class RotateState {
-public:
-  SubSocket* fpkt_sock;
-  uint32_t stream_frame_id, log_frame_id, last_rotate_frame_id;
-  bool enabled, should_rotate, initialized;
-  std::atomic<bool> rotating;
-  std::atomic<int> cur_seg;
-
-  RotateState() : fpkt_sock(nullptr), stream_frame_id(0), log_frame_id(0),
-                  last_rotate_frame_id(UINT32_MAX), enabled(false), should_rotate(false), initialized(false), rotating(false), cur_seg(-1) {};
-
-  void waitLogThread() {
-    std::unique_lock<std::mutex> lk(fid_lock);
-    while (stream_frame_id > log_frame_id           // if the log camera is older, wait for it to catch up.
-           && (stream_frame_id - log_frame_id) < 8  // but if its too old then there probably was a discontinuity (visiond restarted)
-           && !do_exit) {
-      cv.wait(lk);
-    }
-  }
-
-  void cancelWait() {
-    cv.notify_one();
-  }
-
-  void setStreamFrameId(uint32_t frame_id) {
-    fid_lock.lock();
-    stream_frame_id = frame_id;
-    fid_lock.unlock();
-    cv.notify_one();
-  }
-
-  void setLogFrameId(uint32_t frame_id) {
-    fid_lock.lock();
-    log_frame_id = frame_id;
-    fid_lock.unlock();
-    cv.notify_one();
-  }
-
-  void rotate() {
-    if (enabled) {
-      std::unique_lock<std::mutex> lk(fid_lock);
-      should_rotate = true;
-      last_rotate_frame_id = stream_frame_id;
-    }
-  }
+// Segments are published to the encoder threads without locks. The main thread fills
+// rotations[epoch % ROTATION_SLOTS] and then bumps epoch, encoder threads only read the
+// latest slot, which isn't written again for another ROTATION_SLOTS segments.
+#define ROTATION_SLOTS 8
+// Encoders switch segments this many frames after the newest one a camera is at,
+// so they all see the rotation before they get to that frame
+#define ROTATE_FRAME_LOOKAHEAD 2
+// A camera that is further behind the start of the segment restarted
+#define ROTATE_MAX_FRAMES_BEHIND 8
+
+struct SegmentRotation {
+  int segment;
+  char path[4096];
+  uint32_t start_frame_id[LOG_CAMERA_ID_MAX-1];  // the first frame each camera encodes into it
+};
 
-  void finish_rotate() {
-    std::unique_lock<std::mutex> lk(fid_lock);
-    should_rotate = false;
-  }
+struct RotateState {
+  SubSocket *fpkt_sock = nullptr;
+  bool enabled = false;
+  uint32_t log_frame_id = 0;  // main thread
 
-private:
-  std::mutex fid_lock;
-  std::condition_variable cv;
+  // written by the encoder thread
+  std::atomic<uint32_t> stream_frame_id = 0;
+  std::atomic<uint64_t> epoch = 0;  // of the segment it encodes into
+  std::atomic<uint32_t> segment_start_frame_id = 0;
 };
 
 struct LoggerdState {
   Context *ctx;
   LoggerState logger = {};
-  char segment_path[4096];
-  int rotate_segment;
-  pthread_mutex_t rotate_lock;
+  std::atomic<uint64_t> epoch = 0;
+  SegmentRotation rotations[ROTATION_SLOTS];
   RotateState rotate_state[LOG_CAMERA_ID_MAX-1];
 };
 LoggerdState s;
 
+VideoEncoder *create_encoder(const LogCameraInfo &info, int width, int height) {
+#if defined(QCOM) || defined(QCOM2)
+  return new OmxEncoder(info.filename, width, height, info.fps, info.bitrate, info.is_h265, info.downscale);
+#else
+#ifdef AV_ENCODER
+  // lossless unless LOGGERD_AVENCODER is set and libavcodec was built with the codec
+  if (getenv("LOGGERD_AVENCODER") && AvEncoder::available(info.is_h265)) {
+    return new AvEncoder(info.filename, width, height, info.fps, info.bitrate, info.is_h265, info.downscale);
+  }
+#endif
+  return new RawLogger(info.filename, width, height, info.fps, info.bitrate, info.is_h265, info.downscale);
+#endif
+}
+
+// publishes the encode index of frames the main encoder encoded
+void encoded_frame(int cam_idx, const EncoderFrame &frame, int out_id) {
+  if (out_id == -1 || frame.segment->lh == nullptr) return;
+
+  MessageBuilder msg;
+  // this is really ugly
+  auto eidx = cam_idx == LOG_CAMERA_ID_DCAMERA ? msg.initEvent().initDriverEncodeIdx() :
+             (cam_idx == LOG_CAMERA_ID_ECAMERA ? msg.initEvent().initWideRoadEncodeIdx() : msg.initEvent().initRoadEncodeIdx());
+  eidx.setFrameId(frame.extra.frame_id);
+  eidx.setTimestampSof(frame.extra.timestamp_sof);
+  eidx.setTimestampEof(frame.extra.timestamp_eof);
+  if (Hardware::TICI()) {
+    eidx.setType(cereal::EncodeIndex::Type::FULL_H_E_V_C);
+  } else {
+    eidx.setType(cam_idx == LOG_CAMERA_ID_DCAMERA ? cereal::EncodeIndex::Type::FRONT : cereal::EncodeIndex::Type::FULL_H_E_V_C);
+  }
+  eidx.setEncodeId(frame.encode_id);
+  eidx.setSegmentNum(frame.segment->num);
+  eidx.setSegmentId(out_id);
+  // TODO: this should read cereal/services.h for qlog decimation
+  auto event = msg.getRoot<cereal::Event>();
+  auto bytes = msg.toBytes();
+  lh_log(frame.segment->lh, bytes.begin(), bytes.size(), true, event.getLogMonoTime(), event.which());
+}
+
+// Receives the camera's frames and hands them to the encoders' threads
 void encoder_thread(int cam_idx) {
   assert(cam_idx < LOG_CAMERA_ID_MAX-1);
 
@@ -166,9 +181,10 @@ void encoder_thread(int cam_idx) {
 
   set_thread_name(cam_info.filename);
 
-  int cnt = 0;
-  LoggerHandle *lh = NULL;
-  std::vector<Encoder *> encoders;
+  uint32_t cnt = 0;
+  std::shared_ptr<EncoderSegment> segment;
+  std::vector<VideoEncoder *> encoders;
+  std::unique_ptr<EncoderPipeline> pipeline;
   VisionIpcClient vipc_client = VisionIpcClient("camerad", cam_info.stream_type, false);
 
   while (!do_exit) {
@@ -183,16 +199,18 @@ void encoder_thread(int cam_idx) {
       LOGD("encoder init %dx%d", buf_info.width, buf_info.height);
 
       // main encoder
-      encoders.push_back(new Encoder(cam_info.filename, buf_info.width, buf_info.height,
-                                     cam_info.fps, cam_info.bitrate, cam_info.is_h265, cam_info.downscale));
+      encoders.push_back(create_encoder(cam_info, buf_info.width, buf_info.height));
 
       // qcamera encoder
       if (cam_info.has_qcamera) {
         LogCameraInfo &qcam_info = cameras_logged[LOG_CAMERA_ID_QCAMERA];
-        encoders.push_back(new Encoder(qcam_info.filename,
-                                       qcam_info.frame_width, qcam_info.frame_height,
-                                       qcam_info.fps, qcam_info.bitrate, qcam_info.is_h265, qcam_info.downscale));
+        encoders.push_back(create_encoder(qcam_info, qcam_info.frame_width, qcam_info.frame_height));
       }
+
+      pipeline = std::make_unique<EncoderPipeline>(cam_info.filename, encoders, buf_info.width, buf_info.height,
+                                                   [cam_idx](int encoder_idx, const EncoderFrame &frame, int out_id) {
+        if (encoder_idx == 0) encoded_frame(cam_idx, frame, out_id);
+      });
     }
 
     while (!do_exit) {
@@ -204,101 +222,68 @@ void encoder_thread(int cam_idx) {
 
       //printf("logger latency to tsEof: %f\n", (double)(nanos_since_boot() - extra.timestamp_eof) / 1000000.0);
 
-      // all the rotation stuff
-      {
-        pthread_mutex_lock(&s.rotate_lock);
-        pthread_mutex_unlock(&s.rotate_lock);
-
-        // wait if camera pkt id is older than stream
-        rotate_state.waitLogThread();
-
-        if (do_exit) break;
-
-        // rotate the encoder if the logger is on a newer segment
-        if (rotate_state.should_rotate) {
-          LOGW("camera %d rotate encoder to %s", cam_idx, s.segment_path);
-
-          if (!rotate_state.initialized) {
-            rotate_state.last_rotate_frame_id = extra.frame_id - 1;
-            rotate_state.initialized = true;
+      const uint32_t prev_frame_id = rotate_state.stream_frame_id.exchange(extra.frame_id);
+
+      // switch to a newer segment once at its first frame,
+      // the encoders reopen their files when they get to this frame
+      const uint64_t epoch = s.epoch.load(std::memory_order_acquire);
+      if (epoch != rotate_state.epoch) {
+        const SegmentRotation &rot = s.rotations[epoch % ROTATION_SLOTS];
+        const uint32_t start_frame_id = rot.start_frame_id[cam_idx];
+        const bool restarted = start_frame_id > extra.frame_id + ROTATE_MAX_FRAMES_BEHIND;
+        if (!segment || extra.frame_id >= start_frame_id || restarted) {
+          if (segment) {
+            LOGW("%s", pipeline->stats().c_str());
+            if (prev_frame_id >= start_frame_id && !restarted) {
+              LOGE("camera %d rotated late, at frame %d instead of %d", cam_idx, extra.frame_id, start_frame_id);
+            }
           }
+          LOGW("camera %d rotate encoder to %s at frame %d", cam_idx, rot.path, extra.frame_id);
 
-          // get new logger handle for new segment
-          if (lh) {
+          LoggerHandle *lh = logger_get_handle(&s.logger);
+          if (lh && strcmp(lh->segment_path, rot.path) != 0) {
+            // the logger already moved on to another segment
             lh_close(lh);
+            lh = nullptr;
           }
-          lh = logger_get_handle(&s.logger);
-
-          // wait for all to start rotating
-          rotate_state.rotating = true;
-          for(auto &r : s.rotate_state) {
-             while(r.enabled && !r.rotating && !do_exit) util::sleep_for(5);
-          }
-
-          pthread_mutex_lock(&s.rotate_lock);
-          for (auto &e : encoders) {
-            e->encoder_close();
-            e->encoder_open(s.segment_path);
-          }
-          rotate_state.cur_seg = s.rotate_segment;
-          pthread_mutex_unlock(&s.rotate_lock);
-
-          // wait for all to finish rotating
-          for(auto &r : s.rotate_state) {
-             while(r.enabled && r.cur_seg != s.rotate_segment && !do_exit) util::sleep_for(5);
-          }
-          rotate_state.rotating = false;
-          rotate_state.finish_rotate();
+          segment = std::make_shared<EncoderSegment>(rot.segment, rot.path, lh);
+          rotate_state.segment_start_frame_id = extra.frame_id;
+          rotate_state.epoch = epoch;
         }
       }
 
-      rotate_state.setStreamFrameId(extra.frame_id);
-
       // encode a frame
-      for (int i = 0; i < encoders.size(); ++i) {
-        int out_id = encoders[i]->encode_frame(buf->y, buf->u, buf->v,
-                                               buf->width, buf->height, extra.timestamp_eof);
-        if (i == 0 && out_id != -1) {
-          // publish encode index
-          MessageBuilder msg;
-          // this is really ugly
-          auto eidx = cam_idx == LOG_CAMERA_ID_DCAMERA ? msg.initEvent().initDriverEncodeIdx() :
-                     (cam_idx == LOG_CAMERA_ID_ECAMERA ? msg.initEvent().initWideRoadEncodeIdx() : msg.initEvent().initRoadEncodeIdx());
-          eidx.setFrameId(extra.frame_id);
-          eidx.setTimestampSof(extra.timestamp_sof);
-          eidx.setTimestampEof(extra.timestamp_eof);
-          if (Hardware::TICI()) {
-            eidx.setType(cereal::EncodeIndex::Type::FULL_H_E_V_C);
-          } else {
-            eidx.setType(cam_idx == LOG_CAMERA_ID_DCAMERA ? cereal::EncodeIndex::Type::FRONT : cereal::EncodeIndex::Type::FULL_H_E_V_C);
-          }
-          eidx.setEncodeId(cnt);
-          eidx.setSegmentNum(rotate_state.cur_seg);
-          eidx.setSegmentId(out_id);
-          if (lh) {
-            // TODO: this should read cereal/services.h for qlog decimation
-            auto bytes = msg.toBytes();
-            lh_log(lh, bytes.begin(), bytes.size(), true);
-          }
-        }
+      if (segment) {
+        pipeline->push(buf->y, buf->u, buf->v, extra, cnt, segment);
       }
-
       cnt++;
     }
-
-    if (lh) {
-      lh_close(lh);
-      lh = NULL;
-    }
   }
 
   LOG("encoder destroy");
+  segment.reset();
+  // finishes the queued frames and closes the encoders
+  pipeline.reset();
   for(auto &e : encoders) {
-    e->encoder_close();
     delete e;
   }
 }
 
+// logMonoTime and type of a received event for the log index, read in place from the
+// word aligned arena once for both the rlog and the qlog
+static void event_index(kj::ArrayPtr<const capnp::word> words, uint64_t &mono_time, int &which) {
+  mono_time = 0;
+  which = -1;
+  try {
+    capnp::FlatArrayMessageReader cmsg(words);
+    cereal::Event::Reader event = cmsg.getRoot<cereal::Event>();
+    mono_time = event.getLogMonoTime();
+    which = event.which();
+  } catch (const kj::Exception &e) {
+    LOGE_100("log index: unparsable event of %zu bytes", words.size() * sizeof(capnp::word));
+  }
+}
+
 int clear_locks_fn(const char* fpath, const struct stat *sb, int tyupeflag) {
   const char* dot = strrchr(fpath, '.');
   if (dot && strcmp(dot, ".lock") == 0) {
@@ -352,8 +337,6 @@ int main(int argc, char** argv) {
   params.put("CurrentRoute", s.logger.route_name);
 
   // init encoders
-  pthread_mutex_init(&s.rotate_lock, NULL);
-
   // TODO: create these threads dynamically on frame packet presence
   std::vector<std::thread> encoder_threads;
   encoder_threads.push_back(std::thread(encoder_thread, LOG_CAMERA_ID_FCAMERA));
@@ -370,7 +353,7 @@ int main(int argc, char** argv) {
 
   uint64_t msg_count = 0;
   uint64_t bytes_count = 0;
-  AlignedBuffer aligned_buf;
+  MessageArena arena;
 
   double start_ts = seconds_since_boot();
   double last_rotate_tms = millis_since_boot();
@@ -379,66 +362,67 @@ int main(int argc, char** argv) {
     // TODO: fix msgs from the first poll getting dropped
     // poll for new messages on all sockets
     for (auto sock : poller->poll(1000)) {
+      int fpkt_id = -1;
+      for (int cid = 0; cid <=MAX_CAM_IDX; cid++) {
+        if (sock == s.rotate_state[cid].fpkt_sock) {
+          fpkt_id=cid;
+          break;
+        }
+      }
 
       // drain socket
-      Message * last_msg = nullptr;
       while (!do_exit) {
-        Message * msg = sock->receive(true);
-        if (!msg){
+        arena.clear();
+        int num_msgs = sock->receive_batch(&arena, DRAIN_BATCH_MSGS, DRAIN_BATCH_BYTES);
+        if (num_msgs == 0) {
           break;
         }
-        delete last_msg;
-        last_msg = msg;
 
         QlogState& qs = qlog_states[sock];
-        logger_log(&s.logger, (uint8_t*)msg->getData(), msg->getSize(), qs.counter == 0 && qs.freq != -1);
-        if (qs.freq != -1) {
-          qs.counter = (qs.counter + 1) % qs.freq;
-        }
-
-        bytes_count += msg->getSize();
-        if ((++msg_count % 1000) == 0) {
-          double ts = seconds_since_boot();
-          LOGD("%lu messages, %.2f msg/sec, %.2f KB/sec", msg_count, msg_count * 1.0 / (ts - start_ts), bytes_count * 0.001 / (ts - start_ts));
-        }
-      }
+        for (int i = 0; i < num_msgs; i++) {
+          uint64_t mono_time;
+          int which;
+          event_index(arena.getWords(i), mono_time, which);
+          logger_log(&s.logger, (uint8_t*)arena.getData(i), arena.getSize(i), qs.counter == 0 && qs.freq != -1, mono_time, which);
+          if (qs.freq != -1) {
+            qs.counter = (qs.counter + 1) % qs.freq;
+          }
 
-      if (last_msg) {
-        int fpkt_id = -1;
-        for (int cid = 0; cid <=MAX_CAM_IDX; cid++) {
-          if (sock == s.rotate_state[cid].fpkt_sock) {
-            fpkt_id=cid;
-            break;
+          bytes_count += arena.getSize(i);
+          if ((++msg_count % 1000) == 0) {
+            double ts = seconds_since_boot();
+            LOGD("%lu messages, %.2f msg/sec, %.2f KB/sec", msg_count, msg_count * 1.0 / (ts - start_ts), bytes_count * 0.001 / (ts - start_ts));
           }
         }
+
         if (fpkt_id >= 0) {
           // track camera frames to sync to encoder
-          // only process last frame
-          capnp::FlatArrayMessageReader cmsg(aligned_buf.align(last_msg));
+          // only process last frame of the batch
+          capnp::FlatArrayMessageReader cmsg(arena.getWords(num_msgs - 1));
           cereal::Event::Reader event = cmsg.getRoot<cereal::Event>();
 
           if (fpkt_id == LOG_CAMERA_ID_FCAMERA) {
-            s.rotate_state[fpkt_id].setLogFrameId(event.getRoadCameraState().getFrameId());
+            s.rotate_state[fpkt_id].log_frame_id = event.getRoadCameraState().getFrameId();
           } else if (fpkt_id == LOG_CAMERA_ID_DCAMERA) {
-            s.rotate_state[fpkt_id].setLogFrameId(event.getDriverCameraState().getFrameId());
+            s.rotate_state[fpkt_id].log_frame_id = event.getDriverCameraState().getFrameId();
           } else if (fpkt_id == LOG_CAMERA_ID_ECAMERA) {
-            s.rotate_state[fpkt_id].setLogFrameId(event.getWideRoadCameraState().getFrameId());
+            s.rotate_state[fpkt_id].log_frame_id = event.getWideRoadCameraState().getFrameId();
           }
           last_camera_seen_tms = millis_since_boot();
         }
       }
-      delete last_msg;
     }
 
     bool new_segment = s.logger.part == -1;
+    bool camera_rotation = false;
     if (s.logger.part > -1) {
       double tms = millis_since_boot();
       if (tms - last_camera_seen_tms <= NO_CAMERA_PATIENCE && encoder_threads.size() > 0) {
-        new_segment = true;
+        new_segment = camera_rotation = true;
         for (auto &r : s.rotate_state) {
+          // every camera is in the current segment and has been for long enough
           // this *should* be redundant on tici since all camera frames are synced
-          new_segment &= (((r.stream_frame_id >= r.last_rotate_frame_id + SEGMENT_LENGTH * MAIN_FPS) &&
-                          (!r.should_rotate) && (r.initialized)) ||
+          new_segment &= ((r.epoch == s.epoch && r.stream_frame_id >= r.segment_start_frame_id + SEGMENT_LENGTH * MAIN_FPS) ||
                           (!r.enabled));
           if (!Hardware::TICI()) break; // only look at fcamera frame id if not QCOM2
         }
@@ -452,21 +436,31 @@ int main(int argc, char** argv) {
 
     // rotate to new segment
     if (new_segment) {
-      pthread_mutex_lock(&s.rotate_lock);
       last_rotate_tms = millis_since_boot();
 
-      int err = logger_next(&s.logger, LOG_ROOT.c_str(), s.segment_path, sizeof(s.segment_path), &s.rotate_segment);
+      const uint64_t epoch = s.epoch + 1;
+      SegmentRotation &rot = s.rotations[epoch % ROTATION_SLOTS];
+      int err = logger_next(&s.logger, LOG_ROOT.c_str(), rot.path, sizeof(rot.path), &rot.segment);
       assert(err == 0);
-      LOGW((s.logger.part == 0) ? "logging to %s" : "rotated to %s", s.segment_path);
+      LOGW((s.logger.part == 0) ? "logging to %s" : "rotated to %s", rot.path);
 
-      // rotate encoders
-      for (auto &r : s.rotate_state) r.rotate();
-      pthread_mutex_unlock(&s.rotate_lock);
+      // the encoders switch at the same frame, just past the newest frame any of them
+      // received or was logged. Without cameras they switch at their next frame
+      uint32_t newest_frame_id = 0;
+      for (auto &r : s.rotate_state) {
+        if (r.enabled) newest_frame_id = std::max({newest_frame_id, r.stream_frame_id.load(), r.log_frame_id});
+      }
+      for (int cid = 0; cid < LOG_CAMERA_ID_MAX-1; cid++) {
+        RotateState &r = s.rotate_state[cid];
+        // only the tici cameras are synced
+        const uint32_t frame_id = Hardware::TICI() ? newest_frame_id : std::max(r.stream_frame_id.load(), r.log_frame_id);
+        rot.start_frame_id[cid] = camera_rotation ? frame_id + ROTATE_FRAME_LOOKAHEAD : 0;
+      }
+      s.epoch.store(epoch, std::memory_order_release);
     }
   }
 
   LOGW("closing encoders");
-  for (auto &r : s.rotate_state) r.cancelWait();
   for (auto &t : encoder_threads) t.join();
 
   LOGW("closing logger");
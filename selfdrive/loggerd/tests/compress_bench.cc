@@ -0,0 +1,173 @@
+// Writes a log through each compression setup the way loggerd's main loop does and
+// reports the time spent in write (what stalls draining the sockets), throughput,
+// CPU of the writer thread and of the whole process, and the compression ratio.
+//
+// usage: tests/compress_bench [decompressed rlog] [MB/s, 0 for as fast as possible] [seconds]
+
+#include <sys/resource.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <ctime>
+#include <memory>
+#include <random>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "selfdrive/common/timing.h"
+#include "selfdrive/common/util.h"
+#include "selfdrive/loggerd/compressor.h"
+#include "selfdrive/loggerd/logger.h"
+
+#define BENCH_PATH "/tmp/compress_bench"
+
+struct BenchConfig {
+  const char *name;
+  bool streaming;  // the BZFile loggerd used before
+  LogCompression compression;
+  int threads;
+  bool io;  // written from the log I/O thread
+};
+
+// messages of a loggerd-like mix: mostly small, some large, numbers that change slowly
+static std::vector<std::string> synthetic_msgs() {
+  std::mt19937 rng(42);
+  std::vector<std::string> msgs;
+  for (int i = 0; i < 20000; i++) {
+    size_t size = (i % 100 == 0) ? 20000 : 64 + rng() % 512;
+    std::string msg(size, '\0');
+    for (size_t j = 0; j + 4 <= size; j += 4) {
+      uint32_t v = (j % 16 == 0) ? i : (uint32_t)(j * 31 + (rng() % 4));
+      memcpy(&msg[j], &v, 4);
+    }
+    msgs.push_back(msg);
+  }
+  return msgs;
+}
+
+// split a raw log into its events
+static std::vector<std::string> rlog_msgs(const std::string &path) {
+  std::string data = util::read_file(path);
+  kj::Array<capnp::word> words = kj::heapArray<capnp::word>(data.size() / sizeof(capnp::word));
+  memcpy(words.begin(), data.data(), words.size() * sizeof(capnp::word));
+
+  std::vector<std::string> msgs;
+  kj::ArrayPtr<const capnp::word> remaining = words;
+  while (remaining.size() > 0) {
+    capnp::FlatArrayMessageReader cmsg(remaining, {.traversalLimitInWords = kj::maxValue});
+    const capnp::word *end = cmsg.getEnd();
+    msgs.push_back(std::string((const char *)remaining.begin(), (end - remaining.begin()) * sizeof(capnp::word)));
+    remaining = kj::arrayPtr(end, remaining.end());
+  }
+  return msgs;
+}
+
+static double thread_cpu_seconds() {
+  struct timespec t;
+  clock_gettime(CLOCK_THREAD_CPUTIME_ID, &t);
+  return t.tv_sec + t.tv_nsec * 1e-9;
+}
+
+static double process_cpu_seconds() {
+  struct rusage r;
+  getrusage(RUSAGE_SELF, &r);
+  return r.ru_utime.tv_sec + r.ru_stime.tv_sec + (r.ru_utime.tv_usec + r.ru_stime.tv_usec) * 1e-6;
+}
+
+static double pct(std::vector<uint32_t> &v, double p) {
+  std::sort(v.begin(), v.end());
+  return v.empty() ? 0 : v[std::min(v.size() - 1, (size_t)(p * v.size()))];
+}
+
+static void run(const BenchConfig &config, const std::vector<std::string> &msgs, double rate, double seconds) {
+  std::unique_ptr<LogCompressorPool> pool;
+  if (!config.streaming && config.threads > 0) {
+    pool = std::make_unique<LogCompressorPool>(config.threads, 16);
+  }
+  std::unique_ptr<AsyncLogWriter> io;
+  LogLatencyHistogram io_latency;
+  if (config.io) {
+    io = std::make_unique<AsyncLogWriter>();
+  }
+
+  std::vector<uint32_t> write_ns;
+  write_ns.reserve(msgs.size() * 8);
+  size_t bytes = 0;
+  const double thread_start = thread_cpu_seconds(), process_start = process_cpu_seconds();
+  const uint64_t start = nanos_since_boot();
+  {
+    std::unique_ptr<BZFile> bz_file;
+    std::unique_ptr<CompressedLogFile> file;
+    if (config.streaming) {
+      bz_file = std::make_unique<BZFile>(BENCH_PATH);
+    } else {
+      file = std::make_unique<CompressedLogFile>(BENCH_PATH, config.compression, pool.get(), nullptr, io.get(), &io_latency);
+    }
+
+    for (size_t i = 0; nanos_since_boot() - start < seconds * 1e9; i = (i + 1) % msgs.size()) {
+      if (rate > 0) {
+        // pace the input, like messages arriving on the sockets
+        uint64_t due = start + bytes / rate * 1e9;
+        uint64_t now = nanos_since_boot();
+        if (due > now) {
+          std::this_thread::sleep_for(std::chrono::nanoseconds(due - now));
+        }
+      }
+
+      uint64_t t = nanos_since_boot();
+      if (bz_file) {
+        bz_file->write((void *)msgs[i].data(), msgs[i].size());
+      } else {
+        file->write(msgs[i].data(), msgs[i].size());
+      }
+      write_ns.push_back(nanos_since_boot() - t);
+      bytes += msgs[i].size();
+    }
+  }
+  // includes compressing the tail on close
+  const double elapsed = (nanos_since_boot() - start) * 1e-9;
+  const double thread_cpu = thread_cpu_seconds() - thread_start;
+  pool.reset();
+  const double process_cpu = process_cpu_seconds() - process_start;
+
+  size_t compressed = util::read_file(BENCH_PATH).size();
+  unlink(BENCH_PATH);
+
+  printf("%-16s %10.2f %8.2f %10.1f %10.1f %10.1f %10.1f %10.1f\n", config.name,
+         bytes / elapsed / 1e6, (double)bytes / compressed, thread_cpu / elapsed * 100, process_cpu / elapsed * 100,
+         pct(write_ns, 0.5) / 1e3, pct(write_ns, 0.99) / 1e3, pct(write_ns, 1.0) / 1e3);
+  if (io_latency.count() > 0) {
+    printf("%-16s disk writes %s\n", "", io_latency.to_string().c_str());
+  }
+  fflush(stdout);
+}
+
+int main(int argc, char **argv) {
+  std::vector<std::string> msgs = (argc > 1 && strlen(argv[1]) > 0) ? rlog_msgs(argv[1]) : synthetic_msgs();
+  const double rate = (argc > 2 ? atof(argv[2]) : 0) * 1e6;
+  const double seconds = argc > 3 ? atof(argv[3]) : 10;
+
+  const BenchConfig configs[] = {
+    {"bz2 streaming", true, LogCompression::BZ2, 0, false},
+    {"bz2", false, LogCompression::BZ2, 0, false},
+    {"bz2 2 threads", false, LogCompression::BZ2, 2, false},
+    {"bz2 4 threads", false, LogCompression::BZ2, 4, false},
+    {"bz2 2 thr + io", false, LogCompression::BZ2, 2, true},
+    {"zstd", false, LogCompression::ZSTD, 0, false},
+    {"zstd 2 threads", false, LogCompression::ZSTD, 2, false},
+    {"zstd 2 thr + io", false, LogCompression::ZSTD, 2, true},
+  };
+
+  printf("%zu messages, %s\n", msgs.size(), rate > 0 ? (std::to_string(rate / 1e6) + " MB/s").c_str() : "as fast as possible");
+  printf("%-16s %10s %8s %10s %10s %10s %10s %10s\n", "", "MB/s", "ratio", "writer %", "total %",
+         "write us", "p99 us", "max us");
+  for (auto &config : configs) {
+    run(config, msgs, rate, seconds);
+  }
+  return 0;
+}
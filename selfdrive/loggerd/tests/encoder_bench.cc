@@ -0,0 +1,124 @@
+// Encodes synthetic road camera frames through each software encoder setup and reports
+// the frame rate, the CPU it takes, how many cores that is at the camera's 20 fps,
+// and the bitrate that came out.
+//
+// built with scons --test --av-encoder
+// usage: tests/encoder_bench [frames] [width=1928] [height=1208]
+
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <cstdio>
+#include <cstdlib>
+#include <memory>
+#include <random>
+#include <string>
+#include <vector>
+
+#include "selfdrive/common/timing.h"
+#include "selfdrive/common/util.h"
+#include "selfdrive/loggerd/av_encoder.h"
+#include "selfdrive/loggerd/raw_logger.h"
+
+#define BENCH_PATH "/tmp/encoder_bench"
+#define BENCH_FPS 20
+#define BENCH_BITRATE 10000000
+
+struct BenchConfig {
+  const char *name;
+  bool h265;
+  const char *preset;  // nullptr for the RawLogger
+  const char *threads;
+};
+
+// a pattern that moves every frame over some noise, so neither motion search nor
+// the residual is free
+static std::vector<std::vector<uint8_t>> synthetic_frames(int width, int height, int count) {
+  std::mt19937 rng(42);
+  std::vector<std::vector<uint8_t>> frames;
+  for (int i = 0; i < count; i++) {
+    std::vector<uint8_t> f(width * height * 3 / 2);
+    for (int y = 0; y < height; y++) {
+      for (int x = 0; x < width; x++) {
+        f[y * width + x] = ((x + 4 * i) / 16 + y / 16) % 2 * 128 + y * 64 / height + rng() % 16;
+      }
+    }
+    for (size_t j = width * height; j < f.size(); j++) {
+      f[j] = 128 + rng() % 8;
+    }
+    frames.push_back(std::move(f));
+  }
+  return frames;
+}
+
+static double process_cpu_seconds() {
+  struct rusage r;
+  getrusage(RUSAGE_SELF, &r);
+  return r.ru_utime.tv_sec + r.ru_stime.tv_sec + (r.ru_utime.tv_usec + r.ru_stime.tv_usec) * 1e-6;
+}
+
+static void run(const BenchConfig &config, const std::vector<std::vector<uint8_t>> &frames, int width, int height, int count) {
+  const char *filename = config.h265 ? "fcamera.hevc" : "qcamera.ts";
+  std::unique_ptr<VideoEncoder> encoder;
+  if (config.preset) {
+    setenv(config.h265 ? "LOGGERD_ENCODER_PRESET" : "LOGGERD_QCAM_ENCODER_PRESET", config.preset, 1);
+    setenv(config.h265 ? "LOGGERD_ENCODER_THREADS" : "LOGGERD_QCAM_ENCODER_THREADS", config.threads, 1);
+    if (!AvEncoder::available(config.h265)) {
+      printf("%-22s not available\n", config.name);
+      return;
+    }
+    encoder = std::make_unique<AvEncoder>(filename, width, height, BENCH_FPS, BENCH_BITRATE, config.h265, false);
+  } else {
+    encoder = std::make_unique<RawLogger>(filename, width, height, BENCH_FPS, BENCH_BITRATE, config.h265, false);
+  }
+
+  const double cpu_start = process_cpu_seconds();
+  const uint64_t start = nanos_since_boot();
+  encoder->encoder_open(BENCH_PATH);
+  for (int i = 0; i < count; i++) {
+    const uint8_t *y = frames[i % frames.size()].data();
+    encoder->encode_frame(y, y + width * height, y + width * height * 5 / 4, width, height, i * 1e9 / BENCH_FPS);
+  }
+  // includes flushing the frames still in the encoder
+  encoder->encoder_close();
+  const double elapsed = (nanos_since_boot() - start) * 1e-9;
+  const double cpu = process_cpu_seconds() - cpu_start;
+
+  // the RawLogger writes an mkv next to where the encoder would
+  const std::string path = util::string_format("%s/%s%s", BENCH_PATH, filename, config.preset ? "" : ".mkv");
+  const size_t size = util::read_file(path).size();
+  unlink(path.c_str());
+
+  const double fps = count / elapsed;
+  printf("%-22s %8.1f %8.1f %10.2f %10.2f\n", config.name, fps, cpu / elapsed * 100,
+         cpu / count * BENCH_FPS, size * 8.0 / (count / (double)BENCH_FPS) / 1e6);
+  fflush(stdout);
+}
+
+int main(int argc, char **argv) {
+  const int count = argc > 1 ? atoi(argv[1]) : 200;
+  const int width = argc > 2 ? atoi(argv[2]) : 1928;
+  const int height = argc > 3 ? atoi(argv[3]) : 1208;
+
+  const BenchConfig configs[] = {
+    {"x265 ultrafast", true, "ultrafast", "0"},
+    {"x265 ultrafast 2 thr", true, "ultrafast", "2"},
+    {"x265 ultrafast 4 thr", true, "ultrafast", "4"},
+    {"x265 superfast", true, "superfast", "0"},
+    {"x264 veryfast", false, "veryfast", "0"},
+    {"x264 veryfast 2 thr", false, "veryfast", "2"},
+    {"raw ffvhuff", true, nullptr, nullptr},
+  };
+
+  mkdir(BENCH_PATH, 0775);
+  // a second of distinct frames, looped
+  auto frames = synthetic_frames(width, height, BENCH_FPS);
+
+  printf("%d frames of %dx%d, %d cores\n", count, width, height, (int)sysconf(_SC_NPROCESSORS_ONLN));
+  printf("%-22s %8s %8s %10s %10s\n", "", "fps", "cpu %", "cores@20", "Mbit/s");
+  for (auto &config : configs) {
+    run(config, frames, width, height, count);
+  }
+  return 0;
+}
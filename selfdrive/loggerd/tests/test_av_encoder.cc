@@ -0,0 +1,116 @@
+#define CATCH_CONFIG_MAIN
+#include "catch2/catch.hpp"
+
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <string>
+#include <vector>
+
+extern "C" {
+#include <libavcodec/avcodec.h>
+#include <libavformat/avformat.h>
+}
+
+#include "selfdrive/common/util.h"
+#include "selfdrive/loggerd/av_encoder.h"
+
+#define TEST_PATH "/tmp/test_av_encoder"
+#define WIDTH 320
+#define HEIGHT 240
+#define FPS 20
+#define FRAMES 50
+
+struct ReadBack {
+  AVCodecID codec_id;
+  int width, height;
+  int frames;
+};
+
+// demuxes and decodes the whole file
+static ReadBack read_back(const std::string &path) {
+  ReadBack r = {};
+  AVFormatContext *format_ctx = NULL;
+  REQUIRE(avformat_open_input(&format_ctx, path.c_str(), NULL, NULL) == 0);
+  REQUIRE(avformat_find_stream_info(format_ctx, NULL) >= 0);
+  REQUIRE(format_ctx->nb_streams == 1);
+  AVCodecParameters *par = format_ctx->streams[0]->codecpar;
+  r.codec_id = par->codec_id;
+  r.width = par->width;
+  r.height = par->height;
+
+  AVCodec *codec = avcodec_find_decoder(par->codec_id);
+  REQUIRE(codec != NULL);
+  AVCodecContext *codec_ctx = avcodec_alloc_context3(codec);
+  REQUIRE(avcodec_parameters_to_context(codec_ctx, par) >= 0);
+  REQUIRE(avcodec_open2(codec_ctx, codec, NULL) == 0);
+
+  AVPacket *pkt = av_packet_alloc();
+  AVFrame *frame = av_frame_alloc();
+  while (av_read_frame(format_ctx, pkt) == 0) {
+    REQUIRE(avcodec_send_packet(codec_ctx, pkt) == 0);
+    av_packet_unref(pkt);
+    while (avcodec_receive_frame(codec_ctx, frame) == 0) r.frames++;
+  }
+  avcodec_send_packet(codec_ctx, NULL);
+  while (avcodec_receive_frame(codec_ctx, frame) == 0) r.frames++;
+
+  av_frame_free(&frame);
+  av_packet_free(&pkt);
+  avcodec_free_context(&codec_ctx);
+  avformat_close_input(&format_ctx);
+  return r;
+}
+
+// encodes two files with the same encoder, like two segments, and decodes them again
+static void test_round_trip(const char *filename, bool h265, bool downscale, AVCodecID codec_id) {
+  if (!AvEncoder::available(h265)) {
+    WARN("libavcodec has no " << (h265 ? "HEVC" : "H.264") << " encoder, skipping");
+    return;
+  }
+
+  // qcamera is downscaled from the full camera size
+  const int in_width = downscale ? WIDTH * 2 : WIDTH;
+  const int in_height = downscale ? HEIGHT * 2 : HEIGHT;
+  std::vector<uint8_t> buf(in_width * in_height * 3 / 2, 128);
+  uint8_t *y = buf.data(), *u = y + in_width * in_height, *v = u + in_width * in_height / 4;
+
+  mkdir(TEST_PATH, 0775);
+  AvEncoder encoder(filename, WIDTH, HEIGHT, FPS, 1000000, h265, downscale);
+  for (int segment = 0; segment < 2; segment++) {
+    const std::string dir = util::string_format("%s/%d", TEST_PATH, segment);
+    const std::string path = dir + "/" + filename;
+    mkdir(dir.c_str(), 0775);
+
+    encoder.encoder_open(dir.c_str());
+    REQUIRE(util::file_exists(path + ".lock"));
+    for (int i = 0; i < FRAMES; i++) {
+      // a pattern that moves every frame
+      for (int j = 0; j < in_width * in_height; j++) {
+        y[j] = (j % in_width + j / in_width + i * 4) & 0xff;
+      }
+      REQUIRE(encoder.encode_frame(y, u, v, in_width, in_height, i * 1e9 / FPS) == i);
+    }
+    encoder.encoder_close();
+    REQUIRE(!util::file_exists(path + ".lock"));
+
+    // every frame flushed out of the encoder's threads is in the file
+    ReadBack r = read_back(path);
+    REQUIRE(r.codec_id == codec_id);
+    REQUIRE(r.width == WIDTH);
+    REQUIRE(r.height == HEIGHT);
+    REQUIRE(r.frames == FRAMES);
+
+    unlink(path.c_str());
+    rmdir(dir.c_str());
+  }
+  rmdir(TEST_PATH);
+}
+
+TEST_CASE("AvEncoder HEVC round trip") {
+  test_round_trip("fcamera.hevc", true, false, AV_CODEC_ID_HEVC);
+}
+
+TEST_CASE("AvEncoder qcamera round trip") {
+  test_round_trip("qcamera.ts", false, true, AV_CODEC_ID_H264);
+}
@@ -0,0 +1,179 @@
+#define CATCH_CONFIG_MAIN
+#include "catch2/catch.hpp"
+
+#include <bzlib.h>
+#include <zstd.h>
+
+#include <cstring>
+#include <random>
+#include <string>
+
+#include "selfdrive/common/util.h"
+#include "selfdrive/loggerd/compressor.h"
+
+static std::string decompress_bz2(const std::string &in) {
+  std::string out;
+  bz_stream strm = {};
+  REQUIRE(BZ2_bzDecompressInit(&strm, 0, 0) == BZ_OK);
+  strm.next_in = (char *)in.data();
+  strm.avail_in = in.size();
+
+  char buf[64 * 1024];
+  while (strm.avail_in > 0) {
+    strm.next_out = buf;
+    strm.avail_out = sizeof(buf);
+    int ret = BZ2_bzDecompress(&strm);
+    REQUIRE((ret == BZ_OK || ret == BZ_STREAM_END));
+    out.append(buf, sizeof(buf) - strm.avail_out);
+    if (ret == BZ_STREAM_END) {
+      // concatenated stream, start over
+      BZ2_bzDecompressEnd(&strm);
+      char *next_in = strm.next_in;
+      unsigned int avail_in = strm.avail_in;
+      strm = {};
+      REQUIRE(BZ2_bzDecompressInit(&strm, 0, 0) == BZ_OK);
+      strm.next_in = next_in;
+      strm.avail_in = avail_in;
+    }
+  }
+  BZ2_bzDecompressEnd(&strm);
+  return out;
+}
+
+// decompresses every frame and checks them against the seek table at the end
+static std::string decompress_zstd(const std::string &in) {
+  uint32_t footer[2];
+  REQUIRE(in.size() >= 9);
+  memcpy(&footer[0], &in[in.size() - 9], 4);
+  memcpy(&footer[1], &in[in.size() - 4], 4);
+  REQUIRE(footer[1] == ZSTD_SEEKABLE_MAGIC);
+  REQUIRE(in[in.size() - 5] == 0);
+
+  const uint32_t num_frames = footer[0];
+  const size_t table_start = in.size() - 9 - num_frames * 8 - 8;
+  uint32_t header[2];
+  memcpy(header, &in[table_start], sizeof(header));
+  REQUIRE(header[0] == ZSTD_SEEKABLE_SKIPPABLE_MAGIC);
+  REQUIRE(header[1] == num_frames * 8 + 9);
+
+  std::string out;
+  size_t offset = 0;
+  ZSTD_DCtx *dctx = ZSTD_createDCtx();
+  for (uint32_t i = 0; i < num_frames; i++) {
+    uint32_t entry[2];
+    memcpy(entry, &in[table_start + 8 + i * 8], sizeof(entry));
+    std::string frame(entry[1], '\0');
+    size_t rc = ZSTD_decompressDCtx(dctx, frame.data(), frame.size(), &in[offset], entry[0]);
+    REQUIRE(!ZSTD_isError(rc));
+    REQUIRE(rc == entry[1]);
+    out += frame;
+    offset += entry[0];
+  }
+  ZSTD_freeDCtx(dctx);
+  REQUIRE(offset == table_start);
+  return out;
+}
+
+static void test_roundtrip(LogCompression compression, LogCompressorPool *pool, AsyncLogWriter *io = nullptr) {
+  std::mt19937 rng(1234);
+  std::string expected;
+  const std::string path = "/tmp/test_compressor." + std::string(log_compression_ext(compression));
+  {
+    CompressedLogFile f(path.c_str(), compression, pool, nullptr, io);
+    // compressible messages of random sizes, crossing block boundaries
+    for (int i = 0; i < 20000; i++) {
+      std::string msg(std::uniform_int_distribution<int>(1, 1000)(rng), 'a' + i % 26);
+      for (int j = 0; j < msg.size(); j += 7) msg[j] = rng();
+      f.write(msg.data(), msg.size());
+      expected += msg;
+    }
+    // one write larger than a block
+    std::string big(3 * LOG_BZ2_BLOCK_SIZE / 2, 'z');
+    f.write(big.data(), big.size());
+    expected += big;
+  }
+
+  std::string compressed = util::read_file(path);
+  REQUIRE(compressed.size() < expected.size());
+  std::string out = compression == LogCompression::ZSTD ? decompress_zstd(compressed) : decompress_bz2(compressed);
+  REQUIRE(out.size() == expected.size());
+  REQUIRE(out == expected);
+  unlink(path.c_str());
+}
+
+TEST_CASE("CompressedLogFile bz2 roundtrip") {
+  SECTION("caller's thread") {
+    test_roundtrip(LogCompression::BZ2, nullptr);
+  }
+  SECTION("thread pool") {
+    LogCompressorPool pool(3, 2);
+    test_roundtrip(LogCompression::BZ2, &pool);
+  }
+  SECTION("thread pool and io thread") {
+    LogCompressorPool pool(3, 2);
+    AsyncLogWriter io;
+    test_roundtrip(LogCompression::BZ2, &pool, &io);
+  }
+}
+
+TEST_CASE("CompressedLogFile zstd roundtrip with seek table") {
+  SECTION("caller's thread") {
+    test_roundtrip(LogCompression::ZSTD, nullptr);
+  }
+  SECTION("thread pool") {
+    LogCompressorPool pool(3, 2);
+    test_roundtrip(LogCompression::ZSTD, &pool);
+  }
+  SECTION("thread pool and io thread") {
+    LogCompressorPool pool(3, 2);
+    AsyncLogWriter io;
+    test_roundtrip(LogCompression::ZSTD, &pool, &io);
+  }
+}
+
+TEST_CASE("CompressedLogFile files share a pool") {
+  LogCompressorPool pool(2, 4);
+  std::string expected;
+  {
+    CompressedLogFile a("/tmp/test_compressor_a.zst", LogCompression::ZSTD, &pool);
+    CompressedLogFile b("/tmp/test_compressor_b.bz2", LogCompression::BZ2, &pool);
+    for (int i = 0; i < 100000; i++) {
+      std::string msg = "message " + std::to_string(i) + "\n";
+      a.write(msg.data(), msg.size());
+      b.write(msg.data(), msg.size());
+      expected += msg;
+    }
+  }
+  REQUIRE(decompress_zstd(util::read_file("/tmp/test_compressor_a.zst")) == expected);
+  REQUIRE(decompress_bz2(util::read_file("/tmp/test_compressor_b.bz2")) == expected);
+  unlink("/tmp/test_compressor_a.zst");
+  unlink("/tmp/test_compressor_b.bz2");
+}
+
+TEST_CASE("log_decompress") {
+  std::string expected;
+  for (int i = 0; i < 200000; i++) {
+    expected += "message " + std::to_string(i) + "\n";
+  }
+  for (auto compression : {LogCompression::BZ2, LogCompression::ZSTD}) {
+    const std::string path = "/tmp/test_compressor." + std::string(log_compression_ext(compression));
+    {
+      CompressedLogFile f(path.c_str(), compression);
+      f.write(expected.data(), expected.size() / 2);
+      f.write(expected.data() + expected.size() / 2, expected.size() - expected.size() / 2);
+    }
+    std::string compressed = util::read_file(path);
+    std::string out;
+    REQUIRE(log_decompress(compressed.data(), compressed.size(), out));
+    REQUIRE(out == expected);
+
+    // truncated
+    out.clear();
+    REQUIRE(!log_decompress(compressed.data(), compressed.size() / 2, out));
+    unlink(path.c_str());
+  }
+
+  std::string out;
+  REQUIRE(log_decompress(expected.data(), expected.size(), out));
+  REQUIRE(out == expected);
+}
@@ -0,0 +1,134 @@
+#define CATCH_CONFIG_MAIN
+#include "catch2/catch.hpp"
+
+#include <atomic>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#include "selfdrive/common/util.h"
+#include "selfdrive/loggerd/encoder_pipeline.h"
+
+#define WIDTH 64
+#define HEIGHT 32
+
+struct EncodedFrame {
+  std::string path;
+  uint8_t y, u, v;
+  uint64_t ts;
+};
+
+class TestEncoder : public VideoEncoder {
+ public:
+  TestEncoder(int delay_ms = 0) : delay_ms(delay_ms) {}
+  int encode_frame(const uint8_t *y_ptr, const uint8_t *u_ptr, const uint8_t *v_ptr,
+                   int in_width, int in_height, uint64_t ts) {
+    while (blocked) util::sleep_for(1);
+    util::sleep_for(delay_ms);
+    if (!is_open || in_width != WIDTH || in_height != HEIGHT) errors++;
+    encoded.push_back({path, y_ptr[WIDTH * HEIGHT - 1], u_ptr[WIDTH * HEIGHT / 4 - 1], v_ptr[WIDTH * HEIGHT / 4 - 1], ts});
+    num_encoded++;
+    return counter++;
+  }
+  void encoder_open(const char *p) {
+    if (is_open) errors++;
+    is_open = true;
+    path = p;
+    counter = 0;
+    opens++;
+  }
+  void encoder_close() {
+    if (!is_open) errors++;
+    is_open = false;
+  }
+
+  const int delay_ms;
+  std::atomic<bool> blocked = false;
+  std::atomic<int> num_encoded = 0;
+  bool is_open = false;
+  std::string path;
+  int counter = 0, opens = 0, errors = 0;
+  std::vector<EncodedFrame> encoded;
+};
+
+static bool push_frame(EncoderPipeline &pipeline, uint8_t i, std::shared_ptr<EncoderSegment> segment) {
+  std::vector<uint8_t> y(WIDTH * HEIGHT, i), u(WIDTH * HEIGHT / 4, i + 1), v(WIDTH * HEIGHT / 4, i + 2);
+  VisionIpcBufExtra extra = {.frame_id = i, .timestamp_eof = 1000ULL * i};
+  return pipeline.push(y.data(), u.data(), v.data(), extra, i, segment);
+}
+
+TEST_CASE("EncoderPipeline encodes every frame in order") {
+  TestEncoder main_encoder(1), qcam_encoder;
+  std::mutex lock;
+  std::vector<std::pair<int, int>> callbacks;  // encode id, out id
+  {
+    EncoderPipeline pipeline("test", {&main_encoder, &qcam_encoder}, WIDTH, HEIGHT,
+                             [&](int encoder_idx, const EncoderFrame &frame, int out_id) {
+      std::unique_lock lk(lock);
+      callbacks.push_back({frame.encode_id, out_id});
+    });
+
+    auto seg0 = std::make_shared<EncoderSegment>(0, "/tmp/seg--0", nullptr);
+    auto seg1 = std::make_shared<EncoderSegment>(1, "/tmp/seg--1", nullptr);
+    for (int i = 0; i < 20; i++) {
+      // the main encoder is slower than frames come in, its queue fills up without overflowing
+      while (main_encoder.num_encoded < i - ENCODER_QUEUE_SIZE + 2) util::sleep_for(1);
+      REQUIRE(push_frame(pipeline, i, i < 10 ? seg0 : seg1));
+    }
+  }
+
+  // checked once the pipeline joined the encoders' threads
+  for (auto e : {&main_encoder, &qcam_encoder}) {
+    REQUIRE(e->errors == 0);
+    REQUIRE(!e->is_open);
+    REQUIRE(e->opens == 2);
+    REQUIRE(e->encoded.size() == 20);
+    for (int i = 0; i < 20; i++) {
+      auto &f = e->encoded[i];
+      REQUIRE(f.path == (i < 10 ? "/tmp/seg--0" : "/tmp/seg--1"));
+      REQUIRE((f.y == i && f.u == i + 1 && f.v == i + 2));
+      REQUIRE(f.ts == 1000ULL * i);
+    }
+  }
+  REQUIRE(callbacks.size() == 40);
+  for (auto [encode_id, out_id] : callbacks) {
+    REQUIRE(out_id == encode_id % 10);
+  }
+}
+
+TEST_CASE("EncoderPipeline keeps the other encoders going when one is stuck") {
+  TestEncoder main_encoder, qcam_encoder;
+  const int num_frames = ENCODER_QUEUE_SIZE * 3;
+  {
+    EncoderPipeline pipeline("test", {&main_encoder, &qcam_encoder}, WIDTH, HEIGHT);
+    auto seg = std::make_shared<EncoderSegment>(0, "/tmp/seg--0", nullptr);
+
+    // a stuck qcamera encoder fills its queue and drops the rest
+    qcam_encoder.blocked = true;
+    for (int i = 0; i < num_frames; i++) {
+      REQUIRE(push_frame(pipeline, i, seg) == (i < ENCODER_QUEUE_SIZE));
+      while (main_encoder.num_encoded <= i) util::sleep_for(1);
+    }
+
+    std::string stats = pipeline.stats();
+    INFO(stats);
+    REQUIRE(stats.find(util::string_format("test: %d frames", num_frames)) != std::string::npos);
+    REQUIRE(stats.find("encoder 0: 0 dropped") != std::string::npos);
+    REQUIRE(stats.find(util::string_format("encoder 1: %d dropped, max queued %d", num_frames - ENCODER_QUEUE_SIZE,
+                                           ENCODER_QUEUE_SIZE)) != std::string::npos);
+
+    // once it catches up it gets new frames again
+    qcam_encoder.blocked = false;
+    while (qcam_encoder.num_encoded < ENCODER_QUEUE_SIZE) util::sleep_for(1);
+    REQUIRE(push_frame(pipeline, num_frames, seg));
+  }
+
+  REQUIRE(main_encoder.errors == 0);
+  REQUIRE(main_encoder.encoded.size() == num_frames + 1);
+  for (int i = 0; i <= num_frames; i++) {
+    REQUIRE(main_encoder.encoded[i].y == i);
+  }
+  REQUIRE(qcam_encoder.errors == 0);
+  REQUIRE(qcam_encoder.encoded.size() == ENCODER_QUEUE_SIZE + 1);
+  REQUIRE(qcam_encoder.encoded.back().y == num_frames);
+}
@@ -0,0 +1,158 @@
+#define CATCH_CONFIG_MAIN
+#include "catch2/catch.hpp"
+
+#include <unistd.h>
+
+#include <string>
+#include <vector>
+
+#include "cereal/messaging/messaging.h"
+#include "selfdrive/common/util.h"
+#include "selfdrive/loggerd/compressor.h"
+#include "selfdrive/loggerd/log_index.h"
+
+#define TEST_EVENTS 50000
+#define TEST_DT 1000000ULL  // 1 ms between events
+
+// can on every event, a carState every 10th and a sentinel every 1000th
+static void write_log(const char *path, LogCompression compression, LogCompressorPool *pool) {
+  const std::string index_path = std::string(path) + LOG_INDEX_EXT;
+  CompressedLogFile f(path, compression, pool, index_path.c_str());
+  for (int i = 0; i < TEST_EVENTS; i++) {
+    MessageBuilder msg;
+    auto event = msg.initEvent();
+    event.setLogMonoTime(i * TEST_DT);
+    if (i % 1000 == 0) {
+      event.initSentinel().setSignal(i);
+    } else if (i % 10 == 0) {
+      event.initCarState().setVEgo(i);
+    } else {
+      auto can = event.initCan(4);
+      for (int j = 0; j < can.size(); j++) {
+        uint32_t dat[2] = {(uint32_t)i, (uint32_t)j};
+        can[j].setAddress(0x100 + j);
+        can[j].setDat(kj::arrayPtr((uint8_t *)dat, sizeof(dat)));
+      }
+    }
+    auto bytes = msg.toBytes();
+    f.write_event(bytes.begin(), bytes.size(), event.getLogMonoTime(), event.which());
+  }
+}
+
+static std::vector<uint64_t> read_times(SeekableLogReader &reader) {
+  std::vector<uint64_t> times;
+  cereal::Event::Reader event;
+  while (reader.next(event)) {
+    times.push_back(event.getLogMonoTime());
+  }
+  return times;
+}
+
+static void test_reader(LogCompression compression, LogCompressorPool *pool) {
+  const std::string path = "/tmp/test_log_index." + std::string(log_compression_ext(compression));
+  write_log(path.c_str(), compression, pool);
+
+  SeekableLogReader reader;
+  REQUIRE(reader.load(path));
+  REQUIRE(reader.indexed());
+  const size_t num_blocks = reader.blocks().size();
+  REQUIRE(num_blocks > 4);
+
+  uint64_t raw_offset = 0, num_events = 0;
+  for (auto &b : reader.blocks()) {
+    REQUIRE(b.raw_offset == raw_offset);
+    REQUIRE(b.min_mono_time <= b.max_mono_time);
+    REQUIRE(b.has_service(cereal::Event::CAN));
+    raw_offset += b.raw_size;
+    num_events += b.num_events;
+  }
+  REQUIRE(num_events == TEST_EVENTS);
+
+  SECTION("everything") {
+    std::vector<uint64_t> times = read_times(reader);
+    REQUIRE(times.size() == TEST_EVENTS);
+    for (int i = 0; i < TEST_EVENTS; i++) {
+      REQUIRE(times[i] == i * TEST_DT);
+    }
+    REQUIRE(reader.blocks_decompressed == num_blocks);
+  }
+
+  SECTION("seek") {
+    const int start = TEST_EVENTS * 3 / 4 + 123;
+    reader.seek(start * TEST_DT);
+    std::vector<uint64_t> times = read_times(reader);
+    REQUIRE(times.size() == TEST_EVENTS - start);
+    REQUIRE(times[0] == start * TEST_DT);
+    REQUIRE(reader.blocks_decompressed < num_blocks / 2);
+
+    // back to the start
+    reader.seek(0);
+    REQUIRE(read_times(reader).size() == TEST_EVENTS);
+  }
+
+  SECTION("services") {
+    reader.set_services({cereal::Event::SENTINEL});
+    cereal::Event::Reader event;
+    int count = 0;
+    while (reader.next(event)) {
+      REQUIRE(event.which() == cereal::Event::SENTINEL);
+      REQUIRE(event.getSentinel().getSignal() == count * 1000);
+      count++;
+    }
+    REQUIRE(count == TEST_EVENTS / 1000);
+
+    reader.set_services({cereal::Event::CAR_STATE, cereal::Event::SENTINEL});
+    reader.seek(TEST_EVENTS / 2 * TEST_DT);
+    REQUIRE(read_times(reader).size() == TEST_EVENTS / 2 / 10);
+  }
+
+  unlink(path.c_str());
+  unlink((path + LOG_INDEX_EXT).c_str());
+}
+
+TEST_CASE("SeekableLogReader zstd") {
+  LogCompressorPool pool(2, 4);
+  test_reader(LogCompression::ZSTD, &pool);
+}
+
+TEST_CASE("SeekableLogReader bz2") {
+  test_reader(LogCompression::BZ2, nullptr);
+}
+
+TEST_CASE("SeekableLogReader without an index") {
+  const char *path = "/tmp/test_log_index_noidx.zst";
+  write_log(path, LogCompression::ZSTD, nullptr);
+  unlink((std::string(path) + LOG_INDEX_EXT).c_str());
+
+  SeekableLogReader reader;
+  REQUIRE(reader.load(path));
+  REQUIRE(!reader.indexed());
+  reader.seek(TEST_EVENTS / 2 * TEST_DT);
+  REQUIRE(read_times(reader).size() == TEST_EVENTS / 2);
+  REQUIRE(reader.blocks_decompressed == 1);
+  unlink(path);
+}
+
+TEST_CASE("SeekableLogReader with a partial index") {
+  const std::string path = "/tmp/test_log_index_partial.zst";
+  const std::string index_path = path + LOG_INDEX_EXT;
+  write_log(path.c_str(), LogCompression::ZSTD, nullptr);
+
+  // as if loggerd died with only the first two entries written
+  REQUIRE(truncate(index_path.c_str(), sizeof(LogIndexHeader) + 2 * sizeof(LogIndexBlock)) == 0);
+  std::string data = util::read_file(path);
+  const uint32_t seek_table_size = *(uint32_t *)(data.data() + data.size() - 9) * 8 + 9 + 8;
+  REQUIRE(truncate(path.c_str(), data.size() - seek_table_size) == 0);
+
+  SeekableLogReader reader;
+  REQUIRE(reader.load(path));
+  REQUIRE(reader.indexed());
+  REQUIRE(reader.blocks().size() == 3);
+  REQUIRE(reader.blocks().back().max_mono_time == UINT64_MAX);
+
+  std::vector<uint64_t> times = read_times(reader);
+  REQUIRE(times.size() == TEST_EVENTS);
+  REQUIRE(times.back() == (TEST_EVENTS - 1) * TEST_DT);
+  unlink(path.c_str());
+  unlink(index_path.c_str());
+}
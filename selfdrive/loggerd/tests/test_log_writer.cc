@@ -0,0 +1,104 @@
+#define CATCH_CONFIG_MAIN
+#include "catch2/catch.hpp"
+
+#include <unistd.h>
+
+#include <memory>
+#include <random>
+#include <string>
+
+#include "selfdrive/common/util.h"
+#include "selfdrive/loggerd/log_writer.h"
+
+static void test_log_file(AsyncLogWriter *io, bool direct) {
+  const char *path = "/tmp/test_log_writer.log";
+  std::mt19937 rng(1234);
+  std::string expected;
+  LogLatencyHistogram latency;
+  {
+    LogFile f(io, path, direct, &latency);
+    // writes of random sizes, some larger than a chunk
+    for (int i = 0; i < 300; i++) {
+      size_t size = (i % 50 == 0) ? 3 * LOG_WRITE_CHUNK_SIZE / 2 : rng() % 50000;
+      std::string data(size, '\0');
+      for (auto &c : data) c = rng();
+      f.write(data.data(), data.size());
+      expected += data;
+      if (!direct && i % 10 == 0) {
+        f.flush();
+      }
+    }
+  }
+  std::string out = util::read_file(path);
+  REQUIRE(out.size() == expected.size());
+  REQUIRE(out == expected);
+  REQUIRE(latency.count() >= expected.size() / LOG_WRITE_CHUNK_SIZE);
+  unlink(path);
+}
+
+TEST_CASE("LogFile") {
+  SECTION("caller's thread") {
+    test_log_file(nullptr, false);
+    test_log_file(nullptr, true);
+  }
+  SECTION("io thread, pwrite") {
+    AsyncLogWriter io(false);
+    test_log_file(&io, false);
+    test_log_file(&io, true);
+  }
+  SECTION("io thread, io_uring if available") {
+    AsyncLogWriter io(true);
+    test_log_file(&io, false);
+    test_log_file(&io, true);
+  }
+}
+
+TEST_CASE("LogFile flush") {
+  const char *path = "/tmp/test_log_writer_flush.log";
+  AsyncLogWriter io;
+  LogFile f(&io, path, false);
+  f.write("hello", 5);
+  io.run([] {}).wait();
+  REQUIRE(util::read_file(path).empty());
+
+  f.flush();
+  io.run([] {}).wait();
+  REQUIRE(util::read_file(path) == "hello");
+
+  f.write(" world", 6);
+  f.flush();
+  io.run([] {}).wait();
+  REQUIRE(util::read_file(path) == "hello world");
+  unlink(path);
+}
+
+TEST_CASE("AsyncLogWriter runs in order") {
+  AsyncLogWriter io;
+  std::string order;
+  std::future<void> last;
+  for (int i = 0; i < 10; i++) {
+    last = io.run([&order, i] { order += std::to_string(i); });
+  }
+  last.wait();
+  REQUIRE(order == "0123456789");
+}
+
+TEST_CASE("LogLatencyHistogram") {
+  LogLatencyHistogram h;
+  REQUIRE(h.count() == 0);
+  REQUIRE(h.percentile_us(0.5) == 0);
+
+  // 98 fast writes, one slow, one very slow
+  for (int i = 0; i < 98; i++) {
+    h.add(300 * 1000);
+  }
+  h.add(20 * 1000 * 1000);
+  h.add(100ULL * 1000 * 1000 * 1000);
+  REQUIRE(h.count() == 100);
+  REQUIRE(h.percentile_us(0.5) == 512);
+  REQUIRE(h.percentile_us(0.99) == 32768);
+  REQUIRE(h.percentile_us(1.0) == 100 * 1000 * 1000);
+
+  h.reset();
+  REQUIRE(h.count() == 0);
+}
@@ -71,8 +71,10 @@ class Uploader():
     self.last_filename = ""
 
     self.immediate_folders = ["crash/", "boot/"]
-    self.immediate_priority = {"qlog.bz2": 0, "qcamera.ts": 1}
-    self.high_priority = {"rlog.bz2": 0, "fcamera.hevc": 1, "dcamera.hevc": 2, "ecamera.hevc": 3}
+    # log indexes (.idx) go right after their logs, they are small and make them seekable
+    self.immediate_priority = {"qlog.bz2": 0, "qlog.zst": 0, "qlog.bz2.idx": 1, "qlog.zst.idx": 1, "qcamera.ts": 2}
+    self.high_priority = {"rlog.bz2": 0, "rlog.zst": 0, "rlog.bz2.idx": 1, "rlog.zst.idx": 1,
+                          "fcamera.hevc": 2, "dcamera.hevc": 3, "ecamera.hevc": 4}
 
   def get_upload_sort(self, name):
     if name in self.immediate_priority:
@@ -30,6 +30,9 @@ constexpr int LEAD_MHP_GROUP_SIZE = (2*LEAD_MHP_VALS + LEAD_MHP_SELECTION);
 
 constexpr int POSE_SIZE = 12;
 
+// modelV2 is built in place in the msgq ring, raw predictions are reserved on top
+constexpr size_t MODEL_V2_RESERVE_SIZE = 64 * 1024;
+
 constexpr int PLAN_IDX = 0;
 constexpr int LL_IDX = PLAN_IDX + PLAN_MHP_N*PLAN_MHP_GROUP_SIZE;
 constexpr int LL_PROB_IDX = LL_IDX + 4*2*2*33;
@@ -314,7 +317,8 @@ void model_publish(PubMaster &pm, uint32_t vipc_frame_id, uint32_t frame_id, flo
                    const ModelDataRaw &net_outputs, uint64_t timestamp_eof,
                    float model_execution_time, kj::ArrayPtr<const float> raw_pred) {
   const uint32_t frame_age = (frame_id > vipc_frame_id) ? (frame_id - vipc_frame_id) : 0;
-  MessageBuilder msg;
+  size_t reserve_size = MODEL_V2_RESERVE_SIZE + (send_raw_pred ? raw_pred.asBytes().size() : 0);
+  MessageBuilder &msg = pm.reserve("modelV2", reserve_size);
   auto framed = msg.initEvent().initModelV2();
   framed.setFrameId(vipc_frame_id);
   framed.setFrameAge(frame_age);
@@ -325,7 +329,7 @@ void model_publish(PubMaster &pm, uint32_t vipc_frame_id, uint32_t frame_id, flo
     framed.setRawPredictions(raw_pred.asBytes());
   }
   fill_model(framed, net_outputs);
-  pm.send("modelV2", msg);
+  pm.commit("modelV2");
 }
 
 void posenet_publish(PubMaster &pm, uint32_t vipc_frame_id, uint32_t vipc_dropped_frames,